@@ -0,0 +1,363 @@
+/*
+FILENAME... MD90Autotune.cpp
+USAGE...    I gain autotuning for the DSM MD-90 controller.
+
+The MD-90 closes the loop with an integral-only controller whose gain is set
+with SGN (1-1000).  Settle time depends strongly on the gain, so the autotune
+routine makes a bounded set of small closed loop step moves, forward and back,
+at each candidate gain.  It measures settle time and overshoot from timestamped
+GEC samples and applies the gain that settles fastest.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include <iocsh.h>
+#include <epicsThread.h>
+#include <epicsStdio.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+
+#define NINT(f) (int)((f)>0 ? (f)+0.5 : (f)-0.5)
+
+/** One timestamped encoder sample of an autotune step move */
+struct MD90StepSample {
+  double time;                  /**< Seconds since the step move was started */
+  double position;              /**< Encoder position (counts) */
+};
+
+void MD90AutotuneThreadC(void *pPvt)
+{
+  MD90Axis *pAxis = (MD90Axis *)pPvt;
+  pAxis->autotune();
+}
+
+/** Start the autotune thread for this axis.  Called with the controller locked.
+  * Refused while the axis is moving, jogging, homing or coupled. */
+asynStatus MD90Axis::startAutotune()
+{
+  char threadName[64];
+  static const char *functionName = "MD90Axis::startAutotune";
+
+  if (autotuneActive_) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: autotune already running\n", functionName);
+    return asynError;
+  }
+  // The step moves would fight a move, jog or home in progress
+  if (lastStatus_ == MD90_STA_MOVING || jogActive_) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: axis is moving\n", functionName);
+    return asynError;
+  }
+  if (checkMoveAllowed(functionName, false)) return asynError;
+  autotuneActive_ = true;
+  autotuneAbort_ = false;
+  setIntegerParam(pC_->MD90Autotune_, 1);
+  setIntegerParam(pC_->MD90AutotuneState_, MD90_AUTOTUNE_RUNNING);
+  callParamCallbacks();
+
+  epicsSnprintf(threadName, sizeof(threadName), "MD90Tune%s:%d", pC_->portName, axisNo_);
+  if (!epicsThreadCreate(threadName, epicsThreadPriorityLow,
+                         epicsThreadGetStackSize(epicsThreadStackMedium),
+                         (EPICSTHREADFUNC)MD90AutotuneThreadC, this)) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: cannot create thread %s\n", functionName, threadName);
+    autotuneActive_ = false;
+    setIntegerParam(pC_->MD90Autotune_, 0);
+    setIntegerParam(pC_->MD90AutotuneState_, MD90_AUTOTUNE_FAILED);
+    callParamCallbacks();
+    return asynError;
+  }
+  return asynSuccess;
+}
+
+/** Make one closed loop step move and measure it.
+  * The controller is locked for each transaction only, so the poller keeps running.
+  * \param[in] target      Absolute target position in encoder counts
+  * \param[in] window      Distance from the target counted as settled (counts)
+  * \param[out] settle     Time from the start of the move until the position stayed inside the window (s)
+  * \param[out] overshoot  Largest excursion past the target (counts)
+  */
+asynStatus MD90Axis::autotuneStep(double target, double window, double *settle, double *overshoot)
+{
+  std::vector<MD90StepSample> samples;
+  MD90StepSample sample;
+  epicsTimeStamp start, now;
+  double status, position, startPosition, direction;
+  double doneTime = -1.;
+  asynStatus comStatus;
+  size_t i, settled;
+  static const char *functionName = "MD90Axis::autotuneStep";
+
+  pC_->lock();
+  comStatus = query("GEC", &startPosition);
+  if (!comStatus) {
+    sprintf(pC_->outString_, "CLM %d", NINT(target * 10));
+    comStatus = pC_->writeReadController();
+  }
+  if (!comStatus) {
+    comStatus = parseReply(functionName, pC_->inString_);
+  }
+  pC_->unlock();
+  if (comStatus) return comStatus;
+  epicsTimeGetCurrent(&start);
+
+  // Sample until the move has completed and the position has been watched for a while
+  while (1) {
+    if (autotuneAbort_) return asynError;
+    pC_->lock();
+    comStatus = query("STA", &status);
+    if (!comStatus) comStatus = query("GEC", &position);
+    pC_->unlock();
+    if (comStatus) return comStatus;
+
+    epicsTimeGetCurrent(&now);
+    sample.time = epicsTimeDiffInSeconds(&now, &start);
+    sample.position = position;
+    samples.push_back(sample);
+
+    switch (NINT(status)) {
+      case 2:  // Move in progress
+      case 6:  // Stance complete, starting extension move
+        break;
+      case MD90_STA_HOMING_ERROR: case MD90_STA_STANCE_ERROR: case MD90_STA_OPEN_LOOP_ERROR:
+      case MD90_STA_CLOSED_LOOP_ERROR: case MD90_STA_END_OF_TRAVEL: case MD90_STA_RAMP_ERROR:
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+          "%s: step move to %f failed: %s\n",
+          functionName, target, md90StatusName(NINT(status)));
+        return asynError;
+      default:
+        if (doneTime < 0.) doneTime = sample.time;
+        break;
+    }
+    if (doneTime >= 0. && sample.time - doneTime >= AUTOTUNE_DWELL) break;
+    if (sample.time > AUTOTUNE_TIMEOUT) {
+      asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+        "%s: step move to %f timed out\n",
+        functionName, target);
+      return asynError;
+    }
+    epicsThreadSleep(AUTOTUNE_SAMPLE_PERIOD);
+  }
+
+  // Settled from the first sample after the last one outside the window
+  direction = (target >= startPosition) ? 1. : -1.;
+  *overshoot = 0.;
+  settled = 0;
+  for (i=0; i<samples.size(); i++) {
+    if ((samples[i].position - target) * direction > *overshoot) {
+      *overshoot = (samples[i].position - target) * direction;
+    }
+    if (fabs(samples[i].position - target) > window) settled = i + 1;
+  }
+  if (settled >= samples.size()) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: position did not settle within %f counts of %f\n",
+      functionName, window, target);
+    return asynError;
+  }
+  *settle = samples[settled].time;
+  return asynSuccess;
+}
+
+/** Body of the autotune thread.
+  * Steps forward by MD90_AUTOTUNE_STEP and back again at each candidate gain, scores each
+  * gain by its mean settle time (overshoot breaks ties) and applies the best one.
+  * The original gain is restored if no candidate succeeds or the autotune is aborted,
+  * unless it could not be read.
+  */
+void MD90Axis::autotune()
+{
+  double step, window, origGain = 0., start;
+  double settle1, settle2, overshoot1, overshoot2, settle, overshoot;
+  double bestSettle = 0., bestOvershoot = 0.;
+  double results[3 * AUTOTUNE_MAX_GAINS];
+  int minGain, maxGain, numGains, gain, bestGain = 0;
+  int i, state, nResults = 0;
+  bool gainRead;
+  asynStatus status;
+  static const char *functionName = "MD90Axis::autotune";
+
+  pC_->lock();
+  pC_->getDoubleParam(axisNo_, pC_->MD90AutotuneStep_, &step);
+  pC_->getDoubleParam(axisNo_, pC_->MD90SettleWindow_, &window);
+  pC_->getIntegerParam(axisNo_, pC_->MD90AutotuneMinGain_, &minGain);
+  pC_->getIntegerParam(axisNo_, pC_->MD90AutotuneMaxGain_, &maxGain);
+  pC_->getIntegerParam(axisNo_, pC_->MD90AutotuneNumGains_, &numGains);
+  status = query("GGN", &origGain);
+  gainRead = (status == asynSuccess);
+  if (!status) status = query("GEC", &start);
+  pC_->unlock();
+
+  if (minGain < 1) minGain = 1;
+  if (maxGain > 1000) maxGain = 1000;
+  if (maxGain < minGain) maxGain = minGain;
+  if (numGains < 1) numGains = 1;
+  if (numGains > AUTOTUNE_MAX_GAINS) numGains = AUTOTUNE_MAX_GAINS;
+
+  for (i=0; !status && i<numGains; i++) {
+    if (autotuneAbort_) break;
+    gain = (numGains > 1) ? NINT(minGain + (double)(maxGain - minGain) * i / (numGains - 1)) : minGain;
+
+    pC_->lock();
+    sprintf(pC_->outString_, "SGN %d", gain);
+    status = pC_->writeReadController();
+    if (!status) status = parseReply(functionName, pC_->inString_);
+    pC_->unlock();
+    if (status) break;
+
+    if (autotuneStep(start + step, window, &settle1, &overshoot1) ||
+        autotuneStep(start, window, &settle2, &overshoot2)) {
+      if (autotuneAbort_) break;
+      asynPrint(pasynUser_, ASYN_TRACE_WARNING,
+        "%s: gain %d rejected\n", functionName, gain);
+      // Return to the start position before trying the next gain
+      pC_->lock();
+      sprintf(pC_->outString_, "CLM %d", NINT(start * 10));
+      status = pC_->writeReadController();
+      if (!status) status = parseReply(functionName, pC_->inString_);
+      pC_->unlock();
+      epicsThreadSleep(AUTOTUNE_DWELL);
+      continue;
+    }
+    settle = (settle1 + settle2) / 2.;
+    overshoot = (overshoot1 > overshoot2) ? overshoot1 : overshoot2;
+    asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+      "%s: gain %d, settle %f s, overshoot %f counts\n",
+      functionName, gain, settle, overshoot);
+
+    results[nResults++] = gain;
+    results[nResults++] = settle;
+    results[nResults++] = overshoot;
+    if (bestGain == 0 || settle < bestSettle ||
+        (settle == bestSettle && overshoot < bestOvershoot)) {
+      bestGain = gain;
+      bestSettle = settle;
+      bestOvershoot = overshoot;
+    }
+  }
+
+  if (autotuneAbort_) {
+    state = MD90_AUTOTUNE_ABORTED;
+  } else if (status || bestGain == 0) {
+    state = MD90_AUTOTUNE_FAILED;
+  } else {
+    state = MD90_AUTOTUNE_DONE;
+  }
+
+  pC_->lock();
+  // The original gain is only written back if it was read
+  if (state == MD90_AUTOTUNE_DONE || gainRead) {
+    sprintf(pC_->outString_, "SGN %d", (state == MD90_AUTOTUNE_DONE) ? bestGain : NINT(origGain));
+    if (!pC_->writeReadController()) {
+      parseReply(functionName, pC_->inString_);
+    }
+  }
+  if (state == MD90_AUTOTUNE_DONE) {
+    setIntegerParam(pC_->MD90AutotuneGain_, bestGain);
+    setDoubleParam(pC_->MD90AutotuneSettle_, bestSettle);
+    setDoubleParam(pC_->MD90AutotuneOvershoot_, bestOvershoot);
+  }
+  pC_->doCallbacksFloat64Array(results, nResults, pC_->MD90AutotuneResults_, axisNo_);
+  setIntegerParam(pC_->MD90AutotuneState_, state);
+  setIntegerParam(pC_->MD90Autotune_, 0);
+  autotuneActive_ = false;
+  callParamCallbacks();
+  pC_->unlock();
+
+  if (state == MD90_AUTOTUNE_DONE) {
+    asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+      "%s: %s axis %d: gain %d, settle %f s, overshoot %f counts\n",
+      functionName, pC_->portName, axisNo_, bestGain, bestSettle, bestOvershoot);
+  } else if (gainRead) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: %s axis %d: autotune %s, gain restored to %d\n",
+      functionName, pC_->portName, axisNo_,
+      (state == MD90_AUTOTUNE_ABORTED) ? "aborted" : "failed", NINT(origGain));
+  } else {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: %s axis %d: autotune %s, cannot read the gain\n",
+      functionName, pC_->portName, axisNo_,
+      (state == MD90_AUTOTUNE_ABORTED) ? "aborted" : "failed");
+  }
+}
+
+/** Sets the autotune parameters of an axis and starts the autotune.
+  * \param[in] axisNo    Axis number
+  * \param[in] step      Size of the step moves in encoder counts, 0 to keep the current setting
+  * \param[in] minGain   Lowest candidate gain (1-1000), 0 to keep the current setting
+  * \param[in] maxGain   Highest candidate gain (1-1000), 0 to keep the current setting
+  * \param[in] numGains  Number of candidate gains, 0 to keep the current setting
+  */
+asynStatus MD90Controller::startAutotune(int axisNo, double step, int minGain, int maxGain, int numGains)
+{
+  MD90Axis *pAxis;
+  asynStatus status;
+
+  pAxis = getAxis(axisNo);
+  if (!pAxis) return asynError;
+  lock();
+  if (step > 0.)    setDoubleParam(axisNo, MD90AutotuneStep_, step);
+  if (minGain > 0)  setIntegerParam(axisNo, MD90AutotuneMinGain_, minGain);
+  if (maxGain > 0)  setIntegerParam(axisNo, MD90AutotuneMaxGain_, maxGain);
+  if (numGains > 0) setIntegerParam(axisNo, MD90AutotuneNumGains_, numGains);
+  status = pAxis->startAutotune();
+  unlock();
+  return status;
+}
+
+/** Runs the I gain autotune on one axis.
+  * Configuration command, called directly or from iocsh
+  * \param[in] portName  The name of the MD90Controller asyn port
+  * \param[in] axis      Axis number
+  * \param[in] step      Size of the step moves in encoder counts, 0 to keep the current setting
+  * \param[in] minGain   Lowest candidate gain (1-1000), 0 to keep the current setting
+  * \param[in] maxGain   Highest candidate gain (1-1000), 0 to keep the current setting
+  * \param[in] numGains  Number of candidate gains, 0 to keep the current setting
+  */
+extern "C" int MD90AutotuneGain(const char *portName, int axis, double step, int minGain, int maxGain, int numGains)
+{
+  MD90Controller *pC;
+  static const char *functionName = "MD90AutotuneGain";
+
+  pC = (MD90Controller*) findAsynPortDriver(portName);
+  if (!pC) {
+    printf("%s: %s: port not found\n", functionName, portName);
+    return asynError;
+  }
+  if (!pC->getAxis(axis)) {
+    printf("%s: %s: invalid axis %d\n", functionName, portName, axis);
+    return asynError;
+  }
+  return pC->startAutotune(axis, step, minGain, maxGain, numGains);
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90AutotuneGainArg0 = {"Port name", iocshArgString};
+static const iocshArg MD90AutotuneGainArg1 = {"Axis number", iocshArgInt};
+static const iocshArg MD90AutotuneGainArg2 = {"Step size (counts)", iocshArgDouble};
+static const iocshArg MD90AutotuneGainArg3 = {"Minimum gain", iocshArgInt};
+static const iocshArg MD90AutotuneGainArg4 = {"Maximum gain", iocshArgInt};
+static const iocshArg MD90AutotuneGainArg5 = {"Number of gains", iocshArgInt};
+static const iocshArg * const MD90AutotuneGainArgs[] = {&MD90AutotuneGainArg0,
+                                                         &MD90AutotuneGainArg1,
+                                                         &MD90AutotuneGainArg2,
+                                                         &MD90AutotuneGainArg3,
+                                                         &MD90AutotuneGainArg4,
+                                                         &MD90AutotuneGainArg5};
+static const iocshFuncDef MD90AutotuneGainDef = {"MD90AutotuneGain", 6, MD90AutotuneGainArgs};
+static void MD90AutotuneGainCallFunc(const iocshArgBuf *args)
+{
+  MD90AutotuneGain(args[0].sval, args[1].ival, args[2].dval, args[3].ival, args[4].ival, args[5].ival);
+}
+
+static void MD90AutotuneRegister(void)
+{
+  iocshRegister(&MD90AutotuneGainDef, MD90AutotuneGainCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90AutotuneRegister);
+}
@@ -0,0 +1,198 @@
+/*
+FILENAME...   MD90Client.cpp
+USAGE...      Asynchronous client for one DSM MD-90 controller, independent of EPICS.
+
+*/
+
+#include "MD90Client.h"
+
+/** Creates a client; the client owns the transport.
+  * \param[in] transport      Connection to the controller, opened by start()
+  * \param[in] pipelineDepth  Largest number of commands written ahead of their replies
+  * \param[in] timeout        Time allowed for each reply (s) */
+MD90Client::MD90Client(MD90Transport *transport, int pipelineDepth, double timeout)
+  : transport_(transport), pipelineDepth_(pipelineDepth < 1 ? 1 : pipelineDepth),
+    timeout_(timeout), running_(false)
+{
+}
+
+MD90Client::~MD90Client()
+{
+  stop();
+}
+
+/** Opens the transport and starts the worker thread */
+bool MD90Client::start()
+{
+  if (running_) return true;
+  if (!transport_->open()) return false;
+  running_ = true;
+  worker_ = std::thread(&MD90Client::run, this);
+  return true;
+}
+
+/** Stops the worker thread; commands still queued fail with MD90_REPLY_NONE */
+void MD90Client::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!running_) return;
+    running_ = false;
+  }
+  wakeup_.notify_all();
+  worker_.join();
+  while (!queue_.empty()) {
+    complete(queue_.front(), MD90Reply());
+    queue_.pop_front();
+  }
+  transport_->close();
+}
+
+void MD90Client::setPipelineDepth(int depth)
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+  pipelineDepth_ = (depth < 1) ? 1 : depth;
+}
+
+/** Queues a command; the future holds the reply.
+  * A command sent while the client is not running fails at once with MD90_REPLY_NONE. */
+std::future<MD90Reply> MD90Client::send(const std::string &command)
+{
+  Request request;
+  std::future<MD90Reply> future;
+
+  request.command = command;
+  request.promise = std::make_shared<std::promise<MD90Reply> >();
+  future = request.promise->get_future();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!running_) {
+      lock.unlock();
+      complete(request, MD90Reply());
+      return future;
+    }
+    queue_.push_back(request);
+  }
+  wakeup_.notify_one();
+  return future;
+}
+
+/** Queues a command; the callback is called with the reply from the worker thread */
+void MD90Client::send(const std::string &command, Callback callback)
+{
+  Request request;
+
+  request.command = command;
+  request.callback = callback;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!running_) {
+      lock.unlock();
+      complete(request, MD90Reply());
+      return;
+    }
+    queue_.push_back(request);
+  }
+  wakeup_.notify_one();
+}
+
+/** Queues several commands together, so that they are pipelined with each other.
+  * The future holds the replies in command order. */
+std::future<std::vector<MD90Reply> > MD90Client::sendBatch(const std::vector<std::string> &commands)
+{
+  struct Batch {
+    std::vector<MD90Reply> replies;
+    size_t remaining;
+    std::promise<std::vector<MD90Reply> > promise;
+  };
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+  std::future<std::vector<MD90Reply> > future = batch->promise.get_future();
+  Request request;
+  size_t i;
+
+  batch->replies.resize(commands.size());
+  batch->remaining = commands.size();
+  if (commands.empty()) {
+    batch->promise.set_value(batch->replies);
+    return future;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!running_) {
+      lock.unlock();
+      batch->promise.set_value(batch->replies);
+      return future;
+    }
+    for (i=0; i<commands.size(); i++) {
+      request.command = commands[i];
+      // Replies arrive in order on the worker thread, so the batch needs no lock of its own
+      request.callback = [batch, i](const MD90Reply &reply) {
+        batch->replies[i] = reply;
+        if (--batch->remaining == 0) batch->promise.set_value(batch->replies);
+      };
+      queue_.push_back(request);
+    }
+  }
+  wakeup_.notify_one();
+  return future;
+}
+
+/** Sends a command and waits for its reply */
+MD90Reply MD90Client::request(const std::string &command)
+{
+  return send(command).get();
+}
+
+void MD90Client::complete(Request &request, const MD90Reply &reply)
+{
+  if (request.promise) request.promise->set_value(reply);
+  if (request.callback) request.callback(reply);
+}
+
+/** Worker thread: writes queued commands up to the pipeline depth, then reads replies in order */
+void MD90Client::run()
+{
+  std::deque<Request> inflight;
+  std::deque<Request> pending;
+  std::string text;
+  MD90Reply reply;
+
+  while (1) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wakeup_.wait(lock, [this, &inflight] { return !running_ || !queue_.empty() || !inflight.empty(); });
+      if (!running_ && inflight.empty()) break;
+      while (running_ && !queue_.empty() && (int)(inflight.size() + pending.size()) < pipelineDepth_) {
+        pending.push_back(queue_.front());
+        queue_.pop_front();
+      }
+    }
+    while (!pending.empty()) {
+      if (transport_->write(pending.front().command)) {
+        inflight.push_back(pending.front());
+      } else {
+        // Nothing was sent; fail this command alone
+        complete(pending.front(), MD90Reply());
+      }
+      pending.pop_front();
+    }
+    if (inflight.empty()) continue;
+
+    if (transport_->readReply(&text, timeout_)) {
+      if (!md90ParseReply(text.c_str(), &reply)) {
+        reply = MD90Reply();
+        reply.text = text;
+      }
+      complete(inflight.front(), reply);
+      inflight.pop_front();
+    } else {
+      // A lost reply breaks the pairing of later replies with their commands: fail everything
+      // written, and drop any late input
+      while (!inflight.empty()) {
+        complete(inflight.front(), MD90Reply());
+        inflight.pop_front();
+      }
+      transport_->flush();
+    }
+  }
+}
@@ -0,0 +1,64 @@
+/*
+FILENAME...   MD90Client.h
+USAGE...      Asynchronous client for one DSM MD-90 controller, independent of EPICS.
+
+*/
+
+#ifndef MD90Client_H
+#define MD90Client_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "MD90Protocol.h"
+#include "MD90Transport.h"
+
+#define MD90_CLIENT_TIMEOUT   1.0   // Default time allowed for each reply (s)
+
+/** Sends commands to one controller from a worker thread and hands back the replies.
+  * The MD-90 answers each command in order, so up to pipelineDepth commands may be
+  * written before the first reply is read.  A depth of 1 waits for each reply before
+  * the next command, as the EPICS driver does. */
+class MD90Client {
+public:
+  typedef std::function<void(const MD90Reply &)> Callback;
+
+  MD90Client(MD90Transport *transport, int pipelineDepth = 1, double timeout = MD90_CLIENT_TIMEOUT);
+  ~MD90Client();
+  bool start();
+  void stop();
+  std::future<MD90Reply> send(const std::string &command);
+  void send(const std::string &command, Callback callback);
+  std::future<std::vector<MD90Reply> > sendBatch(const std::vector<std::string> &commands);
+  MD90Reply request(const std::string &command);
+  void setPipelineDepth(int depth);
+  int pipelineDepth() const { return pipelineDepth_; }
+  MD90Transport *transport() { return transport_.get(); }
+
+private:
+  struct Request {
+    std::string command;
+    std::shared_ptr<std::promise<MD90Reply> > promise;
+    Callback callback;
+  };
+  void run();
+  void complete(Request &request, const MD90Reply &reply);
+
+  std::unique_ptr<MD90Transport> transport_;
+  int pipelineDepth_;
+  double timeout_;
+  std::deque<Request> queue_;   /**< Commands not written yet */
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::thread worker_;
+  bool running_;
+};
+
+#endif /* MD90Client_H */
@@ -0,0 +1,135 @@
+/*
+FILENAME... MD90Compare.cpp
+USAGE...    Software position compare for fly scans with DSM MD-90 axes.
+
+The MD-90 has no position compare output, so crossings are found in the
+encoder samples the driver reads.  Each GEC reading is timestamped with the
+middle of its round trip.  While position compare is armed, the poll reads
+only STA and GEC, as in streaming mode, so the encoder is sampled as often as
+the moving poll period and the line allow.
+
+The positions written to MD90_COMPARE_POSITIONS are crossed in order.  When
+the path between two samples reaches or passes the next position, its crossing
+time is interpolated linearly between the two samples, and further positions
+are checked against the rest of the path.  Consecutive positions must differ.  Each crossing is delivered as an
+MD90_COMPARE_EVENT callback timestamped with the crossing time, and the
+crossing times since arming are published as the MD90_COMPARE_TIMES waveform.
+The delay from a crossing to its callback, at least the time to the next
+sample, is published as MD90_COMPARE_LATENCY and observed in the
+md90_compare_latency_seconds histogram.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include "MD90Driver.h"
+
+static const char *driverName = "MD90Compare";
+
+/** Arms or disarms position compare.  Arming takes the positions last written to
+  * MD90_COMPARE_POSITIONS and clears the crossings; the next encoder sample is the
+  * starting point of the path that is watched.
+  * \param[in] arm  true to arm, false to disarm */
+asynStatus MD90Axis::armCompare(bool arm)
+{
+  asynStatus status = asynSuccess;
+  static const char *functionName = "armCompare";
+
+  compareArmed_ = false;
+  compareTimes_.clear();
+  compareSent_ = 0;
+  compareSampleValid_ = false;
+  if (arm && comparePositions_.empty()) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s:%s: axis %d: no compare positions\n", driverName, functionName, axisNo_);
+    arm = false;
+    status = asynError;
+  }
+  if (arm) {
+    compareArmed_ = true;
+    compareArmTime_ = MD90Metrics::now();
+    setIntegerParam(pC_->MD90CompareEvent_, -1);
+    setIntegerParam(pC_->MD90CompareCount_, 0);
+    setDoubleParam(pC_->MD90CompareLatency_, 0.);
+    setDoubleParam(pC_->MD90CompareLatencyMax_, 0.);
+  }
+  setIntegerParam(pC_->MD90CompareArm_, arm ? 1:0);
+  callParamCallbacks();
+  return status;
+}
+
+/** Finds the compare positions crossed since the previous encoder sample.
+  * \param[in] position    Encoder position (counts)
+  * \param[in] sampleTime  MD90Metrics::now() at which the position was read
+  */
+void MD90Axis::checkCompare(double position, double sampleTime)
+{
+  double from, fromTime, next;
+
+  if (!compareArmed_) return;
+
+  if (compareSampleValid_) {
+    from = comparePosition_;
+    fromTime = compareTime_;
+    while (compareTimes_.size() < comparePositions_.size()) {
+      next = comparePositions_[compareTimes_.size()];
+      // A sample on the position counts as crossing it, so the path may start there
+      if (!((from <= next && position >= next) || (from >= next && position <= next))) break;
+      if (position != from) fromTime += (sampleTime - fromTime) * (next - from) / (position - from);
+      from = next;
+      compareTimes_.push_back(fromTime);
+    }
+  }
+  compareSampleValid_ = true;
+  comparePosition_ = position;
+  compareTime_ = sampleTime;
+}
+
+/** Delivers the crossings found since the last call as MD90_COMPARE_EVENT callbacks,
+  * each timestamped with its crossing time, and updates MD90_COMPARE_TIMES.
+  * Position compare is disarmed when every position has been crossed. */
+void MD90Axis::publishCompare()
+{
+  epicsTimeStamp savedStamp, nowStamp, stamp;
+  std::vector<double> times;
+  double start, latency, latencyMax;
+  size_t i;
+
+  if (compareSent_ == compareTimes_.size()) return;
+
+  pC_->getTimeStamp(&savedStamp);
+  epicsTimeGetCurrent(&nowStamp);
+  start = MD90Metrics::now();
+  pC_->getDoubleParam(axisNo_, pC_->MD90CompareLatencyMax_, &latencyMax);
+  for (; compareSent_<compareTimes_.size(); compareSent_++) {
+    stamp = nowStamp;
+    epicsTimeAddSeconds(&stamp, compareTimes_[compareSent_] - start);
+    pC_->setTimeStamp(&stamp);
+    latency = MD90Metrics::now() - compareTimes_[compareSent_];
+    if (latency > latencyMax) latencyMax = latency;
+    setIntegerParam(pC_->MD90CompareEvent_, (int)compareSent_);
+    setIntegerParam(pC_->MD90CompareCount_, (int)compareSent_ + 1);
+    setDoubleParam(pC_->MD90CompareLatency_, latency);
+    setDoubleParam(pC_->MD90CompareLatencyMax_, latencyMax);
+    callParamCallbacks();
+    pC_->metrics_.current().axes[axisNo_].compareLatency.observe(latency);
+  }
+
+  times.resize(compareTimes_.size());
+  for (i=0; i<compareTimes_.size(); i++) {
+    times[i] = compareTimes_[i] - compareArmTime_;
+  }
+  pC_->doCallbacksFloat64Array(&times[0], times.size(), pC_->MD90CompareTimes_, axisNo_);
+
+  if (compareTimes_.size() == comparePositions_.size()) {
+    compareArmed_ = false;
+    setIntegerParam(pC_->MD90CompareArm_, 0);
+    callParamCallbacks();
+  }
+  pC_->setTimeStamp(&savedStamp);
+}
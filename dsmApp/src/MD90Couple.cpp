@@ -0,0 +1,358 @@
+/*
+FILENAME... MD90Couple.cpp
+USAGE...    Coupled leader and follower axes on two DSM MD-90 controllers.
+
+Some stages are driven by two MD-90 actuators that must move together, such as
+a gantry or a tilt pair.  MD90Couple names the leader and the follower.  While
+MD90_COUPLE_ENABLE is set on the leader, the leader's motor record drives the
+pair as a single axis: each move is sent to the follower first, to the same
+target plus the offset between the two when coupling was enabled, and then to
+the leader.  The follower's own moves are refused.
+
+At each poll of the leader, the follower's encoder is read and the position
+difference, less the offset, is published as MD90_COUPLE_DIFF.  When it
+exceeds MD90_COUPLE_THRESHOLD while both axes move, the axis that is ahead in
+the direction of travel is stopped.  It is sent to its target again once the
+difference has fallen below half the threshold, or the other axis has stopped.
+The leader reports the pair as moving until both axes are done.
+
+The leader's controller is locked first and the follower's inside it, never
+the other way round, so MD90Couple refuses a controller that is already part
+of a pair.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <set>
+
+#include <iocsh.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+
+#define NINT(f) (int)((f)>0 ? (f)+0.5 : (f)-0.5)
+
+static const char *driverName = "MD90Couple";
+
+// Controllers that lead or follow a pair, see MD90Couple
+static std::set<MD90Controller*> leaders, followers;
+
+/** Makes an axis of this controller the leader of a pair.  Called with no lock held.
+  * \param[in] axisNo          Leader axis number
+  * \param[in] follower        Controller of the follower
+  * \param[in] followerAxisNo  Follower axis number
+  */
+asynStatus MD90Controller::setCouple(int axisNo, MD90Controller *follower, int followerAxisNo)
+{
+  MD90Axis *pAxis;
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis || pAxis->coupleEnabled_) {
+    unlock();
+    return asynError;
+  }
+  pAxis->coupleC_ = follower;
+  pAxis->coupleAxisNo_ = followerAxisNo;
+  unlock();
+  return asynSuccess;
+}
+
+/** Refuses or allows the follower's own moves while its leader is coupled.
+  * Locking is refused while the follower runs an autotune or a group home.
+  * Called by the leader with its own controller locked. */
+asynStatus MD90Controller::lockFollower(int axisNo, bool locked)
+{
+  MD90Axis *pAxis;
+  static const char *functionName = "lockFollower";
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis) {
+    unlock();
+    return asynError;
+  }
+  if (locked && (pAxis->autotuneActive_ || pAxis->homeActive_)) {
+    unlock();
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: %s axis %d: cannot couple during autotune or a group home\n", driverName, functionName, portName, axisNo);
+    return asynError;
+  }
+  pAxis->coupleLocked_ = locked;
+  unlock();
+  return asynSuccess;
+}
+
+/** Moves the follower for its leader.  Called by the leader with its own controller locked.
+  * \param[in] axisNo  Follower axis number
+  * \param[in] position  Absolute target (counts)
+  */
+asynStatus MD90Controller::followMove(int axisNo, double position, double minVelocity,
+                                      double maxVelocity, double acceleration)
+{
+  MD90Axis *pAxis;
+  asynStatus status;
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis) {
+    unlock();
+    return asynError;
+  }
+  // move() refuses the follower's own moves while it is locked to the leader
+  pAxis->coupleLocked_ = false;
+  status = pAxis->move(position, 0, minVelocity, maxVelocity, acceleration);
+  pAxis->coupleLocked_ = true;
+  if (!status) {
+    setIntegerParam(axisNo, motorStatusDone_, 0);
+    callParamCallbacks(axisNo);
+    wakeupPoller();
+  }
+  unlock();
+  return status;
+}
+
+/** Pauses or resumes the follower's move.  Called by the leader with its own controller locked. */
+asynStatus MD90Controller::pauseFollower(int axisNo, bool pause)
+{
+  MD90Axis *pAxis;
+  asynStatus status;
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis) {
+    unlock();
+    return asynError;
+  }
+  status = pAxis->pauseMove(pause);
+  wakeupPoller();
+  unlock();
+  return status;
+}
+
+/** Stops the follower.  Called by the leader with its own controller locked. */
+asynStatus MD90Controller::stopFollower(int axisNo)
+{
+  MD90Axis *pAxis;
+  asynStatus status;
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis) {
+    unlock();
+    return asynError;
+  }
+  status = pAxis->stop(0.);
+  unlock();
+  return status;
+}
+
+/** Reads the follower's encoder and moving state.  Called by the leader with its own
+  * controller locked.
+  * \param[in] axisNo     Follower axis number
+  * \param[out] position  Encoder position (counts)
+  * \param[out] moving    The follower's move is not done, including while it is paused
+  */
+asynStatus MD90Controller::getCoupleState(int axisNo, double *position, bool *moving)
+{
+  MD90Axis *pAxis;
+  asynStatus status;
+  int done;
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis) {
+    unlock();
+    return asynError;
+  }
+  status = pAxis->query("GEC", position);
+  getIntegerParam(axisNo, motorStatusDone_, &done);
+  *moving = !done || pAxis->pauseActive_;
+  unlock();
+  return status;
+}
+
+/** Enables or disables coupled moves with the follower.  Enabling takes the present
+  * difference of the two positions as the offset to keep.
+  * \param[in] enable  true to enable, false to disable */
+asynStatus MD90Axis::enableCouple(bool enable)
+{
+  double position, followerPosition;
+  bool followerMoving;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "enableCouple";
+
+  if (enable && !coupleC_) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s:%s: %s axis %d: no follower, see MD90Couple\n", driverName, functionName, pC_->portName, axisNo_);
+    status = asynError;
+  } else if (enable && !coupleEnabled_ && (autotuneActive_ || homeActive_)) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s:%s: %s axis %d: cannot couple during autotune or a group home\n", driverName, functionName, pC_->portName, axisNo_);
+    status = asynError;
+  } else if (enable && !coupleEnabled_) {
+    status = query("GEC", &position);
+    if (!status) status = coupleC_->getCoupleState(coupleAxisNo_, &followerPosition, &followerMoving);
+    if (!status && (followerMoving || lastStatus_ == MD90_STA_MOVING)) {
+      asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+        "%s:%s: %s axis %d: cannot couple while moving\n", driverName, functionName, pC_->portName, axisNo_);
+      status = asynError;
+    }
+    if (!status) status = coupleC_->lockFollower(coupleAxisNo_, true);
+    if (!status) {
+      coupleEnabled_ = true;
+      coupleActive_ = false;
+      couplePaused_ = 0;
+      coupleOffset_ = followerPosition - position;
+      setDoubleParam(pC_->MD90CoupleOffset_, coupleOffset_);
+      setDoubleParam(pC_->MD90CoupleDiff_, 0.);
+    }
+  } else if (!enable && coupleEnabled_) {
+    if (couplePaused_) stop(0.);
+    coupleC_->lockFollower(coupleAxisNo_, false);
+    coupleEnabled_ = false;
+    coupleActive_ = false;
+    couplePaused_ = 0;
+  }
+  setIntegerParam(pC_->MD90CoupleEnable_, coupleEnabled_ ? 1:0);
+  callParamCallbacks();
+  return status;
+}
+
+/** Stops this axis to wait for the other axis of its pair, or sends it on to its target.
+  * \param[in] pause  true to stop, false to resume */
+asynStatus MD90Axis::pauseMove(bool pause)
+{
+  asynStatus status;
+  static const char *functionName = "MD90Axis::pauseMove";
+
+  if (pause) {
+    // The rest of the move runs at the present step frequency
+    rampActive_ = false;
+    setIntegerParam(pC_->MD90RampActive_, 0);
+    sprintf(pC_->outString_, "STP");
+  } else {
+    sprintf(pC_->outString_, "CLM %d", NINT(moveTarget_ * 10));
+  }
+  status = pC_->writeReadController();
+  if (!status) status = parseReply(functionName, pC_->inString_);
+  if (!status) pauseActive_ = pause;
+  return status;
+}
+
+/** Compares the follower's position with this leader's, and pauses the axis that is
+  * ahead while the difference is larger than the threshold.  Called by poll().
+  * \param[in] position    Leader encoder position (counts)
+  * \param[in,out] moving  Set while either axis of the pair is still moving
+  */
+void MD90Axis::updateCouple(double position, bool *moving)
+{
+  double followerPosition, diff, threshold, direction;
+  bool followerMoving, leaderMoving;
+  int pauses;
+  static const char *functionName = "updateCouple";
+
+  if (!coupleEnabled_) return;
+
+  if (coupleC_->getCoupleState(coupleAxisNo_, &followerPosition, &followerMoving)) {
+    // The follower does not answer; its own poll reports the lost connection
+    setIntegerParam(pC_->motorStatusProblem_, 1);
+    return;
+  }
+  diff = followerPosition - coupleOffset_ - position;
+  setDoubleParam(pC_->MD90CoupleDiff_, diff);
+  if (!coupleActive_) return;
+
+  if (fabs(diff) > coupleMaxDiff_) {
+    coupleMaxDiff_ = fabs(diff);
+    setDoubleParam(pC_->MD90CoupleMaxDiff_, coupleMaxDiff_);
+  }
+  pC_->getDoubleParam(axisNo_, pC_->MD90CoupleThreshold_, &threshold);
+  leaderMoving = *moving && !pauseActive_;
+  direction = (moveTarget_ >= coupleStart_) ? 1. : -1.;
+
+  if (couplePaused_ == 0 && threshold > 0. && fabs(diff) > threshold && leaderMoving && followerMoving) {
+    asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+      "%s:%s: %s axis %d: difference %f, pausing the %s\n", driverName, functionName,
+      pC_->portName, axisNo_, diff, (diff * direction > 0.) ? "follower" : "leader");
+    if (diff * direction > 0.) {
+      if (!coupleC_->pauseFollower(coupleAxisNo_, true)) couplePaused_ = -1;
+    } else {
+      if (!pauseMove(true)) couplePaused_ = 1;
+    }
+    if (couplePaused_) {
+      pC_->getIntegerParam(axisNo_, pC_->MD90CouplePauses_, &pauses);
+      setIntegerParam(pC_->MD90CouplePauses_, pauses + 1);
+    }
+  } else if (couplePaused_ != 0 &&
+             (fabs(diff) <= threshold * COUPLE_RESUME_FRACTION ||
+              !((couplePaused_ > 0) ? followerMoving : leaderMoving))) {
+    if (couplePaused_ > 0) {
+      if (!pauseMove(false)) couplePaused_ = 0;
+    } else {
+      if (!coupleC_->pauseFollower(coupleAxisNo_, false)) couplePaused_ = 0;
+    }
+  }
+
+  if (followerMoving || couplePaused_ != 0) {
+    setIntegerParam(pC_->motorStatusDone_, 0);
+    *moving = true;
+  } else if (!*moving) {
+    coupleActive_ = false;
+  }
+}
+
+/** Makes two axes on different controllers a coupled pair, driven from the leader.
+  * Coupling is enabled with the leader's MD90_COUPLE_ENABLE.
+  * Configuration command, called directly or from iocsh
+  * \param[in] leader    "port" or "port:axis" of the leader
+  * \param[in] follower  "port" or "port:axis" of the follower
+  */
+extern "C" int MD90Couple(const char *leader, const char *follower)
+{
+  MD90Controller *pLeader, *pFollower;
+  int leaderAxis, followerAxis;
+  static const char *functionName = "MD90Couple";
+
+  pLeader = MD90Controller::findAxis(functionName, leader, &leaderAxis);
+  pFollower = MD90Controller::findAxis(functionName, follower, &followerAxis);
+  if (!pLeader || !pFollower) return asynError;
+  if (pLeader == pFollower) {
+    printf("%s: the leader and follower must be on different controllers\n", functionName);
+    return asynError;
+  }
+  if (leaders.count(pLeader) || followers.count(pLeader) ||
+      leaders.count(pFollower) || followers.count(pFollower)) {
+    printf("%s: %s or %s is already part of a pair\n", functionName, leader, follower);
+    return asynError;
+  }
+  if (pLeader->setCouple(leaderAxis, pFollower, followerAxis)) return asynError;
+  leaders.insert(pLeader);
+  followers.insert(pFollower);
+  return asynSuccess;
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90CoupleArg0 = {"Leader (port[:axis])", iocshArgString};
+static const iocshArg MD90CoupleArg1 = {"Follower (port[:axis])", iocshArgString};
+static const iocshArg * const MD90CoupleArgs[] = {&MD90CoupleArg0,
+                                                   &MD90CoupleArg1};
+static const iocshFuncDef MD90CoupleDef = {"MD90Couple", 2, MD90CoupleArgs};
+static void MD90CoupleCallFunc(const iocshArgBuf *args)
+{
+  MD90Couple(args[0].sval, args[1].sval);
+}
+
+static void MD90CoupleRegister(void)
+{
+  iocshRegister(&MD90CoupleDef, MD90CoupleCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90CoupleRegister);
+}
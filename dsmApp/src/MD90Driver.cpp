@@ -17,8 +17,11 @@ March 1, 2012
 
 #include <iocsh.h>
 #include <epicsThread.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
 
 #include <asynOctetSyncIO.h>
+#include <asynCommonSyncIO.h>
 
 #include <epicsExport.h>
 #include "MD90Driver.h"
@@ -39,7 +42,18 @@ MD90Controller::MD90Controller(const char *portName, const char *MD90PortName, i
                          0, // No additional callback interfaces beyond those in base class
                          ASYN_CANBLOCK | ASYN_MULTIDEVICE, 
                          1, // autoconnect
-                         0, 0)  // Default priority and stack size
+                         0, 0), // Default priority and stack size
+     stateFile_(NULL),
+     stateSaveFailed_(false),
+     pasynUserCommon_(NULL),
+     metrics_(portName, numAxes),
+     recorderId_(MD90Recorder::controllerId(portName)),
+     ioPortName_(MD90PortName),
+     pollerSettingsPending_(false),
+     pollEnd_(0.),
+     pollMoving_(false),
+     jitterMean_(0.),
+     jitterMax_(0.)
 {
   int axis;
   asynStatus status;
@@ -53,6 +67,98 @@ MD90Controller::MD90Controller(const char *portName, const char *MD90PortName, i
       "%s: cannot connect to MD-90 controller\n",
       functionName);
   }
+  // A second connection to the port to reopen it if the device goes away, e.g. a USB replug
+  status = pasynCommonSyncIO->connect(MD90PortName, 0, &pasynUserCommon_, NULL);
+  if (status) {
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR, 
+      "%s: cannot connect to asynCommon interface of %s\n",
+      functionName, MD90PortName);
+  }
+  epicsTimeGetCurrent(&reconnectTime_);
+
+  // Create controller-specific parameters
+  createParam(MD90RampIncrementsString, asynParamInt32, &MD90RampIncrements_);
+  createParam(MD90RampActiveString,     asynParamInt32, &MD90RampActive_);
+  createParam(MD90StepFrequencyString,  asynParamInt32, &MD90StepFrequency_);
+  createParam(MD90CountsPerStepString,  asynParamFloat64, &MD90CountsPerStep_);
+  createParam(MD90CalGainString,        asynParamFloat64, &MD90CalGain_);
+  createParam(MD90CalSamplesString,     asynParamInt32, &MD90CalSamples_);
+  createParam(MD90MoveEtaString,        asynParamFloat64, &MD90MoveEta_);
+  createParam(MD90MeasVelocityString,   asynParamFloat64, &MD90MeasVelocity_);
+  createParam(MD90SettleWindowString,   asynParamFloat64, &MD90SettleWindow_);
+  createParam(MD90MoveDurationString,   asynParamFloat64, &MD90MoveDuration_);
+  createParam(MD90SettleTimeString,     asynParamFloat64, &MD90SettleTime_);
+  createParam(MD90OvershootString,      asynParamFloat64, &MD90Overshoot_);
+  createParam(MD90FinalErrorString,     asynParamFloat64, &MD90FinalError_);
+  createParam(MD90MoveCountString,      asynParamInt32, &MD90MoveCount_);
+  createParam(MD90MoveErrorsString,     asynParamInt32, &MD90MoveErrors_);
+  createParam(MD90MoveSummaryString,    asynParamFloat64Array, &MD90MoveSummary_);
+  createParam(MD90StallPolicyString,    asynParamInt32, &MD90StallPolicy_);
+  createParam(MD90StallTimeString,      asynParamFloat64, &MD90StallTime_);
+  createParam(MD90StallThresholdString, asynParamFloat64, &MD90StallThreshold_);
+  createParam(MD90StalledString,        asynParamInt32, &MD90Stalled_);
+  createParam(MD90StallCountString,     asynParamInt32, &MD90StallCount_);
+  createParam(MD90StreamModeString,     asynParamInt32, &MD90StreamMode_);
+  createParam(MD90StreamSetpointString, asynParamFloat64, &MD90StreamSetpoint_);
+  createParam(MD90StreamSetpointsString, asynParamFloat64Array, &MD90StreamSetpoints_);
+  createParam(MD90StreamSentString,     asynParamInt32, &MD90StreamSent_);
+  createParam(MD90StreamDropsString,    asynParamInt32, &MD90StreamDrops_);
+  createParam(MD90StreamLatencyString,  asynParamFloat64, &MD90StreamLatency_);
+  createParam(MD90StreamMaxLatencyString, asynParamFloat64, &MD90StreamMaxLatency_);
+  createParam(MD90AutotuneString,       asynParamInt32, &MD90Autotune_);
+  createParam(MD90AutotuneStateString,  asynParamInt32, &MD90AutotuneState_);
+  createParam(MD90AutotuneStepString,   asynParamFloat64, &MD90AutotuneStep_);
+  createParam(MD90AutotuneMinGainString, asynParamInt32, &MD90AutotuneMinGain_);
+  createParam(MD90AutotuneMaxGainString, asynParamInt32, &MD90AutotuneMaxGain_);
+  createParam(MD90AutotuneNumGainsString, asynParamInt32, &MD90AutotuneNumGains_);
+  createParam(MD90AutotuneGainString,   asynParamInt32, &MD90AutotuneGain_);
+  createParam(MD90AutotuneSettleString, asynParamFloat64, &MD90AutotuneSettle_);
+  createParam(MD90AutotuneOvershootString, asynParamFloat64, &MD90AutotuneOvershoot_);
+  createParam(MD90AutotuneResultsString, asynParamFloat64Array, &MD90AutotuneResults_);
+  createParam(MD90HomeTimeString,       asynParamFloat64, &MD90HomeTime_);
+  createParam(MD90ReconcileString,      asynParamInt32, &MD90Reconcile_);
+  createParam(MD90ReconcileToleranceString, asynParamFloat64, &MD90ReconcileTolerance_);
+  createParam(MD90DeadbandString,       asynParamInt32, &MD90Deadband_);
+  createParam(MD90ReattachCountString,  asynParamInt32, &MD90ReattachCount_);
+  createParam(MD90RecoverBusyString,    asynParamInt32, &MD90RecoverBusy_);
+  createParam(MD90RecoverStanceString,  asynParamInt32, &MD90RecoverStance_);
+  createParam(MD90RecoverRampString,    asynParamInt32, &MD90RecoverRamp_);
+  createParam(MD90RetryLimitString,     asynParamInt32, &MD90RetryLimit_);
+  createParam(MD90RetryDelayString,     asynParamFloat64, &MD90RetryDelay_);
+  createParam(MD90RetryCountString,     asynParamInt32, &MD90RetryCount_);
+  createParam(MD90LastErrorString,      asynParamInt32, &MD90LastError_);
+  createParam(MD90ErrorCountsString,    asynParamFloat64Array, &MD90ErrorCounts_);
+  createParam(MD90ReadNowString,        asynParamInt32, &MD90ReadNow_);
+  createParam(MD90PositionString,       asynParamFloat64, &MD90Position_);
+  createParam(MD90SettleMeanString,     asynParamFloat64, &MD90SettleMean_);
+  createParam(MD90PlanPointsString,     asynParamFloat64Array, &MD90PlanPoints_);
+  createParam(MD90PlanString,           asynParamInt32, &MD90Plan_);
+  createParam(MD90PlanOrderString,      asynParamFloat64Array, &MD90PlanOrder_);
+  createParam(MD90PlanTotalString,      asynParamFloat64, &MD90PlanTotal_);
+  createParam(MD90PlanNaturalTotalString, asynParamFloat64, &MD90PlanNaturalTotal_);
+  createParam(MD90PollJitterString,     asynParamFloat64, &MD90PollJitter_);
+  createParam(MD90PollJitterMeanString, asynParamFloat64, &MD90PollJitterMean_);
+  createParam(MD90PollJitterMaxString,  asynParamFloat64, &MD90PollJitterMax_);
+  createParam(MD90PollJitterResetString, asynParamInt32, &MD90PollJitterReset_);
+  createParam(MD90ApproachModeString,   asynParamInt32, &MD90ApproachMode_);
+  createParam(MD90ApproachDistanceString, asynParamFloat64, &MD90ApproachDistance_);
+  createParam(MD90ComparePositionsString, asynParamFloat64Array, &MD90ComparePositions_);
+  createParam(MD90CompareArmString,     asynParamInt32, &MD90CompareArm_);
+  createParam(MD90CompareEventString,   asynParamInt32, &MD90CompareEvent_);
+  createParam(MD90CompareCountString,   asynParamInt32, &MD90CompareCount_);
+  createParam(MD90CompareTimesString,   asynParamFloat64Array, &MD90CompareTimes_);
+  createParam(MD90CompareLatencyString, asynParamFloat64, &MD90CompareLatency_);
+  createParam(MD90CompareLatencyMaxString, asynParamFloat64, &MD90CompareLatencyMax_);
+  createParam(MD90PrecisionModeString,  asynParamInt32, &MD90PrecisionMode_);
+  createParam(MD90CoarseDeadbandString, asynParamInt32, &MD90CoarseDeadband_);
+  createParam(MD90ActiveDeadbandString, asynParamInt32, &MD90ActiveDeadband_);
+  createParam(MD90CoupleEnableString,   asynParamInt32, &MD90CoupleEnable_);
+  createParam(MD90CoupleThresholdString, asynParamFloat64, &MD90CoupleThreshold_);
+  createParam(MD90CoupleOffsetString,   asynParamFloat64, &MD90CoupleOffset_);
+  createParam(MD90CoupleDiffString,     asynParamFloat64, &MD90CoupleDiff_);
+  createParam(MD90CoupleMaxDiffString,  asynParamFloat64, &MD90CoupleMaxDiff_);
+  createParam(MD90CouplePausesString,   asynParamInt32, &MD90CouplePauses_);
+
   for (axis=0; axis<numAxes; axis++) {
     pAxis = new MD90Axis(this, axis);
   }
@@ -89,11 +195,320 @@ void MD90Controller::report(FILE *fp, int level)
 {
   fprintf(fp, "MD-90 motor driver %s, numAxes=%d, moving poll period=%f, idle poll period=%f\n", 
     this->portName, numAxes_, movingPollPeriod_, idlePollPeriod_);
+  fprintf(fp, "  poll start jitter mean=%.3f ms, max=%.3f ms\n", jitterMean_ * 1e3, jitterMax_ * 1e3);
 
   // Call the base class method
   asynMotorController::report(fp, level);
 }
 
+/** Called when asyn clients call pasynInt32->write().
+  * Extracts the function and axis number from pasynUser.
+  * Sets the value in the parameter library.
+  * Handles the MD-90 specific parameters, and calls the base class for all others.
+  * \param[in] pasynUser asynUser structure that encodes the reason and address.
+  * \param[in] value     Value to write. */
+asynStatus MD90Controller::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+  int function = pasynUser->reason;
+  int deadband;
+  MD90Axis *pAxis;
+  asynStatus status = asynSuccess;
+
+  pAxis = getAxis(pasynUser);
+  if (!pAxis) return asynError;
+
+  if (function == MD90Autotune_) {
+    if (value) {
+      status = pAxis->startAutotune();
+    } else {
+      pAxis->autotuneAbort_ = true;
+    }
+  } else if (function == MD90ReadNow_) {
+    if (value) status = pAxis->readNow(value > 1);
+  } else if (function == MD90CoupleEnable_) {
+    status = pAxis->enableCouple(value != 0);
+  } else if (function == MD90CompareArm_) {
+    status = pAxis->armCompare(value != 0);
+  } else if (function == MD90Plan_) {
+    if (value) status = planPoints(pAxis->axisNo_);
+  } else if (function == MD90PollJitterReset_) {
+    jitterMax_ = 0.;
+    for (int axis=0; axis<numAxes_; axis++) {
+      setDoubleParam(axis, MD90PollJitterMax_, 0.);
+    }
+  } else if (function == MD90Deadband_) {
+    getIntegerParam(pAxis->axisNo_, MD90Deadband_, &deadband);
+    // Skip the write if the warm start found the controller already holds this deadband
+    if (value != deadband || !pAxis->deadbandVerified_) {
+      status = pAxis->sendDeadband(value);
+    }
+    if (!status) {
+      if (value != deadband) pAxis->stateChanged_ = true;
+      pAxis->deadbandVerified_ = true;
+      setIntegerParam(pAxis->axisNo_, MD90Deadband_, value);
+    }
+    callParamCallbacks(pAxis->axisNo_);
+  } else {
+    // Call base class method
+    status = asynMotorController::writeInt32(pasynUser, value);
+  }
+  return status;
+}
+
+/** Called when asyn clients call pasynFloat64->write().
+  * Extracts the function and axis number from pasynUser.
+  * Sets the value in the parameter library.
+  * Handles the MD-90 specific parameters, and calls the base class for all others.
+  * \param[in] pasynUser asynUser structure that encodes the reason and address.
+  * \param[in] value     Value to write. */
+asynStatus MD90Controller::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
+{
+  int function = pasynUser->reason;
+  MD90Axis *pAxis;
+  asynStatus status = asynSuccess;
+
+  pAxis = getAxis(pasynUser);
+  if (!pAxis) return asynError;
+
+  if (function == MD90CountsPerStep_) {
+    // Override the calibration, e.g. to reset it to the nominal value
+    if (value <= 0.) return asynError;
+    pAxis->countsPerStep_ = value;
+    pAxis->calValid_ = false;
+    pAxis->stateChanged_ = true;
+    pAxis->setDoubleParam(function, value);
+    pAxis->callParamCallbacks();
+  } else if (function == MD90StreamSetpoint_) {
+    status = pAxis->streamSetpoint(value);
+    if (!status) pAxis->setDoubleParam(function, value);
+    pAxis->callParamCallbacks();
+  } else {
+    // Call base class method
+    status = asynMotorController::writeFloat64(pasynUser, value);
+  }
+  return status;
+}
+
+/** Called when asyn clients call pasynFloat64Array->write().
+  * MD90_STREAM_SETPOINTS queues one closed loop setpoint per axis, element n going to axis n;
+  * MD90_PLAN_POINTS and MD90_COMPARE_POSITIONS are stored for the planner and position compare;
+  * all other parameters are handled by the base class.
+  * \param[in] pasynUser asynUser structure that encodes the reason and address.
+  * \param[in] value     Pointer to the array to write.
+  * \param[in] nElements Number of elements in the array. */
+asynStatus MD90Controller::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements)
+{
+  int function = pasynUser->reason;
+  size_t axis, i;
+  MD90Axis *pAxis;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "MD90Controller::writeFloat64Array";
+
+  if (function == MD90PlanPoints_) {
+    planPoints_.assign(value, value + nElements);
+    return asynSuccess;
+  }
+  if (function == MD90ComparePositions_) {
+    pAxis = getAxis(pasynUser);
+    if (!pAxis || nElements > COMPARE_MAX_POINTS) return asynError;
+    // A position equal to the one before would be crossed together with it
+    for (i=0; i<nElements; i++) {
+      if (!isfinite(value[i]) || (i > 0 && value[i] == value[i-1])) {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+          "%s: compare position %d is invalid or repeats the one before\n", functionName, (int)i);
+        return asynError;
+      }
+    }
+    // Taken into use when position compare is next armed
+    pAxis->comparePositions_.assign(value, value + nElements);
+    return asynSuccess;
+  }
+  if (function != MD90StreamSetpoints_) {
+    return asynMotorController::writeFloat64Array(pasynUser, value, nElements);
+  }
+  for (axis=0; axis<nElements && axis<(size_t)numAxes_; axis++) {
+    pAxis = getAxis((int)axis);
+    if (!pAxis) continue;
+    if (pAxis->streamSetpoint(value[axis])) status = asynError;
+    pAxis->callParamCallbacks();
+  }
+  return status;
+}
+
+/** Writes outString_ and reads the reply into inString_, recording the round trip time
+  * of the command for the metrics */
+asynStatus MD90Controller::writeReadController()
+{
+  double start = MD90Metrics::now();
+  asynStatus status;
+
+  status = asynMotorController::writeReadController();
+  metrics_.command(outString_, MD90Metrics::now() - start, status == asynTimeout);
+  return status;
+}
+
+/** Polls the controller before the axes are polled.
+  * Sends the latest pending streamed setpoint of each axis, so that a setpoint waits
+  * at most for the poll cycle that is in progress when it arrives. */
+asynStatus MD90Controller::poll()
+{
+  int axis;
+  bool commLost = false;
+  epicsTimeStamp now;
+  MD90Axis *pAxis;
+  static const char *functionName = "MD90Controller::poll";
+
+  measurePollJitter();
+  if (pollerSettingsPending_) applyPollerSettings();
+
+  // Reopen the serial port while the controller is not answering.  Once a replugged
+  // adapter has been given its device node again, the port reconnects to it; with a
+  // /dev/serial/by-id path that is the same controller whatever ttyUSB it became.
+  // For a terminal server port this closes the TCP connection and connects again.
+  for (axis=0; axis<numAxes_; axis++) {
+    pAxis = getAxis(axis);
+    if (pAxis && pAxis->commLost_) commLost = true;
+  }
+  epicsTimeGetCurrent(&now);
+  if (commLost && pasynUserCommon_ &&
+      epicsTimeDiffInSeconds(&now, &reconnectTime_) >= RECONNECT_INTERVAL) {
+    reconnectTime_ = now;
+    asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s: %s: reopening port %s\n", functionName, portName, ioPortName_.c_str());
+    pasynCommonSyncIO->disconnectDevice(pasynUserCommon_);
+    pasynCommonSyncIO->connectDevice(pasynUserCommon_);
+  }
+
+  for (axis=0; axis<numAxes_; axis++) {
+    pAxis = getAxis(axis);
+    if (!pAxis || !pAxis->streamPending_) continue;
+    pAxis->sendSetpoint();
+    pAxis->callParamCallbacks();
+  }
+  return asynSuccess;
+}
+
+/** Reads the persisted axis state from a file and keeps the file up to date from then on.
+  * Each line of the file has the form "axis <n> <key> <value>"; lines starting with '#' are ignored.
+  * A missing file is not an error; it is created when the state is first saved.
+  * \param[in] fileName  Name of the state file */
+asynStatus MD90Controller::loadState(const char *fileName)
+{
+  FILE *fp;
+  char line[256];
+  char key[64];
+  int axisNo;
+  double value;
+  MD90Axis *pAxis;
+  static const char *functionName = "MD90Controller::loadState";
+
+  free(stateFile_);
+  stateFile_ = epicsStrDup(fileName);
+
+  fp = fopen(fileName, "r");
+  if (!fp) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+      "%s: %s: cannot open state file %s, starting from defaults\n",
+      functionName, portName, fileName);
+    return asynSuccess;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "axis %d %63s %lf", &axisNo, key, &value) != 3) continue;
+    pAxis = getAxis(axisNo);
+    if (!pAxis) continue;
+    pAxis->restoreState(key, value);
+  }
+  fclose(fp);
+
+  // Apply the persisted configuration, and check the home state of each axis
+  // against the file at the next poll
+  for (axisNo=0; axisNo<numAxes_; axisNo++) {
+    pAxis = getAxis(axisNo);
+    if (!pAxis) continue;
+    pAxis->warmStart();
+    setIntegerParam(axisNo, MD90Reconcile_, MD90_RECONCILE_PENDING);
+    pAxis->callParamCallbacks();
+  }
+  return asynSuccess;
+}
+
+/** Writes the persisted state of all axes to the state file, if one is configured.
+  * The file is replaced atomically so that a crash cannot leave it truncated.
+  * After a failure the next attempt is made STATE_RETRY_INTERVAL later. */
+asynStatus MD90Controller::saveState()
+{
+  FILE *fp;
+  char tmpFile[256];
+  int axis;
+  MD90Axis *pAxis;
+  epicsTimeStamp now;
+  static const char *functionName = "MD90Controller::saveState";
+
+  if (!stateFile_) return asynSuccess;
+
+  epicsTimeGetCurrent(&now);
+  if (stateSaveFailed_ && epicsTimeDiffInSeconds(&now, &stateSaveTime_) < STATE_RETRY_INTERVAL) {
+    return asynError;
+  }
+  stateSaveTime_ = now;
+  stateSaveFailed_ = true;
+
+  epicsSnprintf(tmpFile, sizeof(tmpFile), "%s.tmp", stateFile_);
+  fp = fopen(tmpFile, "w");
+  if (!fp) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s: %s: cannot write state file %s\n",
+      functionName, portName, tmpFile);
+    return asynError;
+  }
+  fprintf(fp, "# MD-90 driver state for port %s\n", portName);
+  for (axis=0; axis<numAxes_; axis++) {
+    pAxis = getAxis(axis);
+    if (!pAxis) continue;
+    pAxis->saveState(fp);
+  }
+  fclose(fp);
+  if (rename(tmpFile, stateFile_)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s: %s: cannot replace state file %s\n",
+      functionName, portName, stateFile_);
+    return asynError;
+  }
+  for (axis=0; axis<numAxes_; axis++) {
+    pAxis = getAxis(axis);
+    if (pAxis) pAxis->stateChanged_ = false;
+  }
+  stateSaveFailed_ = false;
+  return asynSuccess;
+}
+
+/** Loads the persisted state for a controller and enables saving it.
+  * Configuration command, called directly or from iocsh
+  * \param[in] portName  The name of the MD90Controller asyn port
+  * \param[in] fileName  The name of the state file
+  */
+extern "C" int MD90StateFile(const char *portName, const char *fileName)
+{
+  MD90Controller *pC;
+  asynStatus status;
+  static const char *functionName = "MD90StateFile";
+
+  pC = (MD90Controller*) findAsynPortDriver(portName);
+  if (!pC) {
+    printf("%s: %s: port not found\n", functionName, portName);
+    return asynError;
+  }
+  if (!fileName || !fileName[0]) {
+    printf("%s: %s: no file name given\n", functionName, portName);
+    return asynError;
+  }
+  pC->lock();
+  status = pC->loadState(fileName);
+  pC->unlock();
+  return status;
+}
+
 /** Returns a pointer to an MD90Axis object.
   * Returns NULL if the axis number encoded in pasynUser is invalid.
   * \param[in] pasynUser asynUser structure that encodes the axis index number. */
@@ -110,6 +525,39 @@ MD90Axis* MD90Controller::getAxis(int axisNo)
   return static_cast<MD90Axis*>(asynMotorController::getAxis(axisNo));
 }
 
+/** Finds the controller and axis named by "port" or "port:axis", as given to the
+  * configuration commands; prints an error if there is no such axis.
+  * \param[in] functionName  Name of the calling command, for the error message
+  * \param[in] spec          "port" or "port:axis"
+  * \param[out] axisNo       Axis number, 0 if not given */
+MD90Controller* MD90Controller::findAxis(const char *functionName, const char *spec, int *axisNo)
+{
+  MD90Controller *pC;
+  char *name, *axis, *end;
+
+  name = epicsStrDup(spec ? spec : "");
+  *axisNo = 0;
+  axis = strchr(name, ':');
+  if (axis) {
+    *axis++ = '\0';
+    *axisNo = strtol(axis, &end, 10);
+    if (end == axis || *end) {
+      printf("%s: %s: invalid axis number\n", functionName, name);
+      free(name);
+      return NULL;
+    }
+  }
+  pC = (MD90Controller*) findAsynPortDriver(name);
+  if (!pC) {
+    printf("%s: %s: port not found\n", functionName, name);
+  } else if (!pC->getAxis(*axisNo)) {
+    printf("%s: %s: invalid axis %d\n", functionName, name, *axisNo);
+    pC = NULL;
+  }
+  free(name);
+  return pC;
+}
+
 
 // These are the MD90Axis methods
 
@@ -121,8 +569,152 @@ MD90Axis* MD90Controller::getAxis(int axisNo)
   */
 MD90Axis::MD90Axis(MD90Controller *pC, int axisNo)
   : asynMotorAxis(pC, axisNo),
-    pC_(pC)
+    pC_(pC),
+    lastPosition_(0.),
+    moveTarget_(0.),
+    stepFreq_(0),
+    rampActive_(false),
+    rampTarget_(0.),
+    rampMinFreq_(0.),
+    rampMaxFreq_(0.),
+    rampRate_(0.),
+    rampIncrement_(0.),
+    countsPerStep_(MD90_COUNTS_PER_STEP),
+    calValid_(false),
+    calPosition_(0.),
+    calFreq_(0),
+    stateChanged_(false),
+    homed_(0),
+    savedPosition_(0.),
+    savedHomed_(-1),
+    homeSuspect_(false),
+    homeTimed_(false),
+    homeStartTime_(0.),
+    commLost_(false),
+    powerOn_(-1),
+    gain_(-1),
+    persistentMove_(-1),
+    deadbandVerified_(false),
+    activeDeadband_(-1),
+    lastStatus_(0),
+    retryCount_(0),
+    retryPending_(false),
+    approachPending_(false),
+    approachTarget_(0.),
+    moveDeadbandActive_(false),
+    finePending_(false),
+    coupleC_(NULL),
+    coupleAxisNo_(0),
+    coupleEnabled_(false),
+    coupleLocked_(false),
+    coupleActive_(false),
+    couplePaused_(0),
+    coupleOffset_(0.),
+    coupleStart_(0.),
+    coupleMaxDiff_(0.),
+    pauseActive_(false),
+    compareArmed_(false),
+    compareSent_(0),
+    compareArmTime_(0.),
+    compareSampleValid_(false),
+    comparePosition_(0.),
+    compareTime_(0.),
+    sampleValid_(false),
+    samplePosition_(0.),
+    measVelocity_(0.),
+    moveActive_(false),
+    moveStart_(0.),
+    moveOvershoot_(0.),
+    settleMean_(-1.),
+    movePeakVelocity_(0.),
+    settled_(false),
+    stalled_(false),
+    stallValid_(false),
+    stallPosition_(0.),
+    stallMinFreq_(0),
+    streamPending_(false),
+    streamSetpoint_(0.),
+    streamFreq_(0),
+    jogActive_(false),
+    jogDirection_(1),
+    jogRearmMoving_(true),
+    autotuneActive_(false),
+    autotuneAbort_(false),
+    homeActive_(false),
+    homeAbort_(false)
 {  
+  setIntegerParam(pC_->MD90RampIncrements_, RAMP_INCREMENTS);
+  setIntegerParam(pC_->MD90RampActive_, 0);
+  setIntegerParam(pC_->MD90StepFrequency_, 0);
+  setDoubleParam(pC_->MD90CountsPerStep_, countsPerStep_);
+  setDoubleParam(pC_->MD90CalGain_, CAL_GAIN);
+  setIntegerParam(pC_->MD90CalSamples_, 0);
+  setDoubleParam(pC_->MD90MoveEta_, 0.);
+  setDoubleParam(pC_->MD90MeasVelocity_, 0.);
+  setDoubleParam(pC_->MD90SettleWindow_, SETTLE_WINDOW);
+  setDoubleParam(pC_->MD90MoveDuration_, 0.);
+  setDoubleParam(pC_->MD90SettleTime_, 0.);
+  setDoubleParam(pC_->MD90Overshoot_, 0.);
+  setDoubleParam(pC_->MD90FinalError_, 0.);
+  setIntegerParam(pC_->MD90MoveCount_, 0);
+  setIntegerParam(pC_->MD90MoveErrors_, 0);
+  setIntegerParam(pC_->MD90StallPolicy_, MD90_STALL_IGNORE);
+  setDoubleParam(pC_->MD90StallTime_, STALL_TIME);
+  setDoubleParam(pC_->MD90StallThreshold_, STALL_THRESHOLD);
+  setIntegerParam(pC_->MD90Stalled_, 0);
+  setIntegerParam(pC_->MD90StallCount_, 0);
+  setIntegerParam(pC_->MD90StreamMode_, 0);
+  setIntegerParam(pC_->MD90StreamSent_, 0);
+  setIntegerParam(pC_->MD90StreamDrops_, 0);
+  setDoubleParam(pC_->MD90StreamLatency_, 0.);
+  setDoubleParam(pC_->MD90StreamMaxLatency_, 0.);
+  setIntegerParam(pC_->MD90Autotune_, 0);
+  setIntegerParam(pC_->MD90AutotuneState_, MD90_AUTOTUNE_IDLE);
+  setDoubleParam(pC_->MD90AutotuneStep_, AUTOTUNE_STEP);
+  setIntegerParam(pC_->MD90AutotuneMinGain_, 100);
+  setIntegerParam(pC_->MD90AutotuneMaxGain_, 1000);
+  setIntegerParam(pC_->MD90AutotuneNumGains_, 10);
+  setIntegerParam(pC_->MD90AutotuneGain_, 0);
+  setDoubleParam(pC_->MD90AutotuneSettle_, 0.);
+  setDoubleParam(pC_->MD90AutotuneOvershoot_, 0.);
+  setDoubleParam(pC_->MD90HomeTime_, 0.);
+  setIntegerParam(pC_->MD90Reconcile_, MD90_RECONCILE_PENDING);
+  setDoubleParam(pC_->MD90ReconcileTolerance_, RECONCILE_TOLERANCE);
+  setIntegerParam(pC_->MD90Deadband_, -1);
+  setIntegerParam(pC_->MD90ReattachCount_, 0);
+  setIntegerParam(pC_->MD90RecoverBusy_, MD90_RECOVER_FAIL);
+  setIntegerParam(pC_->MD90RecoverStance_, MD90_RECOVER_FAIL);
+  setIntegerParam(pC_->MD90RecoverRamp_, MD90_RECOVER_FAIL);
+  setIntegerParam(pC_->MD90RetryLimit_, RETRY_LIMIT);
+  setDoubleParam(pC_->MD90RetryDelay_, RETRY_DELAY);
+  setIntegerParam(pC_->MD90RetryCount_, 0);
+  setIntegerParam(pC_->MD90LastError_, MD90_ERROR_NONE);
+  setIntegerParam(pC_->MD90ReadNow_, 0);
+  setDoubleParam(pC_->MD90Position_, 0.);
+  setDoubleParam(pC_->MD90SettleMean_, 0.);
+  setIntegerParam(pC_->MD90Plan_, 0);
+  setDoubleParam(pC_->MD90PlanTotal_, 0.);
+  setDoubleParam(pC_->MD90PlanNaturalTotal_, 0.);
+  setDoubleParam(pC_->MD90PollJitter_, 0.);
+  setDoubleParam(pC_->MD90PollJitterMean_, 0.);
+  setDoubleParam(pC_->MD90PollJitterMax_, 0.);
+  setIntegerParam(pC_->MD90ApproachMode_, MD90_APPROACH_OFF);
+  setDoubleParam(pC_->MD90ApproachDistance_, APPROACH_DISTANCE);
+  setIntegerParam(pC_->MD90CompareArm_, 0);
+  setIntegerParam(pC_->MD90CompareEvent_, -1);
+  setIntegerParam(pC_->MD90CompareCount_, 0);
+  setDoubleParam(pC_->MD90CompareLatency_, 0.);
+  setDoubleParam(pC_->MD90CompareLatencyMax_, 0.);
+  setIntegerParam(pC_->MD90PrecisionMode_, MD90_PRECISION_FINE);
+  setIntegerParam(pC_->MD90CoarseDeadband_, COARSE_DEADBAND);
+  setIntegerParam(pC_->MD90ActiveDeadband_, -1);
+  setIntegerParam(pC_->MD90CoupleEnable_, 0);
+  setDoubleParam(pC_->MD90CoupleThreshold_, COUPLE_THRESHOLD);
+  setDoubleParam(pC_->MD90CoupleOffset_, 0.);
+  setDoubleParam(pC_->MD90CoupleDiff_, 0.);
+  setDoubleParam(pC_->MD90CoupleMaxDiff_, 0.);
+  setIntegerParam(pC_->MD90CouplePauses_, 0);
+  memset(errorCounts_, 0, sizeof(errorCounts_));
 }
 
 /** Reports on status of the axis
@@ -136,75 +728,1140 @@ void MD90Axis::report(FILE *fp, int level)
   if (level > 0) {
     fprintf(fp, "  axis %d\n",
             axisNo_);
+    fprintf(fp, "    counts per step %f, step frequency %d Hz\n",
+            countsPerStep_, stepFreq_);
   }
 
   // Call the base class method
   asynMotorAxis::report(fp, level);
 }
 
+/** Send a query command and return the numeric value of the reply.
+  * \param[in] command       Command to send, e.g. "GEC"
+  * \param[out] value        Value field of the reply
+  * Returns asynError if the controller returns a non-zero reply code or the reply cannot be parsed.
+  */
+asynStatus MD90Axis::query(const char *command, double *value)
+{
+  MD90Reply reply;
+  asynStatus status;
+
+  sprintf(pC_->outString_, "%s", command);
+  status = pC_->writeReadController();
+  if (status) return status;
+  // The response string is of the form "0: <description>: <value>"
+  if (!md90ParseReply(pC_->inString_, &reply) || !reply.ok() || !reply.hasValue) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "MD90Axis::query: %s: %s\n",
+      command, pC_->inString_);
+    return asynError;
+  }
+  *value = reply.value;
+  return asynSuccess;
+}
+
+/** Send a poll query and parse the reply.  A reply that cannot be parsed is a
+  * communication error; a refused query or one without a value is reported, and
+  * the caller leaves the value it reads unchanged (reply->ok() && reply->hasValue).
+  * \param[in] command       Command to send, e.g. "STA"
+  * \param[out] reply        The parsed reply
+  */
+asynStatus MD90Axis::pollQuery(const char *command, MD90Reply *reply)
+{
+  asynStatus status;
+
+  sprintf(pC_->outString_, "%s", command);
+  status = pC_->writeReadController();
+  if (status) return status;
+  if (!md90ParseReply(pC_->inString_, reply)) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "MD90Axis::poll: %s: invalid reply \"%s\"\n", command, pC_->inString_);
+    return asynError;
+  }
+  if (!reply->ok() || !reply->hasValue) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "MD90Axis::poll: %s: %s\n", command, pC_->inString_);
+  }
+  return asynSuccess;
+}
+
 /** Print out message if the motor controller returns a non-zero error code
   * \param[in] functionName  The function originating the call
   * \param[in] reply         Reply message returned from motor controller
+  * \param[out] pStatus      Optional; the reply code returned by the controller (-1 if no reply)
   */
-asynStatus MD90Axis::parseReply(const char *functionName, const char *reply)
+asynStatus MD90Axis::parseReply(const char *functionName, const char *reply, int *pStatus)
 {
-  int replyStatus;
-  char replyString[256];
-  int replyValue;
+  MD90Reply parsed;
+  int replyStatus = 0;
   asynStatus comStatus;
 
   comStatus = asynSuccess;
 
-  if (reply[0] == '\0') {
+  // No reply, or one that cannot be parsed, is a communication error
+  if (reply[0] == '\0' || !md90ParseReply(reply, &parsed)) {
     comStatus = asynError;
-	replyStatus = -1;
-  } else if ( strcmp(reply, "Unrecognized command.") == 0 ) {
-    replyStatus = 6;
+    replyStatus = MD90_REPLY_NONE;
   } else {
-    sscanf(reply, "%d: %[^:]: %d", &replyStatus, replyString, &replyValue);
+    replyStatus = parsed.code;
   }
 
   if (replyStatus != 0) {
     asynPrint(pasynUser_, ASYN_TRACE_ERROR,
       "%s:  %s\n",
       functionName, reply);
+    if (comStatus) {
+      countError(MD90_ERROR_COMM);
+    } else if (replyStatus == REPLY_CANNOT_EXECUTE_MOVING) {
+      countError(MD90_ERROR_BUSY);
+    } else {
+      countError(MD90_ERROR_REJECTED);
+    }
   }
 
+  if (pStatus) *pStatus = replyStatus;
   return comStatus;
 }
 
-/** Acceleration currently unsupported with MD-90 controller
+/** Convert a velocity to the step frequency sent to the controller
+  * \param[in] velocity      Motor velocity in encoder counts / sec
+  */
+int MD90Axis::velocityToFrequency(double velocity)
+{
+  // Our unit step size of the encoder is 10 nm, but the motor moves in steps approx. 10 micrometers.
+  // Motor controller accepts step frequency in Hz.
+  return NINT(fabs(velocity / countsPerStep_));
+}
+
+/** Predict the duration of a closed loop move from the calibrated counts per step.
+  * \param[in] distance      Move distance in encoder counts
+  * \param[in] minVelocity   Base velocity in encoder counts / sec
+  * \param[in] maxVelocity   Cruise velocity in encoder counts / sec
+  * \param[in] acceleration  Acceleration in encoder counts / sec / sec, 0 if the move is not ramped
+  */
+double MD90Axis::predictMoveTime(double distance, double minVelocity, double maxVelocity, double acceleration)
+{
+  double vMax, vMin, vPeak, rampDistance;
+
+  distance = fabs(distance);
+  vMax = velocityToFrequency(maxVelocity) * countsPerStep_;
+  if (vMax <= 0.) return 0.;
+  if (acceleration <= 0.) return distance / vMax;
+
+  vMin = velocityToFrequency(minVelocity);
+  if (vMin < 1) vMin = 1;
+  vMin *= countsPerStep_;
+  if (vMin > vMax) vMin = vMax;
+
+  // Trapezoidal profile, or triangular if the move is too short to reach cruise velocity
+  rampDistance = (vMax * vMax - vMin * vMin) / acceleration;
+  if (distance >= rampDistance) {
+    return 2. * (vMax - vMin) / acceleration + (distance - rampDistance) / vMax;
+  }
+  vPeak = sqrt(vMin * vMin + acceleration * distance);
+  return 2. * (vPeak - vMin) / acceleration;
+}
+
+/** Refine the counts per step estimate from the encoder progress since the last sample.
+  * Samples are only taken while the motor is stepping at a constant frequency towards
+  * a target several steps away, so that the closed loop extension phase is excluded.
+  * \param[in] position      Current encoder position in counts
+  * \param[in] status        Current STA status value
+  */
+void MD90Axis::updateCalibration(double position, int status)
+{
+  epicsTimeStamp now;
+  double gain, dt, steps, sample;
+  int samples;
+
+  epicsTimeGetCurrent(&now);
+  if (status != 2 || stepFreq_ <= 0 ||
+      fabs(moveTarget_ - position) < CAL_MIN_STEPS * countsPerStep_) {
+    calValid_ = false;
+    return;
+  }
+  if (calValid_ && calFreq_ == stepFreq_) {
+    dt = epicsTimeDiffInSeconds(&now, &calTime_);
+    if (dt < CAL_MIN_INTERVAL) return;
+    steps = stepFreq_ * dt;
+    if (steps >= CAL_MIN_STEPS) {
+      sample = fabs(position - calPosition_) / steps;
+      pC_->getDoubleParam(axisNo_, pC_->MD90CalGain_, &gain);
+      if (gain > 0. && gain <= 1. &&
+          sample > MD90_COUNTS_PER_STEP / CAL_LIMIT_FACTOR &&
+          sample < MD90_COUNTS_PER_STEP * CAL_LIMIT_FACTOR) {
+        countsPerStep_ += gain * (sample - countsPerStep_);
+        setDoubleParam(pC_->MD90CountsPerStep_, countsPerStep_);
+        pC_->getIntegerParam(axisNo_, pC_->MD90CalSamples_, &samples);
+        setIntegerParam(pC_->MD90CalSamples_, samples + 1);
+        stateChanged_ = true;
+      }
+    }
+  }
+  calValid_ = true;
+  calPosition_ = position;
+  calFreq_ = stepFreq_;
+  calTime_ = now;
+}
+
+/** Start tracking the statistics of a closed loop move towards moveTarget_ */
+void MD90Axis::startMoveStats()
+{
+  moveActive_ = true;
+  moveStart_ = lastPosition_;
+  epicsTimeGetCurrent(&moveStartTime_);
+  MD90Recorder::post(pC_->recorderId_, axisNo_, MD90_RECORD_MOVE_START, lastPosition_, lastStatus_, 0, moveTarget_);
+  moveOvershoot_ = 0.;
+  movePeakVelocity_ = 0.;
+  settled_ = false;
+}
+
+/** Update the measured velocity from a new encoder sample, and the statistics of
+  * the move in progress.  When the move is over the statistics are published as
+  * parameters and as the MD90_MOVE_SUMMARY waveform.
+  * \param[in] position      Current encoder position in counts
+  * \param[in] status        Current STA status value
+  * \param[in] moving        The axis is moving
+  */
+void MD90Axis::updateMoveStats(double position, int status, bool moving)
+{
+  epicsTimeStamp now;
+  double dt, direction, window, duration, finalError;
+  double summary[MD90_SUMMARY_SIZE];
+  int moves, errors;
+
+  epicsTimeGetCurrent(&now);
+  if (sampleValid_) {
+    dt = epicsTimeDiffInSeconds(&now, &sampleTime_);
+    if (dt > 0.) {
+      measVelocity_ = (position - samplePosition_) / dt;
+      setDoubleParam(pC_->MD90MeasVelocity_, measVelocity_);
+    }
+  }
+  sampleValid_ = true;
+  samplePosition_ = position;
+  sampleTime_ = now;
+
+  if (!moveActive_) return;
+
+  if (fabs(measVelocity_) > movePeakVelocity_) movePeakVelocity_ = fabs(measVelocity_);
+  direction = (moveTarget_ >= moveStart_) ? 1. : -1.;
+  if ((position - moveTarget_) * direction > moveOvershoot_) {
+    moveOvershoot_ = (position - moveTarget_) * direction;
+  }
+  pC_->getDoubleParam(axisNo_, pC_->MD90SettleWindow_, &window);
+  if (fabs(position - moveTarget_) <= window) {
+    if (!settled_) settleTime_ = now;
+    settled_ = true;
+  } else {
+    settled_ = false;
+  }
+
+  if (moving) return;
+
+  // The move is over
+  moveActive_ = false;
+  duration = epicsTimeDiffInSeconds(&now, &moveStartTime_);
+  finalError = position - moveTarget_;
+  pC_->getIntegerParam(axisNo_, pC_->MD90MoveCount_, &moves);
+  pC_->getIntegerParam(axisNo_, pC_->MD90MoveErrors_, &errors);
+  moves++;
+  if (md90IsErrorStatus(status)) errors++;
+  pC_->metrics_.current().axes[axisNo_].moves++;
+  pC_->metrics_.current().axes[axisNo_].moveDuration.observe(duration);
+  MD90Recorder::post(pC_->recorderId_, axisNo_, MD90_RECORD_MOVE_END, position, status, 0, finalError);
+
+  summary[MD90_SUMMARY_MOVE]          = moves;
+  summary[MD90_SUMMARY_TARGET]        = moveTarget_;
+  summary[MD90_SUMMARY_DURATION]      = duration;
+  summary[MD90_SUMMARY_SETTLE]        = settled_ ? epicsTimeDiffInSeconds(&now, &settleTime_) : 0.;
+  summary[MD90_SUMMARY_OVERSHOOT]     = moveOvershoot_;
+  summary[MD90_SUMMARY_FINAL_ERROR]   = finalError;
+  summary[MD90_SUMMARY_PEAK_VELOCITY] = movePeakVelocity_;
+  summary[MD90_SUMMARY_MEAN_VELOCITY] = (duration > 0.) ? fabs(position - moveStart_) / duration : 0.;
+  summary[MD90_SUMMARY_STATUS]        = status;
+
+  setIntegerParam(pC_->MD90MoveCount_, moves);
+  setIntegerParam(pC_->MD90MoveErrors_, errors);
+  setDoubleParam(pC_->MD90MoveDuration_, duration);
+  setDoubleParam(pC_->MD90SettleTime_, summary[MD90_SUMMARY_SETTLE]);
+  // Only moves that reached the settle window tell how long settling takes
+  if (settled_) {
+    settleMean_ = (settleMean_ < 0.) ? summary[MD90_SUMMARY_SETTLE] :
+      settleMean_ + SETTLE_GAIN * (summary[MD90_SUMMARY_SETTLE] - settleMean_);
+    setDoubleParam(pC_->MD90SettleMean_, settleMean_);
+  }
+  setDoubleParam(pC_->MD90Overshoot_, moveOvershoot_);
+  setDoubleParam(pC_->MD90FinalError_, finalError);
+  pC_->doCallbacksFloat64Array(summary, MD90_SUMMARY_SIZE, pC_->MD90MoveSummary_, axisNo_);
+}
+
+/** Detect a stalled move by comparing encoder progress with the progress expected
+  * from the commanded step frequency.  Progress is judged over windows of
+  * MD90_STALL_TIME while the motor is stepping; the final closed loop extension
+  * phase near the target is excluded.
+  * \param[in] position      Current encoder position in counts
+  * \param[in] status        Current STA status value
+  * \return true if a stall was detected by this call
+  */
+bool MD90Axis::checkStall(double position, int status)
+{
+  epicsTimeStamp now;
+  int policy, count;
+  double window, threshold, dt, expected, progress;
+  static const char *functionName = "MD90Axis::checkStall";
+
+  pC_->getIntegerParam(axisNo_, pC_->MD90StallPolicy_, &policy);
+  if (policy == MD90_STALL_IGNORE || stalled_ || status != 2 || stepFreq_ <= 0 ||
+      fabs(moveTarget_ - position) < CAL_MIN_STEPS * countsPerStep_) {
+    stallValid_ = false;
+    return false;
+  }
+
+  epicsTimeGetCurrent(&now);
+  if (!stallValid_) {
+    stallValid_ = true;
+    stallPosition_ = position;
+    stallMinFreq_ = stepFreq_;
+    stallTime_ = now;
+    return false;
+  }
+  if (stepFreq_ < stallMinFreq_) stallMinFreq_ = stepFreq_;
+
+  pC_->getDoubleParam(axisNo_, pC_->MD90StallTime_, &window);
+  dt = epicsTimeDiffInSeconds(&now, &stallTime_);
+  if (dt < window) return false;
+
+  pC_->getDoubleParam(axisNo_, pC_->MD90StallThreshold_, &threshold);
+  expected = stallMinFreq_ * countsPerStep_ * dt;
+  progress = (position - stallPosition_) * ((moveTarget_ >= stallPosition_) ? 1. : -1.);
+  stallValid_ = false;
+  if (progress >= threshold * expected) return false;
+
+  stalled_ = true;
+  pC_->getIntegerParam(axisNo_, pC_->MD90StallCount_, &count);
+  setIntegerParam(pC_->MD90StallCount_, count + 1);
+  setIntegerParam(pC_->MD90Stalled_, 1);
+  asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+    "%s: axis %d stalled, moved %.0f of %.0f expected counts in %.2f s\n",
+    functionName, axisNo_, progress, expected, dt);
+
+  if (policy == MD90_STALL_STOP) {
+    stop(0.);
+  }
+  return true;
+}
+
+/** Checks that the axis can be commanded to move; prints an error if not.
+  * \param[in] functionName  Name of the calling method, for the error message
+  * \param[in] leaderAllowed The leader of an enabled coupled pair may make this move
+  * \return asynError if autotune or a group home is in progress, or the axis is coupled */
+asynStatus MD90Axis::checkMoveAllowed(const char *functionName, bool leaderAllowed)
+{
+  if (autotuneActive_) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: autotune in progress\n", functionName);
+    return asynError;
+  }
+  if (homeActive_) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: group home in progress\n", functionName);
+    return asynError;
+  }
+  if (coupleLocked_) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: axis follows a coupled leader\n", functionName);
+    return asynError;
+  }
+  if (coupleEnabled_ && !leaderAllowed) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: axis is coupled\n", functionName);
+    return asynError;
+  }
+  return asynSuccess;
+}
+
+/** Queue a setpoint written to MD90_STREAM_SETPOINT or MD90_STREAM_SETPOINTS.
+  * Refused unless streaming mode is on and the axis can be moved; the leader of a
+  * coupled pair is refused too, as streamed setpoints are not sent to the follower.
+  * \param[in] target        Absolute target position in encoder counts
+  */
+asynStatus MD90Axis::streamSetpoint(double target)
+{
+  int streaming;
+  static const char *functionName = "MD90Axis::streamSetpoint";
+
+  pC_->getIntegerParam(axisNo_, pC_->MD90StreamMode_, &streaming);
+  if (!streaming) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: streaming mode is off\n", functionName);
+    return asynError;
+  }
+  if (checkMoveAllowed(functionName, false)) return asynError;
+
+  jogActive_ = false;
+  moveTarget_ = target;
+  startMoveStats();
+  queueSetpoint(target, 0);
+  return asynSuccess;
+}
+
+/** Queue a closed loop setpoint to be sent by the poller.
+  * A setpoint that is still pending is superseded and counted as dropped.
+  * \param[in] target        Absolute target position in encoder counts
+  * \param[in] freq          Step frequency for the move in Hz, 0 to keep the current one
+  */
+void MD90Axis::queueSetpoint(double target, int freq)
+{
+  int drops;
+
+  if (streamPending_) {
+    pC_->getIntegerParam(axisNo_, pC_->MD90StreamDrops_, &drops);
+    setIntegerParam(pC_->MD90StreamDrops_, drops + 1);
+  } else {
+    // Latency is measured from the oldest setpoint the controller has not seen
+    epicsTimeGetCurrent(&streamTime_);
+  }
+  streamPending_ = true;
+  streamSetpoint_ = target;
+  if (freq > 0) streamFreq_ = freq;
+  pC_->wakeupPoller();
+}
+
+/** Send the pending streamed setpoint.  SSF is only sent if the step frequency changes. */
+asynStatus MD90Axis::sendSetpoint()
+{
+  epicsTimeStamp now;
+  double latency, maxLatency;
+  int replyStatus, sent;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "MD90Axis::sendSetpoint";
+
+  streamPending_ = false;
+  if (streamFreq_ > 0 && streamFreq_ != stepFreq_) {
+    status = sendStepFrequency(streamFreq_, &replyStatus);
+  }
+  streamFreq_ = 0;
+  moveTarget_ = streamSetpoint_;
+  if (!status) {
+    sprintf(pC_->outString_, "CLM %d", NINT(streamSetpoint_ * 10));
+    status = pC_->writeReadController();
+  }
+  if (!status) {
+    status = parseReply(functionName, pC_->inString_, &replyStatus);
+  }
+  // Only a setpoint the controller accepted is counted and timed
+  if (status || replyStatus != 0) return status;
+
+  epicsTimeGetCurrent(&now);
+  latency = epicsTimeDiffInSeconds(&now, &streamTime_) * 1000.;
+  pC_->getDoubleParam(axisNo_, pC_->MD90StreamMaxLatency_, &maxLatency);
+  pC_->getIntegerParam(axisNo_, pC_->MD90StreamSent_, &sent);
+  setIntegerParam(pC_->MD90StreamSent_, sent + 1);
+  setDoubleParam(pC_->MD90StreamLatency_, latency);
+  if (latency > maxLatency) setDoubleParam(pC_->MD90StreamMaxLatency_, latency);
+  return status;
+}
+
+/** Restore one item of persisted state read from the state file
+  * \param[in] key           Name of the item
+  * \param[in] value         Saved value
+  */
+void MD90Axis::restoreState(const char *key, double value)
+{
+  if (strcmp(key, "countsPerStep") == 0) {
+    if (value > MD90_COUNTS_PER_STEP / CAL_LIMIT_FACTOR && value < MD90_COUNTS_PER_STEP * CAL_LIMIT_FACTOR) {
+      countsPerStep_ = value;
+      setDoubleParam(pC_->MD90CountsPerStep_, countsPerStep_);
+    }
+  } else if (strcmp(key, "position") == 0) {
+    savedPosition_ = value;
+  } else if (strcmp(key, "homed") == 0) {
+    savedHomed_ = (value != 0.) ? 1 : 0;
+  } else if (strcmp(key, "powerOn") == 0) {
+    powerOn_ = NINT(value);
+  } else if (strcmp(key, "gain") == 0) {
+    gain_ = NINT(value);
+  } else if (strcmp(key, "persistentMove") == 0) {
+    persistentMove_ = NINT(value);
+  } else if (strcmp(key, "stepFrequency") == 0) {
+    stepFreq_ = NINT(value);
+  } else if (strcmp(key, "deadband") == 0) {
+    setIntegerParam(pC_->MD90Deadband_, NINT(value));
+  }
+}
+
+/** Compares the home state read at the first poll with the state file.
+  * If the controller stayed powered while the IOC was down it is still referenced, and the
+  * axis does not need homing again.  When the home state or position disagrees with the file,
+  * something moved the axis while the driver was not watching; the homed status is withheld
+  * until the axis is homed again.
+  * \param[in] position  Encoder position (counts)
+  * \param[in] homed     Home status read with GHS */
+void MD90Axis::reconcile(double position, int homed)
+{
+  double tolerance;
+  int state;
+  static const char *functionName = "MD90Axis::reconcile";
+
+  pC_->getDoubleParam(axisNo_, pC_->MD90ReconcileTolerance_, &tolerance);
+  if (!homed) {
+    state = MD90_RECONCILE_NOT_HOMED;
+  } else if (savedHomed_ < 0) {
+    state = MD90_RECONCILE_NO_STATE;
+  } else if (savedHomed_ && fabs(position - savedPosition_) <= tolerance) {
+    state = MD90_RECONCILE_REFERENCED;
+  } else {
+    state = MD90_RECONCILE_MISMATCH;
+    homeSuspect_ = true;
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: %s axis %d: homed at %f, state file has %s at %f; home the axis again\n",
+      functionName, pC_->portName, axisNo_, position,
+      savedHomed_ ? "homed" : "not homed", savedPosition_);
+  }
+  if (state == MD90_RECONCILE_REFERENCED) {
+    asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+      "%s: %s axis %d: still referenced at %f\n",
+      functionName, pC_->portName, axisNo_, position);
+  }
+  setIntegerParam(pC_->MD90Reconcile_, state);
+}
+
+/** Write the persisted state of this axis to the state file
+  * \param[in] fp            File pointer of the state file
+  */
+void MD90Axis::saveState(FILE *fp)
+{
+  int deadband;
+
+  fprintf(fp, "axis %d countsPerStep %.6g\n", axisNo_, countsPerStep_);
+  fprintf(fp, "axis %d position %.1f\n", axisNo_, lastPosition_);
+  fprintf(fp, "axis %d homed %d\n", axisNo_, (homed_ && !homeSuspect_) ? 1 : 0);
+  pC_->getIntegerParam(axisNo_, pC_->MD90Deadband_, &deadband);
+  if (powerOn_ >= 0)        fprintf(fp, "axis %d powerOn %d\n", axisNo_, powerOn_);
+  if (gain_ > 0)            fprintf(fp, "axis %d gain %d\n", axisNo_, gain_);
+  if (persistentMove_ >= 0) fprintf(fp, "axis %d persistentMove %d\n", axisNo_, persistentMove_);
+  if (stepFreq_ > 0)        fprintf(fp, "axis %d stepFrequency %d\n", axisNo_, stepFreq_);
+  if (deadband >= 0)        fprintf(fp, "axis %d deadband %d\n", axisNo_, deadband);
+  savedPosition_ = lastPosition_;
+  savedHomed_ = (homed_ && !homeSuspect_) ? 1 : 0;
+}
+
+/** Send a new step frequency to the controller
+  * \param[in] freq          Step frequency in Hz
+  * \param[out] replyStatus  Reply code returned by the controller
+  */
+asynStatus MD90Axis::sendStepFrequency(int freq, int *replyStatus)
+{
+  asynStatus status;
+  static const char *functionName = "MD90Axis::sendStepFrequency";
+
+  *replyStatus = -1;
+  sprintf(pC_->outString_, "SSF %d", freq);
+  status = pC_->writeReadController();
+  if (!status) {
+    status = parseReply(functionName, pC_->inString_, replyStatus);
+  }
+  if (!status && *replyStatus == 0) {
+    stepFreq_ = freq;
+    setIntegerParam(pC_->MD90StepFrequency_, freq);
+  }
+  return status;
+}
+
+/** Brings the controller in line with the configuration from the state file.
+  * Called once the state file has been read, before iocInit.  One query per setting finds
+  * out what the controller holds, and only settings that differ from the file are written.
+  * The deadband cannot be read back; it is only written if the controller has lost its
+  * reference, i.e. it has been power cycled since the file was written. */
+asynStatus MD90Axis::warmStart()
+{
+  double power, homed, gain, persistent, freq;
+  int deadband, replyStatus, nWrites = 0;
+  asynStatus status;
+  static const char *functionName = "MD90Axis::warmStart";
+
+  status = query("GPS", &power);
+  if (!status) status = query("GHS", &homed);
+  if (!status) status = query("GGN", &gain);
+  if (!status) status = query("GPM", &persistent);
+  if (!status) status = query("GSF", &freq);
+  if (status) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: %s axis %d: cannot read the controller settings\n",
+      functionName, pC_->portName, axisNo_);
+    return status;
+  }
+
+  if (powerOn_ == 1 && NINT(power) != 1) {
+    sprintf(pC_->outString_, "EPS");
+    status = pC_->writeReadController();
+    if (!status) parseReply(functionName, pC_->inString_);
+    nWrites++;
+  }
+  if (!status && gain_ > 0 && NINT(gain) != gain_) {
+    sprintf(pC_->outString_, "SGN %d", gain_);
+    status = pC_->writeReadController();
+    if (!status) parseReply(functionName, pC_->inString_);
+    nWrites++;
+  }
+  if (!status && persistentMove_ >= 0 && (NINT(persistent) != 0) != (persistentMove_ != 0)) {
+    sprintf(pC_->outString_, persistentMove_ ? "EPM" : "DPM");
+    status = pC_->writeReadController();
+    if (!status) parseReply(functionName, pC_->inString_);
+    nWrites++;
+  }
+  if (!status && stepFreq_ > 0 && NINT(freq) != stepFreq_) {
+    status = sendStepFrequency(stepFreq_, &replyStatus);
+    nWrites++;
+  } else if (stepFreq_ <= 0) {
+    stepFreq_ = NINT(freq);
+  }
+  pC_->getIntegerParam(axisNo_, pC_->MD90Deadband_, &deadband);
+  if (!status && deadband >= 0) {
+    if (NINT(homed) != 1 || savedHomed_ != 1) {
+      status = sendDeadband(deadband);
+      nWrites++;
+    }
+    if (!status) {
+      deadbandVerified_ = true;
+      activeDeadband_ = deadband;
+      setIntegerParam(pC_->MD90ActiveDeadband_, deadband);
+    }
+  }
+  setIntegerParam(pC_->MD90StepFrequency_, stepFreq_);
+
+  asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+    "%s: %s axis %d: %d setting(s) written\n",
+    functionName, pC_->portName, axisNo_, nWrites);
+  return status;
+}
+
+/** Sets the closed loop deadband.
+  * \param[in] deadband  Deadband in nm */
+asynStatus MD90Axis::sendDeadband(int deadband)
+{
+  asynStatus status;
+  static const char *functionName = "MD90Axis::sendDeadband";
+
+  sprintf(pC_->outString_, "SDB %d", deadband);
+  status = pC_->writeReadController();
+  if (!status) {
+    status = parseReply(functionName, pC_->inString_);
+  }
+  if (!status) {
+    activeDeadband_ = deadband;
+    setIntegerParam(pC_->MD90ActiveDeadband_, deadband);
+  }
+  return status;
+}
+
+/** Puts back the settings cached while connected, after the controller has been out of reach.
+  * The controller may have been power cycled or replaced by the same one on a different
+  * device node, so the power supply, deadband, gain, step frequency and persistent move
+  * state are all written again.  A refused setting is reported but does not stop the rest.
+  * Returns an error, and leaves the axis marked as disconnected, if the controller still
+  * does not answer. */
+asynStatus MD90Axis::restoreSettings()
+{
+  double value;
+  int deadband, count, replyStatus;
+  asynStatus status;
+  static const char *functionName = "MD90Axis::restoreSettings";
+
+  status = query("STA", &value);
+  if (status) return status;
+
+  asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+    "%s: %s axis %d: controller answers again, restoring settings\n",
+    functionName, pC_->portName, axisNo_);
+  commLost_ = false;
+  jogActive_ = false;
+  rampActive_ = false;
+  setIntegerParam(pC_->MD90RampActive_, 0);
+  pC_->getIntegerParam(axisNo_, pC_->MD90ReattachCount_, &count);
+  setIntegerParam(pC_->MD90ReattachCount_, count + 1);
+
+  if (powerOn_ == 1) {
+    sprintf(pC_->outString_, "EPS");
+    status = pC_->writeReadController();
+    if (!status) parseReply(functionName, pC_->inString_);
+  }
+  pC_->getIntegerParam(axisNo_, pC_->MD90Deadband_, &deadband);
+  if (!status && deadband >= 0) {
+    status = sendDeadband(deadband);
+    if (!status) moveDeadbandActive_ = false;
+  }
+  if (!status && gain_ > 0) {
+    sprintf(pC_->outString_, "SGN %d", gain_);
+    status = pC_->writeReadController();
+    if (!status) parseReply(functionName, pC_->inString_);
+  }
+  if (!status && stepFreq_ > 0) {
+    status = sendStepFrequency(stepFreq_, &replyStatus);
+  }
+  if (!status && persistentMove_ >= 0) {
+    sprintf(pC_->outString_, persistentMove_ ? "EPM" : "DPM");
+    status = pC_->writeReadController();
+    if (!status) parseReply(functionName, pC_->inString_);
+  }
+  // A refused setting has been reported; only a lost connection is an error here
+  if (status) {
+    commLost_ = true;
+  } else {
+    MD90AxisMetrics &metrics = pC_->metrics_.current().axes[axisNo_];
+    metrics.recoveryDuration.observe(MD90Metrics::now() - metrics.commLostSince);
+    metrics.commLostSince = 0.;
+  }
+  return status;
+}
+
+/** Set the step frequency used for the next move.
+  * Acceleration is not supported by the controller itself; ramped moves are
+  * handled on the host by startRamp() and updateRamp().
   * \param[in] acceleration  The accelerations to ramp up to max velocity
   * \param[in] velocity      Motor velocity in steps / sec
   */
 asynStatus MD90Axis::sendAccelAndVelocity(double acceleration, double velocity) 
 {
+  int replyStatus;
+  int freq = velocityToFrequency(velocity);
+
   asynStatus status;
-  int freq;
-  static const char *functionName = "MD90::sendAccelAndVelocity";
 
-  // Send the velocity
-  // Velocity provided in steps/sec
-  // Our unit step size of the encoder is 10 nm, but the motor moves in steps approx. 10 micrometers.
-  // Motor controller accepts step frequency in Hz.
-  freq = NINT(fabs(velocity / COUNTS_PER_STEP));
-  sprintf(pC_->outString_, "SSF %d", freq);
+  // stepFreq_ is confirmed by GSF on every poll, so an unchanged frequency need not be sent
+  if (freq == stepFreq_) return asynSuccess;
+  status = sendStepFrequency(freq, &replyStatus);
+  if (!status && replyStatus == REPLY_CANNOT_EXECUTE_MOVING) {
+    status = recoverBusy(freq);
+  }
+  return status;
+}
+
+/** Reads the position, and optionally the status, outside the poll cycle.
+  * The readbacks are updated and timestamped at once; the poller schedule is not changed.
+  * \param[in] readStatus  Also read STA and update the done and problem status */
+asynStatus MD90Axis::readNow(bool readStatus)
+{
+  double position, status;
+  double sampleStart = MD90Metrics::now();
+  epicsTimeStamp now;
+  asynStatus comStatus;
+
+  comStatus = query("GEC", &position);
+  if (!comStatus) checkCompare(position, (sampleStart + MD90Metrics::now()) / 2.);
+  if (!comStatus && readStatus) comStatus = query("STA", &status);
+  if (comStatus) return comStatus;
+
+  epicsTimeGetCurrent(&now);
+  pC_->setTimeStamp(&now);
+  setDoubleParam(pC_->motorPosition_, position);
+  setDoubleParam(pC_->motorEncoderPosition_, position);
+  setDoubleParam(pC_->MD90Position_, position);
+  lastPosition_ = position;
+  if (readStatus) {
+    setIntegerParam(pC_->motorStatusDone_, (NINT(status) == 2 || jogActive_) ? 0:1);
+    if (md90IsErrorStatus(NINT(status))) setIntegerParam(pC_->motorStatusProblem_, 1);
+  }
+  callParamCallbacks();
+  publishCompare();
+  return asynSuccess;
+}
+
+/** Records an error in the per-class counters.
+  * \param[in] errorClass  One of MD90ErrorClass */
+void MD90Axis::countError(int errorClass)
+{
+  if (errorClass <= MD90_ERROR_NONE || errorClass >= MD90_ERROR_NUM) return;
+  errorCounts_[errorClass]++;
+  pC_->metrics_.current().axes[axisNo_].errors[errorClass]++;
+  MD90Recorder::post(pC_->recorderId_, axisNo_, MD90_RECORD_ERROR, lastPosition_, lastStatus_,
+    commLost_ ? MD90_RECORD_COMM_LOST : 0, errorClass);
+  setIntegerParam(pC_->MD90LastError_, errorClass);
+  pC_->doCallbacksFloat64Array(errorCounts_, MD90_ERROR_NUM, pC_->MD90ErrorCounts_, axisNo_);
+}
+
+/** Applies the MD90_RECOVER_BUSY policy after SSF was refused because the motor is moving,
+  * typically because it is still servoing on the last target.
+  * \param[in] freq  The step frequency that was refused (Hz) */
+asynStatus MD90Axis::recoverBusy(int freq)
+{
+  int policy, limit, retries, replyStatus = REPLY_CANNOT_EXECUTE_MOVING;
+  int attempt;
+  double delay;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "MD90Axis::recoverBusy";
+
+  pC_->getIntegerParam(axisNo_, pC_->MD90RecoverBusy_, &policy);
+  pC_->getIntegerParam(axisNo_, pC_->MD90RetryLimit_, &limit);
+  pC_->getDoubleParam(axisNo_, pC_->MD90RetryDelay_, &delay);
+  pC_->getIntegerParam(axisNo_, pC_->MD90RetryCount_, &retries);
+
+  if (policy == MD90_RECOVER_STOP_RETRY) {
+    sprintf(pC_->outString_, "STP");
+    status = pC_->writeReadController();
+    if (!status) status = parseReply(functionName, pC_->inString_);
+    if (!status) status = sendStepFrequency(freq, &replyStatus);
+    retries++;
+  } else if (policy == MD90_RECOVER_BACKOFF_RETRY) {
+    for (attempt=0; !status && attempt<limit && replyStatus == REPLY_CANNOT_EXECUTE_MOVING; attempt++) {
+      epicsThreadSleep(delay * (1 << attempt));
+      status = sendStepFrequency(freq, &replyStatus);
+      retries++;
+    }
+  }
+  setIntegerParam(pC_->MD90RetryCount_, retries);
+  if (!status && replyStatus != 0) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: %s axis %d: step frequency %d refused while moving\n",
+      functionName, pC_->portName, axisNo_, freq);
+    status = asynError;
+  }
+  return status;
+}
+
+/** Applies the recovery policy for an error state reported by STA during a closed loop move.
+  * Returns true if the move is being retried, in which case the error is not passed on to
+  * the motor record.
+  * \param[in] status  STA status value */
+bool MD90Axis::recoverMove(int status)
+{
+  int policy, limit, retries;
+  double delay;
+  epicsTimeStamp now;
+  static const char *functionName = "MD90Axis::recoverMove";
+
+  if (status == 5) {
+    pC_->getIntegerParam(axisNo_, pC_->MD90RecoverStance_, &policy);
+  } else if (status == 11) {
+    pC_->getIntegerParam(axisNo_, pC_->MD90RecoverRamp_, &policy);
+  } else {
+    return false;
+  }
+  if (!moveActive_ || jogActive_ || policy == MD90_RECOVER_FAIL) return false;
+
+  pC_->getIntegerParam(axisNo_, pC_->MD90RetryLimit_, &limit);
+  pC_->getDoubleParam(axisNo_, pC_->MD90RetryDelay_, &delay);
+  if (retryCount_ >= limit) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: %s axis %d: move to %f failed after %d retries\n",
+      functionName, pC_->portName, axisNo_, moveTarget_, retryCount_);
+    retryPending_ = false;
+    return false;
+  }
+
+  epicsTimeGetCurrent(&now);
+  if (policy == MD90_RECOVER_BACKOFF_RETRY) {
+    if (!retryPending_) {
+      retryPending_ = true;
+      retryTime_ = now;
+      epicsTimeAddSeconds(&retryTime_, delay * (1 << retryCount_));
+    }
+    if (epicsTimeDiffInSeconds(&now, &retryTime_) < 0.) return true;
+  }
+
+  asynPrint(pasynUser_, ASYN_TRACE_WARNING,
+    "%s: %s axis %d: status %d, retrying move to %f\n",
+    functionName, pC_->portName, axisNo_, status, moveTarget_);
+  retryPending_ = false;
+  retryCount_++;
+  pC_->getIntegerParam(axisNo_, pC_->MD90RetryCount_, &retries);
+  setIntegerParam(pC_->MD90RetryCount_, retries + 1);
+  rampActive_ = false;
+  setIntegerParam(pC_->MD90RampActive_, 0);
+  stallValid_ = false;
+
+  sprintf(pC_->outString_, "STP");
+  if (pC_->writeReadController() || parseReply(functionName, pC_->inString_)) return false;
+  sprintf(pC_->outString_, "CLM %d", NINT(moveTarget_ * 10));
+  if (pC_->writeReadController() || parseReply(functionName, pC_->inString_)) return false;
+  return true;
+}
+
+/** Starts the fine stage of a two-stage move: the default deadband is put back and the
+  * target is moved to again, so the controller settles within the default deadband.
+  * Called by the poller when the coarse stage is complete.
+  * \return true if the fine stage was started */
+bool MD90Axis::startFineStage()
+{
+  int deadband;
+  static const char *functionName = "MD90Axis::startFineStage";
+
+  pC_->getIntegerParam(axisNo_, pC_->MD90Deadband_, &deadband);
+  asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+    "%s: %s axis %d: settling at %f with deadband %d nm from %f\n",
+    functionName, pC_->portName, axisNo_, moveTarget_, deadband, lastPosition_);
+  stallValid_ = false;
+  calValid_ = false;
+  settled_ = false;
+
+  if (sendDeadband(deadband)) return false;
+  moveDeadbandActive_ = false;
+  sprintf(pC_->outString_, "STP");
+  if (pC_->writeReadController() || parseReply(functionName, pC_->inString_)) return false;
+  sprintf(pC_->outString_, "CLM %d", NINT(moveTarget_ * 10));
+  if (pC_->writeReadController() || parseReply(functionName, pC_->inString_)) return false;
+  return true;
+}
+
+/** Puts back the default deadband after a move that ran with the coarse deadband.
+  * The target is released with STP first, so that the controller does not go on
+  * correcting the position to the default deadband after the move is reported done.
+  * Tried again at the next poll if the controller does not accept it. */
+void MD90Axis::restoreDeadband()
+{
+  int deadband;
+  static const char *functionName = "MD90Axis::restoreDeadband";
+
+  pC_->getIntegerParam(axisNo_, pC_->MD90Deadband_, &deadband);
+  sprintf(pC_->outString_, "STP");
+  if (pC_->writeReadController() || parseReply(functionName, pC_->inString_)) return;
+  if (deadband < 0 || !sendDeadband(deadband)) moveDeadbandActive_ = false;
+}
+
+/** Sends the final leg of an approach-direction move, back to the target from the
+  * overshoot position in the approach direction.  Called by poll() when the overshoot
+  * leg has completed.
+  * \return true if the final leg was started
+  */
+bool MD90Axis::startApproach()
+{
+  static const char *functionName = "MD90Axis::startApproach";
+
+  asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+    "%s: %s axis %d: approaching %f from %f\n",
+    functionName, pC_->portName, axisNo_, approachTarget_, lastPosition_);
+  moveTarget_ = approachTarget_;
+  rampActive_ = false;
+  setIntegerParam(pC_->MD90RampActive_, 0);
+  stallValid_ = false;
+  calValid_ = false;
+  moveOvershoot_ = 0.;
+  settled_ = false;
+
+  // The controller holds the overshoot position until STP, as after any closed loop move
+  sprintf(pC_->outString_, "STP");
+  if (pC_->writeReadController() || parseReply(functionName, pC_->inString_)) return false;
+  sprintf(pC_->outString_, "CLM %d", NINT(moveTarget_ * 10));
+  if (pC_->writeReadController() || parseReply(functionName, pC_->inString_)) return false;
+  return true;
+}
+
+/** Start a closed loop move whose step frequency is ramped by the host.
+  * The move starts at the base velocity and updateRamp() raises the step frequency
+  * from the poller in timed increments, then lowers it again in time to stop at the target.
+  * \param[in] target        Absolute target position in encoder counts
+  * \param[in] minVelocity   Base velocity in encoder counts / sec
+  * \param[in] maxVelocity   Cruise velocity in encoder counts / sec
+  * \param[in] acceleration  Acceleration in encoder counts / sec / sec
+  */
+asynStatus MD90Axis::startRamp(double target, double minVelocity, double maxVelocity, double acceleration)
+{
+  int increments;
+  int replyStatus;
+  asynStatus status;
+  static const char *functionName = "MD90Axis::startRamp";
+
+  pC_->getIntegerParam(axisNo_, pC_->MD90RampIncrements_, &increments);
+  if (increments < 1) increments = 1;
+
+  rampMaxFreq_ = velocityToFrequency(maxVelocity);
+  rampMinFreq_ = velocityToFrequency(minVelocity);
+  if (rampMinFreq_ < 1) rampMinFreq_ = 1;
+  if (rampMinFreq_ > rampMaxFreq_) rampMinFreq_ = rampMaxFreq_;
+  rampRate_ = fabs(acceleration / countsPerStep_);
+  rampIncrement_ = (rampMaxFreq_ - rampMinFreq_) / increments;
+  rampTarget_ = target;
+  epicsTimeGetCurrent(&rampStartTime_);
+
+  asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+    "%s: target=%f, freq %d -> %d Hz, rate=%f Hz/s\n",
+    functionName, target, NINT(rampMinFreq_), NINT(rampMaxFreq_), rampRate_);
+
+  status = sendStepFrequency(NINT(rampMinFreq_), &replyStatus);
+  if (status) return status;
+
+  // Position specified in encoder steps (10 nm), but motor move commands are in nanometers
+  sprintf(pC_->outString_, "CLM %d", NINT(target * 10));
   status = pC_->writeReadController();
   if (!status) {
     status = parseReply(functionName, pC_->inString_);
   }
+  rampActive_ = (status == asynSuccess);
+  setIntegerParam(pC_->MD90RampActive_, rampActive_ ? 1:0);
+  return status;
+}
+
+/** Change the step frequency of a move in progress by stopping and reissuing
+  * the closed loop move.  Used when the controller refuses SSF while moving.
+  * \param[in] freq          New step frequency in Hz
+  */
+asynStatus MD90Axis::retarget(int freq)
+{
+  int replyStatus;
+  asynStatus status;
+  static const char *functionName = "MD90Axis::retarget";
 
+  sprintf(pC_->outString_, "STP");
+  status = pC_->writeReadController();
+  if (!status) {
+    status = parseReply(functionName, pC_->inString_);
+  }
+  if (!status) {
+    status = sendStepFrequency(freq, &replyStatus);
+  }
+  if (!status) {
+    sprintf(pC_->outString_, "CLM %d", NINT(rampTarget_ * 10));
+    status = pC_->writeReadController();
+  }
+  if (!status) {
+    status = parseReply(functionName, pC_->inString_);
+  }
   return status;
 }
 
+/** Advance the host-side ramp; called from poll() while a ramped move is in progress.
+  * The step frequency follows a trapezoidal profile: it rises at rampRate_ from the
+  * start of the move and falls so that it reaches rampMinFreq_ at the target.
+  * Changes smaller than one ramp increment are not sent.  If the controller refuses
+  * SSF while moving, the move is reissued once by retarget() and the ramp ends.
+  * \param[in] position      Current encoder position in counts
+  */
+asynStatus MD90Axis::updateRamp(double position)
+{
+  epicsTimeStamp now;
+  double elapsed, remaining;
+  double accelFreq, decelFreq, freq;
+  int replyStatus;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "MD90Axis::updateRamp";
+
+  epicsTimeGetCurrent(&now);
+  elapsed = epicsTimeDiffInSeconds(&now, &rampStartTime_);
+  remaining = fabs(rampTarget_ - position) / countsPerStep_;   // in steps
+
+  accelFreq = rampMinFreq_ + rampRate_ * elapsed;
+  decelFreq = sqrt(rampMinFreq_ * rampMinFreq_ + 2. * rampRate_ * remaining);
+  freq = accelFreq;
+  if (decelFreq < freq) freq = decelFreq;
+  if (freq > rampMaxFreq_) freq = rampMaxFreq_;
+
+  // Only send a change once it amounts to a full increment, or when reaching the end points
+  if (fabs(freq - stepFreq_) < rampIncrement_ &&
+      NINT(freq) != NINT(rampMaxFreq_) && NINT(freq) != NINT(rampMinFreq_)) {
+    return asynSuccess;
+  }
+  if (NINT(freq) == stepFreq_) return asynSuccess;
+
+  asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+    "%s: elapsed=%f, remaining steps=%f, freq %d -> %d Hz\n",
+    functionName, elapsed, remaining, stepFreq_, NINT(freq));
+
+  status = sendStepFrequency(NINT(freq), &replyStatus);
+  if (!status && replyStatus == REPLY_CANNOT_EXECUTE_MOVING) {
+    // The controller requires the move to be stopped before the step frequency can change.
+    // Rather than stopping at every increment, stop once and run the rest of the move at
+    // one frequency: the cruise frequency while still accelerating, else the current one.
+    if (accelFreq < decelFreq) {
+      freq = (decelFreq < rampMaxFreq_) ? decelFreq : rampMaxFreq_;
+    }
+    asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+      "%s: SSF refused while moving, ending the ramp at %d Hz\n", functionName, NINT(freq));
+    rampActive_ = false;
+    setIntegerParam(pC_->MD90RampActive_, 0);
+    status = retarget(NINT(freq));
+  }
+  return status;
+}
 
 asynStatus MD90Axis::move(double position, int relative, double minVelocity, double maxVelocity, double acceleration)
 {
   asynStatus status;
+  bool ramped;
+  int streaming, approachMode, precisionMode, coarseDeadband, deadband;
+  double approachDistance, legTarget;
   static const char *functionName = "MD90Axis::move";
 
+  if (checkMoveAllowed(functionName, true)) return asynError;
+
+  jogActive_ = false;
+  rampActive_ = false;
+  setIntegerParam(pC_->MD90RampActive_, 0);
+  retryCount_ = 0;
+  retryPending_ = false;
+  calValid_ = false;
+  stallValid_ = false;
+  stalled_ = false;
+  setIntegerParam(pC_->MD90Stalled_, 0);
+  approachPending_ = false;
+  finePending_ = false;
+  pauseActive_ = false;
+  moveTarget_ = relative ? lastPosition_ + position : position;
+
+  // The follower of a coupled pair is sent first, to the same target plus the offset
+  if (coupleEnabled_) {
+    couplePaused_ = 0;
+    status = coupleC_->followMove(coupleAxisNo_, moveTarget_ + coupleOffset_, minVelocity, maxVelocity, acceleration);
+    if (status) return status;
+    coupleActive_ = true;
+    coupleStart_ = lastPosition_;
+    coupleMaxDiff_ = 0.;
+  }
+
+  // In streaming mode the move is coalesced with any pending one and sent by the poller
+  pC_->getIntegerParam(axisNo_, pC_->MD90StreamMode_, &streaming);
+  if (streaming) {
+    startMoveStats();
+    queueSetpoint(moveTarget_, velocityToFrequency(maxVelocity));
+    return asynSuccess;
+  }
+
+  // Ramp the step frequency on the host if the acceleration time spans more than one poll
+  ramped = (acceleration > 0. && maxVelocity > minVelocity &&
+            (maxVelocity - minVelocity) / acceleration >= pC_->movingPollPeriod_);
+
+  // A move that would end travelling the wrong way overshoots the target first, and the
+  // poller sends the final leg back to the target, so the record sees a single move
+  legTarget = moveTarget_;
+  pC_->getIntegerParam(axisNo_, pC_->MD90ApproachMode_, &approachMode);
+  pC_->getDoubleParam(axisNo_, pC_->MD90ApproachDistance_, &approachDistance);
+  if (approachMode != MD90_APPROACH_OFF && approachDistance > 0. &&
+      (moveTarget_ - lastPosition_) * ((approachMode == MD90_APPROACH_POSITIVE) ? 1. : -1.) < 0.) {
+    legTarget = moveTarget_ + ((approachMode == MD90_APPROACH_POSITIVE) ? -approachDistance : approachDistance);
+  }
+  setDoubleParam(pC_->MD90MoveEta_,
+    predictMoveTime(legTarget - lastPosition_, minVelocity, maxVelocity, ramped ? acceleration : 0.) +
+    predictMoveTime(moveTarget_ - legTarget, minVelocity, maxVelocity, 0.));
+  startMoveStats();
+  if (legTarget != moveTarget_) {
+    approachPending_ = true;
+    approachTarget_ = moveTarget_;
+    moveTarget_ = legTarget;
+    relative = 0;
+    position = legTarget;
+  }
+
+  // A coarse or two-stage move runs with the coarse deadband.  The default deadband is
+  // put back when the move is over, or by the next move that needs it.
+  pC_->getIntegerParam(axisNo_, pC_->MD90PrecisionMode_, &precisionMode);
+  pC_->getIntegerParam(axisNo_, pC_->MD90CoarseDeadband_, &coarseDeadband);
+  pC_->getIntegerParam(axisNo_, pC_->MD90Deadband_, &deadband);
+  if (precisionMode != MD90_PRECISION_FINE && deadband >= 0 && coarseDeadband > deadband) {
+    if (activeDeadband_ != coarseDeadband) {
+      status = sendDeadband(coarseDeadband);
+      if (status) goto done;
+    }
+    moveDeadbandActive_ = true;
+    finePending_ = (precisionMode == MD90_PRECISION_TWO_STAGE);
+  } else if (deadband >= 0 && activeDeadband_ != deadband) {
+    status = sendDeadband(deadband);
+    if (status) goto done;
+    moveDeadbandActive_ = false;
+  }
+
+  if (ramped) {
+    status = startRamp(moveTarget_, minVelocity, maxVelocity, acceleration);
+    goto done;
+  }
+
   status = sendAccelAndVelocity(acceleration, maxVelocity);
-  
+  if (status) goto done;
+
   // Position specified in encoder steps (10 nm), but motor move commands are in nanometers
   position = position * 10;
   if (relative) {
@@ -216,6 +1873,13 @@ asynStatus MD90Axis::move(double position, int relative, double minVelocity, dou
   if (!status) {
     status = parseReply(functionName, pC_->inString_);
   }
+
+  done:
+  // The follower of a coupled pair must not travel on alone if the leader did not start
+  if (status && coupleEnabled_ && coupleActive_) {
+    coupleActive_ = false;
+    coupleC_->stopFollower(coupleAxisNo_);
+  }
   return status;
 }
 
@@ -225,6 +1889,10 @@ asynStatus MD90Axis::home(double minVelocity, double maxVelocity, double acceler
   asynStatus status;
   static const char *functionName = "MD90Axis::home";
 
+  if (checkMoveAllowed(functionName, false)) return asynError;
+
+  jogActive_ = false;
+  homeSuspect_ = false;
   status = sendAccelAndVelocity(acceleration, maxVelocity);
 
   // The MD-90 will start the home routine in the direction of the last move
@@ -252,7 +1920,7 @@ asynStatus MD90Axis::home(double minVelocity, double maxVelocity, double acceler
 
   if (!status) {
     // Wait for the move to complete, then home
-    sleepTime = SLEEP_MARGIN * SMALL_NSTEPS * COUNTS_PER_STEP / maxVelocity;
+    sleepTime = SLEEP_MARGIN * SMALL_NSTEPS * countsPerStep_ / maxVelocity;
     if (sleepTime < HOME_SLEEP_MIN) {
         sleepTime = HOME_SLEEP_MIN;
     }
@@ -264,6 +1932,11 @@ asynStatus MD90Axis::home(double minVelocity, double maxVelocity, double acceler
   if (!status) {
     status = parseReply(functionName, pC_->inString_);
   }
+  if (!status) {
+    homeTimed_ = true;
+    homeStartTime_ = MD90Metrics::now();
+    MD90Recorder::post(pC_->recorderId_, axisNo_, MD90_RECORD_HOME_START, lastPosition_, lastStatus_, 0, 0.);
+  }
   return status;
 }
 
@@ -272,27 +1945,109 @@ asynStatus MD90Axis::moveVelocity(double minVelocity, double maxVelocity, double
   asynStatus status;
   static const char *functionName = "MD90Axis::moveVelocity";
 
+  if (checkMoveAllowed(functionName, false)) return asynError;
+
   asynPrint(pasynUser_, ASYN_TRACE_FLOW,
     "%s: minVelocity=%f, maxVelocity=%f, acceleration=%f\n",
     functionName, minVelocity, maxVelocity, acceleration);
     
+  rampActive_ = false;
+  setIntegerParam(pC_->MD90RampActive_, 0);
   status = sendAccelAndVelocity(acceleration, maxVelocity);
+  if (status) return status;
 
-  /* MD-90 does not have jog command. Move max 6000 steps */
-  sprintf(pC_->outString_, "SNS 6000");
-  status = pC_->writeReadController();
-  if (maxVelocity > 0.) {
-    /* This is a positive move in MD90 coordinates */
-    sprintf(pC_->outString_, "ESF");
-  } else {
-    /* This is a negative move in MD90 coordinates */
-    sprintf(pC_->outString_, "ESB");
+  /* MD-90 does not have jog command.  Jog with open loop bursts that the poller re-arms */
+  jogDirection_ = (maxVelocity > 0.) ? 1 : -1;
+  jogRearmMoving_ = true;
+  status = startJogBurst(false, NULL);
+  jogActive_ = (status == asynSuccess);
+  return status;
+}
+
+/** Start an open loop burst of JOG_BURST_STEPS steps in the jog direction.
+  * \param[in] rearm     Called from the poller to continue a jog.  A re-arm refused with
+  *                      reply 3 because the last burst is still running is expected, and
+  *                      is neither logged nor counted as an error.
+  * \param[out] refused  Optional; set if the re-arm was refused with reply 3
+  */
+asynStatus MD90Axis::startJogBurst(bool rearm, bool *refused)
+{
+  MD90Reply reply;
+  int replyStatus = 0;
+  int i;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "MD90Axis::startJogBurst";
+
+  if (refused) *refused = false;
+  for (i=0; i<2 && !status && replyStatus == 0; i++) {
+    if (i == 0) {
+      sprintf(pC_->outString_, "SNS %d", JOG_BURST_STEPS);
+    } else if (jogDirection_ > 0) {
+      /* This is a positive move in MD90 coordinates */
+      sprintf(pC_->outString_, "ESF");
+    } else {
+      /* This is a negative move in MD90 coordinates */
+      sprintf(pC_->outString_, "ESB");
+    }
+    status = pC_->writeReadController();
+    if (status) break;
+    if (rearm && md90ParseReply(pC_->inString_, &reply) && reply.code == MD90_REPLY_BUSY) {
+      if (refused) *refused = true;
+      return asynSuccess;
+    }
+    status = parseReply(functionName, pC_->inString_, &replyStatus);
   }
-  status = pC_->writeReadController();
-  if (!status) {
-    status = parseReply(functionName, pC_->inString_);
+  if (status) return status;
+  if (replyStatus != 0) return asynError;
+
+  epicsTimeGetCurrent(&jogBurstTime_);
+  // The end of the burst serves as the move target for stall detection and calibration
+  moveTarget_ = lastPosition_ + jogDirection_ * JOG_BURST_STEPS * countsPerStep_;
+  return asynSuccess;
+}
+
+/** Re-arm the jog burst; called from poll() while jogging.
+  * The time left in the burst is estimated from the observed step rate, and the next
+  * burst is started while the current one is still running.  If the controller refuses
+  * that, later bursts are started once the current one has ended, so the jog pauses
+  * briefly at each burst boundary.
+  * \param[in] status        Current STA status value
+  */
+asynStatus MD90Axis::updateJog(int status)
+{
+  epicsTimeStamp now;
+  double rate, elapsed, remaining;
+  bool refused;
+  asynStatus comStatus;
+  static const char *functionName = "MD90Axis::updateJog";
+
+  epicsTimeGetCurrent(&now);
+  elapsed = epicsTimeDiffInSeconds(&now, &jogBurstTime_);
+
+  // Observed step rate, falling back to the commanded one until a velocity has been measured
+  rate = fabs(measVelocity_) / countsPerStep_;
+  if (rate < 1.) rate = stepFreq_;
+  if (rate < 1.) rate = 1.;
+  remaining = JOG_BURST_STEPS / rate - elapsed;
+
+  switch (status) {
+    case 2:  // Move in progress
+      if (!jogRearmMoving_ || remaining > JOG_REARM_POLLS * pC_->movingPollPeriod_) return asynSuccess;
+      break;
+    case 0:  // Idle
+    case 1:  // Open loop move complete
+      break;
+    default: // Stopped from elsewhere, or an error: the jog is over
+      jogActive_ = false;
+      return asynSuccess;
   }
-  return status;
+  comStatus = startJogBurst(true, &refused);
+  if (!comStatus && refused && status == 2) {
+    asynPrint(pasynUser_, ASYN_TRACE_FLOW,
+      "%s: burst cannot be re-armed while running, re-arming at the end of each burst\n", functionName);
+    jogRearmMoving_ = false;
+  }
+  return comStatus;
 }
 
 asynStatus MD90Axis::stop(double acceleration )
@@ -300,6 +2055,22 @@ asynStatus MD90Axis::stop(double acceleration )
   asynStatus status;
   static const char *functionName = "MD90Axis::stop";
 
+  autotuneAbort_ = true;
+  homeAbort_ = true;
+  jogActive_ = false;
+  rampActive_ = false;
+  // A streamed setpoint queued before the stop must not be sent after it
+  streamPending_ = false;
+  streamFreq_ = 0;
+  approachPending_ = false;
+  finePending_ = false;
+  pauseActive_ = false;
+  setIntegerParam(pC_->MD90RampActive_, 0);
+  if (coupleEnabled_) {
+    couplePaused_ = 0;
+    coupleC_->stopFollower(coupleAxisNo_);
+  }
+
   sprintf(pC_->outString_, "STP");
   status = pC_->writeReadController();
   if (!status) {
@@ -370,14 +2141,21 @@ asynStatus MD90Axis::doMoveToHome()
   */
 asynStatus MD90Axis::poll(bool *moving)
 { 
-  int replyStatus;
-  char replyString[256];
+  MD90Reply reply;
   int replyValue;
   int done;
   int driveOn;
   int homed;
   double position;
   double velocity;
+  int moveStatus;
+  int streaming;
+  int reconcileState;
+  double reconcileTolerance;
+  bool shortPoll;
+  epicsTimeStamp readTime;
+  double pollStart = MD90Metrics::now();
+  double sampleStart;
   asynStatus comStatus;
   static const char *functionName = "MD90Axis::poll";
 
@@ -385,33 +2163,60 @@ asynStatus MD90Axis::poll(bool *moving)
 
   setIntegerParam(pC_->motorStatusProblem_, 0);
 
-  // Read the drive power on status
-  sprintf(pC_->outString_, "GPS");
-  comStatus = pC_->writeReadController();
-  if (comStatus) goto skip;
-  // The response string is of the form "0: Power supply enabled state: 1"
-  sscanf(pC_->inString_, "%d: %[^:]: %d", &replyStatus, replyString, &replyValue);
-  driveOn = (replyValue == 1) ? 1:0;
-  setIntegerParam(pC_->motorStatusPowerOn_, driveOn);
-
-  // Read the home status
-  sprintf(pC_->outString_, "GHS");
-  comStatus = pC_->writeReadController();
-  if (comStatus) goto skip;
-  // The response string is of the form "0: Home status: 1"
-  sscanf(pC_->inString_, "%d: %[^:]: %d", &replyStatus, replyString, &replyValue);
-  homed = (replyValue == 1) ? 1:0;
-  setIntegerParam(pC_->motorStatusHomed_, homed);
+  // After the connection was lost, put the cached settings back before reading them
+  if (commLost_) {
+    comStatus = restoreSettings();
+    if (comStatus) goto skip;
+  }
+
+  // While streaming setpoints or watching for position compare crossings only the status
+  // and position are read, to keep the poll cycle short
+  pC_->getIntegerParam(axisNo_, pC_->MD90StreamMode_, &streaming);
+  shortPoll = streaming || compareArmed_;
+
+  if (!shortPoll) {
+    // Read the drive power on status
+    // The response string is of the form "0: Power supply enabled state: 1"
+    comStatus = pollQuery("GPS", &reply);
+    if (comStatus) goto skip;
+    if (reply.ok() && reply.hasValue) {
+      driveOn = (NINT(reply.value) == 1) ? 1:0;
+      if (powerOn_ != driveOn) {
+        powerOn_ = driveOn;
+        stateChanged_ = true;
+      }
+      setIntegerParam(pC_->motorStatusPowerOn_, driveOn);
+    }
+
+    // Read the home status
+    // The response string is of the form "0: Home status: 1"
+    comStatus = pollQuery("GHS", &reply);
+    if (comStatus) goto skip;
+    if (reply.ok() && reply.hasValue) {
+      homed_ = (NINT(reply.value) == 1) ? 1:0;
+    }
+    homed = homed_;
+    setIntegerParam(pC_->motorStatusHomed_, (homed && !homeSuspect_) ? 1:0);
+  }
 
   // Read the moving status of this motor
-  sprintf(pC_->outString_, "STA");
-  comStatus = pC_->writeReadController();
-  if (comStatus) goto skip;
   // The response string is of the form "0: Current status value: 0"
-  sscanf(pC_->inString_, "%d: %[^:]: %d", &replyStatus, replyString, &replyValue);
+  comStatus = pollQuery("STA", &reply);
+  if (comStatus) goto skip;
+  if (!reply.ok() || !reply.hasValue) {
+    // Without a status the rest of the poll has nothing to go on
+    setIntegerParam(pC_->motorStatusProblem_, 1);
+    goto skip;
+  }
+  replyValue = NINT(reply.value);
+  moveStatus = replyValue;
   done = (replyValue == 2) ? 0:1;
   setIntegerParam(pC_->motorStatusDone_, done);
   *moving = done ? false:true;
+  if (homeTimed_ && done) {
+    if (homed_) pC_->metrics_.current().axes[axisNo_].homeDuration.observe(MD90Metrics::now() - homeStartTime_);
+    homeTimed_ = false;
+  }
   switch(replyValue) {
     case 0:  // Idle
         asynPrint(pasynUser_, ASYN_TRACE_FLOW, "%s:  Idle\n", functionName);
@@ -464,49 +2269,187 @@ asynStatus MD90Axis::poll(bool *moving)
         break;
   }
 
+  // Count each STA error state once, and retry the move if its recovery policy allows
+  if (md90IsErrorStatus(moveStatus)) {
+    if (moveStatus != lastStatus_) {
+      countError(moveStatus == MD90_STA_HOMING_ERROR ? MD90_ERROR_HOMING :
+                 moveStatus == MD90_STA_STANCE_ERROR ? MD90_ERROR_STANCE :
+                 moveStatus == MD90_STA_OPEN_LOOP_ERROR ? MD90_ERROR_OPEN_LOOP :
+                 moveStatus == MD90_STA_CLOSED_LOOP_ERROR ? MD90_ERROR_CLOSED_LOOP :
+                 moveStatus == MD90_STA_END_OF_TRAVEL ? MD90_ERROR_END_OF_TRAVEL : MD90_ERROR_RAMP);
+    }
+    if (recoverMove(moveStatus)) {
+      setIntegerParam(pC_->motorStatusProblem_, 0);
+      setIntegerParam(pC_->motorStatusDone_, 0);
+      *moving = true;
+      moveStatus = MD90_STA_MOVING;
+    }
+  }
+  lastStatus_ = replyValue;
+
+  // An axis paused to let the other axis of its coupled pair catch up is still in its move
+  if (pauseActive_) {
+    setIntegerParam(pC_->motorStatusDone_, 0);
+    *moving = true;
+  }
+
+  // The overshoot leg of an approach-direction move has ended; a stop or error ends the move
+  if (approachPending_ && !*moving && moveStatus != MD90_STA_STANCE_DONE) {
+    if (moveStatus == MD90_STA_CLOSED_LOOP_DONE && startApproach()) {
+      setIntegerParam(pC_->motorStatusDone_, 0);
+      *moving = true;
+      moveStatus = MD90_STA_MOVING;
+    }
+    approachPending_ = false;
+  }
+
+  // The coarse stage of a two-stage move has ended; settle with the default deadband
+  if (finePending_ && !*moving && moveStatus != MD90_STA_STANCE_DONE) {
+    if (moveStatus == MD90_STA_CLOSED_LOOP_DONE && startFineStage()) {
+      setIntegerParam(pC_->motorStatusDone_, 0);
+      *moving = true;
+      moveStatus = MD90_STA_MOVING;
+    }
+    finePending_ = false;
+  }
+  if (moveDeadbandActive_ && !*moving && !approachPending_) {
+    restoreDeadband();
+  }
+
   // Read the current motor position in encoder steps (10 nm)
-  sprintf(pC_->outString_, "GEC");
-  comStatus = pC_->writeReadController();
-  if (comStatus) goto skip;
   // The response string is of the form "0: Current position in encoder counts: 1000"
-  sscanf(pC_->inString_, "%d: %[^:]: %lf", &replyStatus, replyString, &position);
+  sampleStart = MD90Metrics::now();
+  comStatus = pollQuery("GEC", &reply);
+  if (comStatus) goto skip;
+  if (!reply.ok() || !reply.hasValue) {
+    setIntegerParam(pC_->motorStatusProblem_, 1);
+    goto skip;
+  }
+  position = reply.value;
+  // The encoder was read at some point during the round trip; take the middle
+  checkCompare(position, (sampleStart + MD90Metrics::now()) / 2.);
+  // Keep a coupled pair together, and report the pair as moving until both are done
+  updateCouple(position, moving);
   setDoubleParam(pC_->motorPosition_, position);
   setDoubleParam(pC_->motorEncoderPosition_, position);
+  epicsTimeGetCurrent(&readTime);
+  pC_->setTimeStamp(&readTime);
+  setDoubleParam(pC_->MD90Position_, position);
   setIntegerParam(pC_->motorStatusAtHome_, (position == 0) ? 1:0); // home limit switch
   setIntegerParam(pC_->motorStatusHome_, (position == 0) ? 1:0); // at home position
+  lastPosition_ = position;
+  MD90Recorder::post(pC_->recorderId_, axisNo_, MD90_RECORD_SAMPLE, position, moveStatus,
+    (*moving ? MD90_RECORD_MOVING : 0) | (homed_ ? MD90_RECORD_HOMED : 0), 0.);
+
+  // After a restart, decide whether the controller is still referenced
+  pC_->getIntegerParam(axisNo_, pC_->MD90Reconcile_, &reconcileState);
+  if (reconcileState == MD90_RECONCILE_PENDING && !shortPoll) {
+    reconcile(position, homed);
+  }
+
+  // Motion statistics from the timestamped encoder sample
+  updateMoveStats(position, moveStatus, *moving);
+
+  // Watch encoder progress for a stalled move
+  checkStall(position, moveStatus);
+
+  // Refine the counts per step estimate, and persist it once the move is over
+  updateCalibration(position, moveStatus);
+  // Drift at rest is saved once it could matter to the reconciliation after a restart
+  pC_->getDoubleParam(axisNo_, pC_->MD90ReconcileTolerance_, &reconcileTolerance);
+  if (!*moving && reconcileState != MD90_RECONCILE_PENDING &&
+      ((homed_ && !homeSuspect_) != (savedHomed_ == 1) ||
+       fabs(position - savedPosition_) > reconcileTolerance / 2.)) {
+    stateChanged_ = true;
+  }
+  if (!*moving && stateChanged_) {
+    pC_->saveState();
+  }
+
+  // Keep a jog going across burst boundaries; it only ends with stop()
+  if (jogActive_) {
+    updateJog(moveStatus);
+  }
+  if (jogActive_) {
+    *moving = true;
+    setIntegerParam(pC_->motorStatusDone_, 0);
+  }
+
+  // Advance the host-side acceleration ramp
+  if (rampActive_) {
+    if (*moving) {
+      updateRamp(position);
+    } else {
+      rampActive_ = false;
+      setIntegerParam(pC_->MD90RampActive_, 0);
+    }
+  }
+
+  if (shortPoll) goto skip;
 
   // Read the current motor step frequency to calculate approx. set velocity in (encoder step lengths / s)
-  sprintf(pC_->outString_, "GSF");
-  comStatus = pC_->writeReadController();
-  if (comStatus) goto skip;
   // The response string is of the form "0: Current step frequency: 100"
-  sscanf(pC_->inString_, "%d: %[^:]: %d", &replyStatus, replyString, &replyValue);
-  velocity = replyValue * COUNTS_PER_STEP;
-  setDoubleParam(pC_->motorVelocity_, velocity);
+  comStatus = pollQuery("GSF", &reply);
+  if (comStatus) goto skip;
+  if (reply.ok() && reply.hasValue) {
+    replyValue = NINT(reply.value);
+    if (stepFreq_ != replyValue) {
+      stepFreq_ = replyValue;
+      stateChanged_ = true;
+    }
+    setIntegerParam(pC_->MD90StepFrequency_, stepFreq_);
+    velocity = replyValue * countsPerStep_;
+    setDoubleParam(pC_->motorVelocity_, velocity);
+  }
 
   // Read the current motor integral gain (range 1-1000)
-  sprintf(pC_->outString_, "GGN");
-  comStatus = pC_->writeReadController();
-  if (comStatus) goto skip;
   // The response string is of the form "0: Gain: 1000"
-  sscanf(pC_->inString_, "%d: %[^:]: %d", &replyStatus, replyString, &replyValue);
-  setDoubleParam(pC_->motorIGain_, replyValue);
+  comStatus = pollQuery("GGN", &reply);
+  if (comStatus) goto skip;
+  if (reply.ok() && reply.hasValue) {
+    replyValue = NINT(reply.value);
+    if (gain_ != replyValue) {
+      gain_ = replyValue;
+      stateChanged_ = true;
+    }
+    setDoubleParam(pC_->motorIGain_, replyValue);
+  }
 
   // Read the current motor persistent move state (using EPICS motorClosedLoop to report this)
-  sprintf(pC_->outString_, "GPM");
-  comStatus = pC_->writeReadController();
-  if (comStatus) goto skip;
   // The response string is of the form "0: Current persistent move state: 1"
-  sscanf(pC_->inString_, "%d: %[^:]: %d", &replyStatus, replyString, &replyValue);
-  setIntegerParam(pC_->motorClosedLoop_, (replyValue == 0) ? 0:1);
+  comStatus = pollQuery("GPM", &reply);
+  if (comStatus) goto skip;
+  if (reply.ok() && reply.hasValue) {
+    replyValue = (NINT(reply.value) == 0) ? 0:1;
+    if (persistentMove_ != replyValue) {
+      persistentMove_ = replyValue;
+      stateChanged_ = true;
+    }
+    setIntegerParam(pC_->motorClosedLoop_, replyValue);
+  }
 
   // set some default params
   setIntegerParam(pC_->motorStatusHasEncoder_, 1);
   setIntegerParam(pC_->motorStatusGainSupport_, 1);
 
   skip:
-  setIntegerParam(pC_->motorStatusProblem_, comStatus ? 1:0);
+  if (comStatus && !commLost_) {
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+      "%s: %s axis %d: lost connection to the controller\n",
+      functionName, pC_->portName, axisNo_);
+    countError(MD90_ERROR_COMM);
+    commLost_ = true;
+    pC_->metrics_.current().axes[axisNo_].commLostSince = MD90Metrics::now();
+  }
+  setIntegerParam(pC_->motorStatusCommsError_, commLost_ ? 1:0);
+  // Keep a problem flagged from the STA status or a stall, add communication errors
+  if (comStatus || stalled_) setIntegerParam(pC_->motorStatusProblem_, 1);
   callParamCallbacks();
+  publishCompare();
+  pC_->metrics_.current().axes[axisNo_].pollDuration.observe(MD90Metrics::now() - pollStart);
+  pC_->pollEnd_ = MD90Metrics::now();
+  if (!comStatus && *moving) pC_->pollMoving_ = true;
+  pC_->metrics_.publish();
   return comStatus ? asynError : asynSuccess;
 }
 
@@ -527,9 +2470,20 @@ static void MD90CreateContollerCallFunc(const iocshArgBuf *args)
   MD90CreateController(args[0].sval, args[1].sval, args[2].ival, args[3].ival, args[4].ival);
 }
 
+static const iocshArg MD90StateFileArg0 = {"Port name", iocshArgString};
+static const iocshArg MD90StateFileArg1 = {"State file name", iocshArgString};
+static const iocshArg * const MD90StateFileArgs[] = {&MD90StateFileArg0,
+                                                      &MD90StateFileArg1};
+static const iocshFuncDef MD90StateFileDef = {"MD90StateFile", 2, MD90StateFileArgs};
+static void MD90StateFileCallFunc(const iocshArgBuf *args)
+{
+  MD90StateFile(args[0].sval, args[1].sval);
+}
+
 static void MD90Register(void)
 {
   iocshRegister(&MD90CreateControllerDef, MD90CreateContollerCallFunc);
+  iocshRegister(&MD90StateFileDef, MD90StateFileCallFunc);
 }
 
 extern "C" {
@@ -4,18 +4,237 @@ USAGE...      Motor driver support for the DSM MD-90 controller.
 
 */
 
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+
 #include "asynMotorController.h"
 #include "asynMotorAxis.h"
+#include "MD90Protocol.h"
+#include "MD90Metrics.h"
+#include "MD90Recorder.h"
 
 #define MAX_MD90_AXES 1
 
-// No controller-specific parameters yet
-#define NUM_MD90_PARAMS 0  
+/* These are the drvInfo strings that are used to identify the parameters.
+ * They are used by asyn clients, including standard asyn device support */
+#define MD90RampIncrementsString    "MD90_RAMP_INCREMENTS"    // Number of step frequency increments in an acceleration ramp
+#define MD90RampActiveString        "MD90_RAMP_ACTIVE"        // Host-side ramp in progress (readback)
+#define MD90StepFrequencyString     "MD90_STEP_FREQUENCY"     // Step frequency last commanded (Hz, readback)
+#define MD90CountsPerStepString     "MD90_COUNTS_PER_STEP"    // Calibrated encoder counts per motor step
+#define MD90CalGainString           "MD90_CAL_GAIN"           // Filter gain of the counts per step estimate (0 disables learning)
+#define MD90CalSamplesString        "MD90_CAL_SAMPLES"        // Number of samples accepted into the estimate (readback)
+#define MD90MoveEtaString           "MD90_MOVE_ETA"           // Predicted duration of the last move (s, readback)
+#define MD90MeasVelocityString      "MD90_MEAS_VELOCITY"      // Velocity measured from encoder samples (counts/s)
+#define MD90SettleWindowString      "MD90_SETTLE_WINDOW"      // Distance from target counted as settled (counts)
+#define MD90MoveDurationString      "MD90_MOVE_DURATION"      // Duration of the last move (s)
+#define MD90SettleTimeString        "MD90_SETTLE_TIME"        // Time from first entering the settle window to done (s)
+#define MD90OvershootString         "MD90_OVERSHOOT"          // Largest excursion past the target (counts)
+#define MD90FinalErrorString        "MD90_FINAL_ERROR"        // Position minus target at the end of the move (counts)
+#define MD90MoveCountString         "MD90_MOVE_COUNT"         // Number of completed moves
+#define MD90MoveErrorsString        "MD90_MOVE_ERRORS"        // Number of moves that ended with an error status
+#define MD90MoveSummaryString       "MD90_MOVE_SUMMARY"       // Summary of the last move (waveform, see MD90_SUMMARY_*)
+#define MD90StallPolicyString       "MD90_STALL_POLICY"       // Action on a detected stall (see MD90StallPolicy)
+#define MD90StallTimeString         "MD90_STALL_TIME"         // Window over which encoder progress is judged (s)
+#define MD90StallThresholdString    "MD90_STALL_THRESHOLD"    // Fraction of the expected progress below which the axis is stalled
+#define MD90StalledString           "MD90_STALLED"            // A stall was detected during the current move (readback)
+#define MD90StallCountString        "MD90_STALL_COUNT"        // Number of stalls detected (readback)
+#define MD90StreamModeString        "MD90_STREAM_MODE"        // Coalesce moves and stream setpoints from the poller
+#define MD90StreamSetpointString    "MD90_STREAM_SETPOINT"    // Closed loop setpoint for one axis (counts)
+#define MD90StreamSetpointsString   "MD90_STREAM_SETPOINTS"   // Closed loop setpoints indexed by axis (counts, array)
+#define MD90StreamSentString        "MD90_STREAM_SENT"        // Number of setpoints sent to the controller (readback)
+#define MD90StreamDropsString       "MD90_STREAM_DROPS"       // Number of setpoints superseded before they were sent (readback)
+#define MD90StreamLatencyString     "MD90_STREAM_LATENCY"     // Time from setpoint receipt to controller reply (ms, readback)
+#define MD90StreamMaxLatencyString  "MD90_STREAM_MAX_LATENCY" // Largest latency since streaming was enabled (ms, readback)
+#define MD90AutotuneString          "MD90_AUTOTUNE"           // Start (1) or abort (0) I gain autotuning
+#define MD90AutotuneStateString     "MD90_AUTOTUNE_STATE"     // Autotune state (see MD90AutotuneState, readback)
+#define MD90AutotuneStepString      "MD90_AUTOTUNE_STEP"      // Size of the autotune step moves (counts)
+#define MD90AutotuneMinGainString   "MD90_AUTOTUNE_MIN_GAIN"  // Lowest candidate gain (SGN units, 1-1000)
+#define MD90AutotuneMaxGainString   "MD90_AUTOTUNE_MAX_GAIN"  // Highest candidate gain (SGN units, 1-1000)
+#define MD90AutotuneNumGainsString  "MD90_AUTOTUNE_NUM_GAINS" // Number of candidate gains
+#define MD90AutotuneGainString      "MD90_AUTOTUNE_GAIN"      // Gain chosen by the last autotune (readback)
+#define MD90AutotuneSettleString    "MD90_AUTOTUNE_SETTLE"    // Settle time with the chosen gain (s, readback)
+#define MD90AutotuneOvershootString "MD90_AUTOTUNE_OVERSHOOT" // Overshoot with the chosen gain (counts, readback)
+#define MD90AutotuneResultsString   "MD90_AUTOTUNE_RESULTS"   // Gain, settle time, overshoot of each candidate (waveform)
+#define MD90HomeTimeString          "MD90_HOME_TIME"          // Time taken by the last group home of the axis (s, readback)
+#define MD90ReconcileString         "MD90_RECONCILE"          // Startup check of the home state against the state file (see MD90ReconcileState)
+#define MD90ReconcileToleranceString "MD90_RECONCILE_TOLERANCE" // Largest position change since the last run that still counts as consistent (counts)
+#define MD90DeadbandString          "MD90_DEADBAND"           // Closed loop deadband (nm), restored after a reattach
+#define MD90ReattachCountString     "MD90_REATTACH_COUNT"     // Number of times the connection was lost and restored (readback)
+#define MD90RecoverBusyString       "MD90_RECOVER_BUSY"       // Recovery from reply 3 "Cannot execute while moving" (see MD90RecoveryPolicy)
+#define MD90RecoverStanceString     "MD90_RECOVER_STANCE"     // Recovery from STA 5 "Stance error" during a move
+#define MD90RecoverRampString       "MD90_RECOVER_RAMP"       // Recovery from STA 11 "Ramp move error" during a move
+#define MD90RetryLimitString        "MD90_RETRY_LIMIT"        // Largest number of retries per command or move
+#define MD90RetryDelayString        "MD90_RETRY_DELAY"        // First back-off delay, doubled on each retry (s)
+#define MD90RetryCountString        "MD90_RETRY_COUNT"        // Number of retries made (readback)
+#define MD90LastErrorString         "MD90_LAST_ERROR"         // Class of the last error (see MD90ErrorClass, readback)
+#define MD90ErrorCountsString       "MD90_ERROR_COUNTS"       // Number of errors of each class (waveform indexed by MD90ErrorClass)
+#define MD90ReadNowString           "MD90_READ_NOW"           // Read the position now: 1 for GEC, 2 for GEC and STA
+#define MD90PositionString          "MD90_POSITION"           // Encoder position with the time it was read (counts, readback)
+#define MD90SettleMeanString        "MD90_SETTLE_MEAN"        // Filtered settle time of recent moves, used by the planner (s, readback)
+#define MD90PlanPointsString        "MD90_PLAN_POINTS"        // Points to visit, one position per plan axis for each point (counts, array)
+#define MD90PlanString              "MD90_PLAN"               // Order the points for the shortest predicted time
+#define MD90PlanOrderString         "MD90_PLAN_ORDER"         // Indices of the points in the planned order (waveform, readback)
+#define MD90PlanTotalString         "MD90_PLAN_TOTAL"         // Predicted time to visit the points in the planned order (s, readback)
+#define MD90PlanNaturalTotalString  "MD90_PLAN_NATURAL_TOTAL" // Predicted time to visit the points in the order given (s, readback)
+#define MD90PollJitterString        "MD90_POLL_JITTER"        // Lateness of the last poll start against its schedule (s, readback)
+#define MD90PollJitterMeanString    "MD90_POLL_JITTER_MEAN"   // Filtered poll start lateness (s, readback)
+#define MD90PollJitterMaxString     "MD90_POLL_JITTER_MAX"    // Largest poll start lateness since the last reset (s, readback)
+#define MD90PollJitterResetString   "MD90_POLL_JITTER_RESET"  // Reset MD90_POLL_JITTER_MAX
+#define MD90ApproachModeString      "MD90_APPROACH_MODE"      // Direction from which every move ends (see MD90ApproachMode)
+#define MD90ApproachDistanceString  "MD90_APPROACH_DISTANCE"  // Overshoot of a move that arrives from the wrong direction (counts)
+#define MD90ComparePositionsString  "MD90_COMPARE_POSITIONS"  // Positions to cross, in crossing order (counts, array)
+#define MD90CompareArmString        "MD90_COMPARE_ARM"        // Arm (1) or disarm (0) position compare; returns to 0 when all are crossed
+#define MD90CompareEventString      "MD90_COMPARE_EVENT"      // Index of the last position crossed, timestamped with the crossing time (readback)
+#define MD90CompareCountString      "MD90_COMPARE_COUNT"      // Number of positions crossed since armed (readback)
+#define MD90CompareTimesString      "MD90_COMPARE_TIMES"      // Crossing time of each position crossed, from arming (s, waveform)
+#define MD90CompareLatencyString    "MD90_COMPARE_LATENCY"    // Time from the last crossing to its event (s, readback)
+#define MD90CompareLatencyMaxString "MD90_COMPARE_LATENCY_MAX" // Largest event latency since armed (s, readback)
+#define MD90PrecisionModeString     "MD90_PRECISION_MODE"     // Deadband used by moves (see MD90PrecisionMode)
+#define MD90CoarseDeadbandString    "MD90_COARSE_DEADBAND"    // Deadband of coarse moves and of the first stage of two-stage moves (nm)
+#define MD90ActiveDeadbandString    "MD90_ACTIVE_DEADBAND"    // Deadband the controller holds, -1 if not known (nm, readback)
+#define MD90CoupleEnableString      "MD90_COUPLE_ENABLE"      // Move the follower set with MD90Couple together with this axis
+#define MD90CoupleThresholdString   "MD90_COUPLE_THRESHOLD"   // Position difference at which the axis ahead is paused (counts)
+#define MD90CoupleOffsetString      "MD90_COUPLE_OFFSET"      // Follower minus leader position when coupling was enabled (counts, readback)
+#define MD90CoupleDiffString        "MD90_COUPLE_DIFF"        // Follower minus leader position, less the offset (counts, readback)
+#define MD90CoupleMaxDiffString     "MD90_COUPLE_MAX_DIFF"    // Largest position difference during the last coupled move (counts, readback)
+#define MD90CouplePausesString      "MD90_COUPLE_PAUSES"      // Number of times an axis was paused to wait for the other (readback)
 
 #define SLEEP_MARGIN		1.2					// Extra factor to wait after stepping before homing
 #define HOME_SLEEP_MIN		1					// Minimum amount of time to wait after stepping/before homing
 #define SMALL_NSTEPS		5					// Number of steps to take to set direction for homing routine
-#define COUNTS_PER_STEP		1000.0				// Number of encoder counts per motor step (measured by testing)
+#define CAL_GAIN			0.1					// Default filter gain of the counts per step estimate
+#define CAL_MIN_INTERVAL	0.2					// Minimum time between calibration samples (s)
+#define CAL_MIN_STEPS		5.0					// Minimum steps between calibration samples
+#define CAL_LIMIT_FACTOR	4.0					// Reject samples more than this factor from MD90_COUNTS_PER_STEP
+#define RAMP_INCREMENTS		10					// Default number of step frequency increments per ramp
+#define REPLY_CANNOT_EXECUTE_MOVING	3			// Reply code "Cannot execute while moving"
+#define SETTLE_WINDOW		1.0					// Default settle window (counts)
+#define STALL_TIME			0.5					// Default stall detection window (s)
+#define STALL_THRESHOLD		0.2					// Default fraction of expected progress that counts as a stall
+#define JOG_BURST_STEPS		6000				// Number of steps in each open loop jog burst
+#define JOG_REARM_POLLS		2.0					// Re-arm a jog burst this many moving polls before it runs out
+#define AUTOTUNE_STEP		1000.0				// Default autotune step size (counts)
+#define AUTOTUNE_MAX_GAINS	20					// Largest number of candidate gains
+#define AUTOTUNE_TIMEOUT	10.0				// Longest time allowed for one autotune step move (s)
+#define AUTOTUNE_DWELL		0.5					// Time the position is watched after a step move completes (s)
+#define AUTOTUNE_SAMPLE_PERIOD 0.005			// Pause between autotune samples, lets the poller in (s)
+#define HOME_TIMEOUT		120.0				// Default time allowed for one axis of a group home (s)
+#define HOME_POLL_PERIOD	0.2					// Time between GHS queries while waiting for a group home (s)
+#define RECONCILE_TOLERANCE	10.0				// Default reconcile position tolerance (counts)
+#define RECONNECT_INTERVAL	2.0					// Time between attempts to reopen a lost serial port (s)
+#define STATE_RETRY_INTERVAL 10.0				// Time between attempts to write the state file after a failure (s)
+#define RETRY_LIMIT			3					// Default number of retries per command or move
+#define RETRY_DELAY			0.1					// Default first back-off delay (s)
+#define SETTLE_GAIN			0.2					// Filter gain of the settle time estimate
+#define PLAN_MAX_POINTS		1000				// Largest number of points the planner orders
+#define PLAN_MAX_PASSES		100					// Largest number of improvement passes over the planned order
+#define SOAK_VELOCITY		100000.0			// Velocity of the soak test moves (counts / sec)
+#define SOAK_STUCK_TIME		60.0				// A soak test move not done after this long fails the test (s)
+#define JITTER_GAIN			0.05				// Filter gain of the mean poll start lateness
+#define JITTER_EARLY_LIMIT	0.002				// A poll starting this much before its schedule was woken early (s)
+#define APPROACH_DISTANCE	1000.0				// Default overshoot of an approach-direction move (counts)
+#define COMPARE_MAX_POINTS	10000				// Largest number of position compare positions per axis
+#define COARSE_DEADBAND		1000				// Default deadband of coarse moves (nm)
+#define COUPLE_THRESHOLD	100.0				// Default position difference of a coupled pair that pauses the axis ahead (counts)
+#define COUPLE_RESUME_FRACTION 0.5				// A paused axis resumes when the difference falls below this fraction of the threshold
+
+// State of the I gain autotune routine
+enum MD90AutotuneState {
+  MD90_AUTOTUNE_IDLE,
+  MD90_AUTOTUNE_RUNNING,
+  MD90_AUTOTUNE_DONE,
+  MD90_AUTOTUNE_FAILED,
+  MD90_AUTOTUNE_ABORTED
+};
+
+// Classes of controller errors, from reply codes and STA error states
+enum MD90ErrorClass {
+  MD90_ERROR_NONE,
+  MD90_ERROR_COMM,              // No reply from the controller
+  MD90_ERROR_BUSY,              // Reply 3: cannot execute while moving
+  MD90_ERROR_REJECTED,          // Any other non-zero reply code, including unrecognized commands
+  MD90_ERROR_HOMING,            // STA 4: homing error
+  MD90_ERROR_STANCE,            // STA 5: stance error
+  MD90_ERROR_OPEN_LOOP,         // STA 7: open loop move error
+  MD90_ERROR_CLOSED_LOOP,       // STA 8: closed loop move error
+  MD90_ERROR_END_OF_TRAVEL,     // STA 10: end of travel error
+  MD90_ERROR_RAMP,              // STA 11: ramp move error
+  MD90_ERROR_NUM
+};
+
+// Direction from which moves end, so that backlash is always taken up the same way
+enum MD90ApproachMode {
+  MD90_APPROACH_OFF,            // Move straight to the target
+  MD90_APPROACH_POSITIVE,       // End every move travelling in the positive direction
+  MD90_APPROACH_NEGATIVE        // End every move travelling in the negative direction
+};
+
+// Deadband used by moves; MD90_DEADBAND is the default the controller returns to
+enum MD90PrecisionMode {
+  MD90_PRECISION_FINE,          // Move with the default deadband
+  MD90_PRECISION_COARSE,        // Move with the coarse deadband, then restore the default
+  MD90_PRECISION_TWO_STAGE      // Move with the coarse deadband, then settle with the default
+};
+
+// Action taken on a recoverable error
+enum MD90RecoveryPolicy {
+  MD90_RECOVER_FAIL,            // Report the error and fail the command or move
+  MD90_RECOVER_STOP_RETRY,      // Stop the motor and retry at once
+  MD90_RECOVER_BACKOFF_RETRY    // Retry after a delay that doubles with each attempt
+};
+
+// Result of comparing the controller's home state at startup with the state file
+enum MD90ReconcileState {
+  MD90_RECONCILE_PENDING,       // Not checked yet
+  MD90_RECONCILE_REFERENCED,    // Still homed at the persisted position; no homing needed
+  MD90_RECONCILE_NOT_HOMED,     // The controller has lost its reference
+  MD90_RECONCILE_MISMATCH,      // Homed, but the position or home state disagrees with the state file
+  MD90_RECONCILE_NO_STATE       // No persisted state to compare against
+};
+
+// Action taken when encoder progress shows that a move has stalled
+enum MD90StallPolicy {
+  MD90_STALL_IGNORE,            // Stall detection disabled
+  MD90_STALL_FLAG,              // Mark the axis as a problem and let the controller continue
+  MD90_STALL_STOP               // Stop the axis and mark it as a problem
+};
+
+// Elements of the MD90_MOVE_SUMMARY waveform
+enum {
+  MD90_SUMMARY_MOVE,            // Move number
+  MD90_SUMMARY_TARGET,          // Target position (counts)
+  MD90_SUMMARY_DURATION,        // Move duration (s)
+  MD90_SUMMARY_SETTLE,          // Settle time (s)
+  MD90_SUMMARY_OVERSHOOT,       // Overshoot (counts)
+  MD90_SUMMARY_FINAL_ERROR,     // Final error (counts)
+  MD90_SUMMARY_PEAK_VELOCITY,   // Peak measured velocity (counts/s)
+  MD90_SUMMARY_MEAN_VELOCITY,   // Mean velocity over the move (counts/s)
+  MD90_SUMMARY_STATUS,          // STA status at the end of the move
+  MD90_SUMMARY_SIZE
+};
+
+// Parameters of an axis for predicting point to point move times
+struct MD90MoveModel {
+  double position;              // Encoder position at the last poll (counts)
+  double velocity;              // Step frequency times counts per step (counts/s)
+  double settle;                // Filtered settle time of recent moves (s)
+  double predict(double from, double to) const;
+};
+
+// Scheduling of a driver thread, see MD90ThreadConfig
+struct MD90ThreadSettings {
+  int policy;                   // SCHED_OTHER, SCHED_FIFO or SCHED_RR, -1 to keep the current policy
+  int priority;                 // Priority for SCHED_FIFO and SCHED_RR (1-99)
+  std::string cpus;             // CPUs the thread may run on, e.g. "2-3,6"; empty to keep
+};
+
+// An axis taking part in a plan
+struct MD90PlanAxis {
+  class MD90Controller *pC;
+  int axisNo;
+};
 
 class epicsShareClass MD90Axis : public asynMotorAxis
 {
@@ -36,9 +255,167 @@ private:
   MD90Controller *pC_;          /**< Pointer to the asynMotorController to which this axis belongs.
                                    *   Abbreviated because it is used very frequently */
   asynStatus sendAccelAndVelocity(double accel, double velocity);
-  asynStatus parseReply(const char *functionName, const char *reply);
+  asynStatus sendStepFrequency(int freq, int *replyStatus);
+  asynStatus parseReply(const char *functionName, const char *reply, int *replyStatus = NULL);
+  asynStatus startRamp(double target, double minVelocity, double maxVelocity, double acceleration);
+  asynStatus updateRamp(double position);
+  asynStatus retarget(int freq);
+  int velocityToFrequency(double velocity);
+  double predictMoveTime(double distance, double minVelocity, double maxVelocity, double acceleration);
+  void updateCalibration(double position, int status);
+  void restoreState(const char *key, double value);
+  void reconcile(double position, int homed);
+  asynStatus restoreSettings();
+  asynStatus warmStart();
+  void countError(int errorClass);
+  asynStatus recoverBusy(int freq);
+  bool recoverMove(int status);
+  bool startApproach();
+  bool startFineStage();
+  void restoreDeadband();
+  asynStatus enableCouple(bool enable);
+  void updateCouple(double position, bool *moving);
+  asynStatus pauseMove(bool pause);
+  asynStatus readNow(bool readStatus);
+  asynStatus armCompare(bool arm);
+  void checkCompare(double position, double sampleTime);
+  void publishCompare();
+  asynStatus sendDeadband(int deadband);
+  void startMoveStats();
+  void updateMoveStats(double position, int status, bool moving);
+  bool checkStall(double position, int status);
+  asynStatus checkMoveAllowed(const char *functionName, bool leaderAllowed);
+  asynStatus streamSetpoint(double target);
+  void queueSetpoint(double target, int freq);
+  asynStatus sendSetpoint();
+  asynStatus startJogBurst(bool rearm, bool *refused);
+  asynStatus updateJog(int status);
+  void saveState(FILE *fp);
+  asynStatus query(const char *command, double *value);
+  asynStatus pollQuery(const char *command, MD90Reply *reply);
+  asynStatus startAutotune();
+  void autotune();
+  asynStatus autotuneStep(double target, double window, double *settle, double *overshoot);
+  asynStatus homeAndWait(int forwards, double timeout, double *elapsed);
+  MD90MoveModel moveModel();
+
+  double lastPosition_;         /**< Encoder position read at the last poll (counts) */
+  double moveTarget_;           /**< Absolute target of the last closed loop move (counts) */
+  int stepFreq_;                /**< Step frequency last accepted by the controller (Hz) */
+
+  // Host-side acceleration ramp state
+  bool rampActive_;             /**< A ramped move is in progress */
+  double rampTarget_;           /**< Absolute target of the ramped move (counts) */
+  double rampMinFreq_;          /**< Start/end step frequency (Hz) */
+  double rampMaxFreq_;          /**< Cruise step frequency (Hz) */
+  double rampRate_;             /**< Step frequency slew rate (Hz/s) */
+  double rampIncrement_;        /**< Smallest frequency change worth sending (Hz) */
+  epicsTimeStamp rampStartTime_;
+
+  // Online calibration of encoder counts per motor step
+  double countsPerStep_;        /**< Filtered estimate of encoder counts per step */
+  bool calValid_;               /**< calPosition_/calTime_ hold a usable reference sample */
+  double calPosition_;          /**< Position of the reference sample (counts) */
+  int calFreq_;                 /**< Step frequency in use at the reference sample (Hz) */
+  epicsTimeStamp calTime_;
+  bool stateChanged_;           /**< Persisted state differs from the state file */
+
+  // Reconciliation of the home state with the state file after a restart
+  int homed_;                   /**< Home state last read with GHS */
+  double savedPosition_;        /**< Position recorded in the state file (counts) */
+  int savedHomed_;              /**< Home state recorded in the state file, -1 if none */
+  bool homeSuspect_;            /**< Reconciliation failed; homed is not reported until the axis is homed again */
+  bool homeTimed_;              /**< A home started by home() is being timed for the metrics */
+  double homeStartTime_;        /**< MD90Metrics::now() when HOM was sent */
+
+  // Settings read back or written while connected, restored after the controller is reattached
+  bool commLost_;               /**< The last poll failed to communicate with the controller */
+  int powerOn_;                 /**< Power supply state from GPS, -1 if not known */
+  int gain_;                    /**< Integral gain from GGN, -1 if not known */
+  int persistentMove_;          /**< Persistent move state from GPM, -1 if not known */
+  bool deadbandVerified_;       /**< The controller is known to hold the MD90_DEADBAND value */
+  int activeDeadband_;          /**< Deadband last written to the controller (nm), -1 if not known */
+
+  // Error counters and automatic recovery
+  double errorCounts_[MD90_ERROR_NUM]; /**< Errors of each MD90ErrorClass */
+  int lastStatus_;              /**< STA status at the previous poll */
+  int retryCount_;              /**< Retries made for the current move */
+  bool retryPending_;           /**< A backed-off retry of the current move is waiting */
+  epicsTimeStamp retryTime_;    /**< Time at which the pending retry is due */
+
+  // Approach-direction moves
+  bool approachPending_;        /**< The move is on its overshoot leg; the final leg follows */
+  double approachTarget_;       /**< Final target of the move (counts) */
+
+  // Per-move deadband
+  bool moveDeadbandActive_;     /**< The controller holds a move's coarse deadband instead of the default */
+  bool finePending_;            /**< A two-stage move is on its coarse stage; the fine stage follows */
+
+  // Coupled pair of axes on two controllers, moved as one from the leader
+  class MD90Controller *coupleC_; /**< Controller of the follower if this axis leads a pair, else NULL */
+  int coupleAxisNo_;            /**< Axis number of the follower */
+  bool coupleEnabled_;          /**< Moves of this axis are mirrored to the follower */
+  bool coupleLocked_;           /**< This axis follows an enabled leader; its own moves are refused */
+  bool coupleActive_;           /**< A coupled move is in progress */
+  int couplePaused_;            /**< 1 if this axis, -1 if the follower is paused for the other to catch up */
+  double coupleOffset_;         /**< Follower minus leader position when coupling was enabled (counts) */
+  double coupleStart_;          /**< Leader position at the start of the coupled move (counts) */
+  double coupleMaxDiff_;        /**< Largest position difference of the coupled move (counts) */
+  bool pauseActive_;            /**< This axis is paused by its pair; the poll reports it moving */
+
+  // Software position compare from timestamped encoder samples
+  bool compareArmed_;           /**< Crossings of comparePositions_ are being watched */
+  std::vector<double> comparePositions_; /**< Positions written to MD90_COMPARE_POSITIONS (counts) */
+  std::vector<double> compareTimes_;     /**< MD90Metrics::now() of each crossing, in position order */
+  size_t compareSent_;          /**< Crossings already delivered as events */
+  double compareArmTime_;       /**< MD90Metrics::now() when armed */
+  bool compareSampleValid_;     /**< comparePosition_/compareTime_ hold the previous encoder sample */
+  double comparePosition_;
+  double compareTime_;          /**< MD90Metrics::now() at which comparePosition_ was read */
+
+  // Motion statistics derived from timestamped encoder samples
+  bool sampleValid_;            /**< samplePosition_/sampleTime_ hold the previous encoder sample */
+  double samplePosition_;
+  epicsTimeStamp sampleTime_;
+  double measVelocity_;         /**< Velocity measured between the last two samples (counts/s) */
+  bool moveActive_;             /**< A closed loop move is being tracked */
+  double moveStart_;            /**< Position at the start of the tracked move (counts) */
+  epicsTimeStamp moveStartTime_;
+  double moveOvershoot_;
+  double settleMean_;           /**< Filtered settle time of recent moves (s), -1 before the first move */
+  double movePeakVelocity_;
+  bool settled_;                /**< Position is inside the settle window */
+  epicsTimeStamp settleTime_;   /**< Time the position last entered the settle window */
+
+  // Stall detection from encoder progress
+  bool stalled_;                /**< A stall was detected during the current move */
+  bool stallValid_;             /**< stallPosition_/stallTime_ hold the start of the current window */
+  double stallPosition_;
+  int stallMinFreq_;            /**< Lowest step frequency used in the current window (Hz) */
+  epicsTimeStamp stallTime_;
+
+  // Setpoint streaming: only the latest pending target is sent, from the poller
+  bool streamPending_;          /**< A setpoint is waiting to be sent */
+  double streamSetpoint_;       /**< Latest pending target (counts) */
+  int streamFreq_;              /**< Step frequency wanted for the pending target, 0 to keep the current one */
+  epicsTimeStamp streamTime_;   /**< Time the pending target was received */
+
+  // Continuous jog built from open loop step bursts
+  bool jogActive_;              /**< A jog is in progress and bursts are re-armed */
+  int jogDirection_;            /**< 1 for ESF, -1 for ESB */
+  epicsTimeStamp jogBurstTime_; /**< Time the current burst was started */
+  bool jogRearmMoving_;         /**< Re-arm before the burst runs out; cleared once the controller refuses that */
+
+  // I gain autotuning, run in its own thread
+  bool autotuneActive_;         /**< Autotune is running; moves from the record are refused */
+  bool autotuneAbort_;          /**< Autotune was asked to stop */
+
+  // Group homing, run from MD90HomeAll
+  bool homeActive_;             /**< A group home is running; moves from the record are refused */
+  bool homeAbort_;              /**< The group home was asked to stop */
   
 friend class MD90Controller;
+friend void MD90AutotuneThreadC(void *pPvt);
 };
 
 class epicsShareClass MD90Controller : public asynMotorController {
@@ -48,6 +425,135 @@ public:
   void report(FILE *fp, int level);
   MD90Axis* getAxis(asynUser *pasynUser);
   MD90Axis* getAxis(int axisNo);
+  static MD90Controller* findAxis(const char *functionName, const char *spec, int *axisNo);
+  asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+  asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+  asynStatus writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements);
+  asynStatus poll();
+  asynStatus loadState(const char *fileName);
+  asynStatus saveState();
+  asynStatus startAutotune(int axisNo, double step, int minGain, int maxGain, int numGains);
+  asynStatus homeAxis(int axisNo, int forwards, double timeout, double *elapsed);
+  using asynMotorController::writeReadController;
+  asynStatus writeReadController();
+  asynStatus getMoveModel(int axisNo, MD90MoveModel *model);
+  asynStatus setPlanAxes(const char *axes);
+  asynStatus moveAxis(int axisNo, double position, double velocity);
+  asynStatus setThreadSettings(bool poller, bool io, const MD90ThreadSettings &settings);
+  asynStatus setCouple(int axisNo, MD90Controller *follower, int followerAxisNo);
+  asynStatus lockFollower(int axisNo, bool locked);
+  asynStatus followMove(int axisNo, double position, double minVelocity, double maxVelocity, double acceleration);
+  asynStatus pauseFollower(int axisNo, bool pause);
+  asynStatus stopFollower(int axisNo);
+  asynStatus getCoupleState(int axisNo, double *position, bool *moving);
+
+protected:
+  int MD90RampIncrements_;
+#define FIRST_MD90_PARAM MD90RampIncrements_
+  int MD90RampActive_;
+  int MD90StepFrequency_;
+  int MD90CountsPerStep_;
+  int MD90CalGain_;
+  int MD90CalSamples_;
+  int MD90MoveEta_;
+  int MD90MeasVelocity_;
+  int MD90SettleWindow_;
+  int MD90MoveDuration_;
+  int MD90SettleTime_;
+  int MD90Overshoot_;
+  int MD90FinalError_;
+  int MD90MoveCount_;
+  int MD90MoveErrors_;
+  int MD90MoveSummary_;
+  int MD90StallPolicy_;
+  int MD90StallTime_;
+  int MD90StallThreshold_;
+  int MD90Stalled_;
+  int MD90StallCount_;
+  int MD90StreamMode_;
+  int MD90StreamSetpoint_;
+  int MD90StreamSetpoints_;
+  int MD90StreamSent_;
+  int MD90StreamDrops_;
+  int MD90StreamLatency_;
+  int MD90StreamMaxLatency_;
+  int MD90Autotune_;
+  int MD90AutotuneState_;
+  int MD90AutotuneStep_;
+  int MD90AutotuneMinGain_;
+  int MD90AutotuneMaxGain_;
+  int MD90AutotuneNumGains_;
+  int MD90AutotuneGain_;
+  int MD90AutotuneSettle_;
+  int MD90AutotuneOvershoot_;
+  int MD90AutotuneResults_;
+  int MD90HomeTime_;
+  int MD90Reconcile_;
+  int MD90ReconcileTolerance_;
+  int MD90Deadband_;
+  int MD90ReattachCount_;
+  int MD90RecoverBusy_;
+  int MD90RecoverStance_;
+  int MD90RecoverRamp_;
+  int MD90RetryLimit_;
+  int MD90RetryDelay_;
+  int MD90RetryCount_;
+  int MD90LastError_;
+  int MD90ErrorCounts_;
+  int MD90ReadNow_;
+  int MD90Position_;
+  int MD90SettleMean_;
+  int MD90PlanPoints_;
+  int MD90Plan_;
+  int MD90PlanOrder_;
+  int MD90PlanTotal_;
+  int MD90PlanNaturalTotal_;
+  int MD90PollJitter_;
+  int MD90PollJitterMean_;
+  int MD90PollJitterMax_;
+  int MD90PollJitterReset_;
+  int MD90ApproachMode_;
+  int MD90ApproachDistance_;
+  int MD90ComparePositions_;
+  int MD90CompareArm_;
+  int MD90CompareEvent_;
+  int MD90CompareCount_;
+  int MD90CompareTimes_;
+  int MD90CompareLatency_;
+  int MD90CompareLatencyMax_;
+  int MD90PrecisionMode_;
+  int MD90CoarseDeadband_;
+  int MD90ActiveDeadband_;
+  int MD90CoupleEnable_;
+  int MD90CoupleThreshold_;
+  int MD90CoupleOffset_;
+  int MD90CoupleDiff_;
+  int MD90CoupleMaxDiff_;
+  int MD90CouplePauses_;
+#define LAST_MD90_PARAM MD90CouplePauses_
+
+#define NUM_MD90_PARAMS ((int)(&LAST_MD90_PARAM - &FIRST_MD90_PARAM + 1))
+
+private:
+  char *stateFile_;             /**< File holding persisted axis state, NULL if not configured */
+  bool stateSaveFailed_;        /**< The last attempt to write the state file failed */
+  epicsTimeStamp stateSaveTime_; /**< Time of the last attempt to write the state file */
+  asynUser *pasynUserCommon_;   /**< asynCommon connection to the serial port, used to reopen it */
+  epicsTimeStamp reconnectTime_; /**< Time of the last attempt to reopen the serial port */
+  MD90Metrics metrics_;         /**< Counters and histograms for MD90MetricsServer */
+  int recorderId_;              /**< Index of this controller in MD90Recorder samples */
+  std::vector<MD90PlanAxis> planAxes_; /**< Axes of the plan points, in column order; empty for this controller's axis */
+  std::vector<double> planPoints_;     /**< Points written to MD90_PLAN_POINTS */
+  asynStatus planPoints(int axisNo);
+  std::string ioPortName_;      /**< Serial port driver of the controller */
+  MD90ThreadSettings pollerSettings_; /**< Scheduling for the poller thread, applied by poll() */
+  bool pollerSettingsPending_;
+  double pollEnd_;              /**< MD90Metrics::now() at the end of the last poll cycle, 0 before the first */
+  bool pollMoving_;             /**< An axis was moving in the last poll cycle */
+  double jitterMean_;
+  double jitterMax_;
+  void measurePollJitter();
+  void applyPollerSettings();
 
 friend class MD90Axis;
 };
@@ -0,0 +1,319 @@
+/*
+FILENAME... MD90Home.cpp
+USAGE...    Group homing across DSM MD-90 controllers.
+
+Homing one MD-90 axis takes a direction-setting step burst, a wait of at least
+a second, then HOM and a wait for the move to end with GHS reporting the axis
+referenced.  Each
+controller drives a single axis, so axes on different controllers can home at
+the same time.  MD90HomeAll takes an ordered list of groups: the axes within a
+group home concurrently, up to a concurrency limit, and a group starts only
+when every axis of the previous group has homed.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+#include <iocsh.h>
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+
+#define NINT(f) (int)((f)>0 ? (f)+0.5 : (f)-0.5)
+
+/** One axis of a group home */
+struct MD90HomeJob {
+  std::string name;             /**< Port name and axis as given on the command line */
+  MD90Controller *pC;
+  int axisNo;
+  asynStatus status;
+  double elapsed;               /**< Time taken to home the axis (s) */
+};
+
+/** The jobs of one group, shared by the threads that home it */
+struct MD90HomeRun {
+  std::vector<MD90HomeJob> *jobs;
+  size_t next;                  /**< Index of the next job to start */
+  size_t running;               /**< Number of threads that have not finished */
+  int forwards;
+  double timeout;
+  epicsMutexId lock;
+  epicsEventId done;            /**< Signalled when the last thread finishes */
+};
+
+/** Body of a group home thread: homes axes of the group until none is left */
+static void MD90HomeThreadC(void *pPvt)
+{
+  MD90HomeRun *run = (MD90HomeRun *)pPvt;
+  MD90HomeJob *job;
+
+  for (;;) {
+    epicsMutexMustLock(run->lock);
+    job = (run->next < run->jobs->size()) ? &(*run->jobs)[run->next++] : NULL;
+    if (!job && --run->running == 0) epicsEventSignal(run->done);
+    epicsMutexUnlock(run->lock);
+    if (!job) break;
+    job->status = job->pC->homeAxis(job->axisNo, run->forwards, run->timeout, &job->elapsed);
+  }
+}
+
+/** Homes the axis and waits until the home routine has ended with the axis referenced.
+  * Unlike home(), this is called without the controller locked; the lock is only held
+  * for each transaction so the poller and other axes keep running.
+  * \param[in] forwards  Start the home routine in the forward direction
+  * \param[in] timeout   Longest time to wait for GHS to report the axis homed (s)
+  * \param[out] elapsed  Time taken (s)
+  */
+asynStatus MD90Axis::homeAndWait(int forwards, double timeout, double *elapsed)
+{
+  epicsTimeStamp start, now;
+  double sleepTime, homed, status;
+  asynStatus comStatus;
+  static const char *functionName = "MD90Axis::homeAndWait";
+
+  epicsTimeGetCurrent(&start);
+  *elapsed = 0.;
+  pC_->lock();
+  // Also refuses a coupled axis, whose partner would not follow the home
+  if (checkMoveAllowed(functionName, false)) {
+    pC_->unlock();
+    return asynError;
+  }
+  homeActive_ = true;
+  homeAbort_ = false;
+  homeSuspect_ = false;
+  jogActive_ = false;
+  rampActive_ = false;
+  setIntegerParam(pC_->MD90RampActive_, 0);
+
+  // Set the direction of the home routine with a small step burst, as in home()
+  sprintf(pC_->outString_, "SNS %d", SMALL_NSTEPS);
+  comStatus = pC_->writeReadController();
+  if (!comStatus) comStatus = parseReply(functionName, pC_->inString_);
+  if (!comStatus) {
+    sprintf(pC_->outString_, forwards ? "ESF" : "ESB");
+    comStatus = pC_->writeReadController();
+  }
+  if (!comStatus) comStatus = parseReply(functionName, pC_->inString_);
+  pC_->unlock();
+
+  if (!comStatus) {
+    sleepTime = (stepFreq_ > 0) ? SLEEP_MARGIN * SMALL_NSTEPS / stepFreq_ : 0.;
+    if (sleepTime < HOME_SLEEP_MIN) sleepTime = HOME_SLEEP_MIN;
+    epicsThreadSleep(sleepTime);
+    if (homeAbort_) comStatus = asynError;
+  }
+  if (!comStatus) {
+    pC_->lock();
+    sprintf(pC_->outString_, "HOM");
+    comStatus = pC_->writeReadController();
+    if (!comStatus) comStatus = parseReply(functionName, pC_->inString_);
+    if (!comStatus) {
+      MD90Recorder::post(pC_->recorderId_, axisNo_, MD90_RECORD_HOME_START, lastPosition_, lastStatus_, 0, 0.);
+    }
+    pC_->unlock();
+  }
+
+  while (!comStatus) {
+    epicsThreadSleep(HOME_POLL_PERIOD);
+    epicsTimeGetCurrent(&now);
+    *elapsed = epicsTimeDiffInSeconds(&now, &start);
+    if (homeAbort_) {
+      comStatus = asynError;
+      break;
+    }
+    pC_->lock();
+    comStatus = query("GHS", &homed);
+    if (!comStatus) comStatus = query("STA", &status);
+    pC_->unlock();
+    if (comStatus) break;
+    // An axis that was already referenced keeps GHS at 1 during the home routine
+    if (NINT(homed) == 1 && NINT(status) != MD90_STA_MOVING) break;
+    if (md90IsErrorStatus(NINT(status))) {
+      asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: %s axis %d: home failed: %s\n",
+        functionName, pC_->portName, axisNo_, md90StatusName(NINT(status)));
+      comStatus = asynError;
+    }
+    if (!comStatus && *elapsed > timeout) {
+      asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s: %s axis %d: home timed out after %f s\n",
+        functionName, pC_->portName, axisNo_, *elapsed);
+      pC_->lock();
+      sprintf(pC_->outString_, "STP");
+      pC_->writeReadController();
+      pC_->unlock();
+      comStatus = asynError;
+    }
+  }
+
+  epicsTimeGetCurrent(&now);
+  *elapsed = epicsTimeDiffInSeconds(&now, &start);
+  pC_->lock();
+  homeActive_ = false;
+  if (!comStatus) {
+    setDoubleParam(pC_->MD90HomeTime_, *elapsed);
+    pC_->metrics_.current().axes[axisNo_].homeDuration.observe(*elapsed);
+  }
+  callParamCallbacks();
+  pC_->unlock();
+  return comStatus;
+}
+
+/** Homes one axis and waits for it to be referenced.
+  * \param[in] axisNo    Axis number
+  * \param[in] forwards  Start the home routine in the forward direction
+  * \param[in] timeout   Longest time to wait for the axis to home (s)
+  * \param[out] elapsed  Time taken (s)
+  */
+asynStatus MD90Controller::homeAxis(int axisNo, int forwards, double timeout, double *elapsed)
+{
+  MD90Axis *pAxis;
+
+  *elapsed = 0.;
+  pAxis = getAxis(axisNo);
+  if (!pAxis) return asynError;
+  return pAxis->homeAndWait(forwards, timeout, elapsed);
+}
+
+/** Parses one group of a MD90HomeAll specification.
+  * Axes are "port" or "port:axis", separated by commas or spaces.
+  */
+static asynStatus parseHomeGroup(const char *functionName, char *group, std::vector<MD90HomeJob> &jobs)
+{
+  MD90HomeJob job;
+  char *name, *save;
+
+  for (name = epicsStrtok_r(group, ", \t", &save); name; name = epicsStrtok_r(NULL, ", \t", &save)) {
+    job.name = name;
+    job.pC = MD90Controller::findAxis(functionName, name, &job.axisNo);
+    if (!job.pC) return asynError;
+    job.status = asynSuccess;
+    job.elapsed = 0.;
+    jobs.push_back(job);
+  }
+  return asynSuccess;
+}
+
+/** Homes axes on one or more controllers, concurrently within each group.
+  * Configuration command, called directly or from iocsh.  Returns when all groups have
+  * homed or a group has failed; later groups are not started after a failure.
+  * \param[in] axes           Groups separated by ';', in the order they must home.  Each group
+  *                           lists "port" or "port:axis", separated by commas or spaces.
+  * \param[in] maxConcurrent  Largest number of axes homing at the same time, 0 for no limit
+  * \param[in] forwards       Start the home routines in the forward direction
+  * \param[in] timeout        Longest time to wait for each axis to home (s), 0 for HOME_TIMEOUT
+  */
+extern "C" int MD90HomeAll(const char *axes, int maxConcurrent, int forwards, double timeout)
+{
+  std::vector<std::vector<MD90HomeJob> > groups;
+  MD90HomeRun run;
+  epicsTimeStamp start, now;
+  char threadName[32];
+  char *spec, *group, *save;
+  size_t g, i, numWorkers, numStarted;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "MD90HomeAll";
+
+  if (!axes || !*axes) {
+    printf("%s: no axes given\n", functionName);
+    return asynError;
+  }
+  if (timeout <= 0.) timeout = HOME_TIMEOUT;
+
+  spec = epicsStrDup(axes);
+  for (group = epicsStrtok_r(spec, ";", &save); group && !status; group = epicsStrtok_r(NULL, ";", &save)) {
+    groups.push_back(std::vector<MD90HomeJob>());
+    status = parseHomeGroup(functionName, group, groups.back());
+    if (groups.back().empty()) groups.pop_back();
+  }
+  free(spec);
+  if (status) return status;
+
+  run.forwards = forwards;
+  run.timeout = timeout;
+  run.lock = epicsMutexMustCreate();
+  run.done = epicsEventMustCreate(epicsEventEmpty);
+
+  epicsTimeGetCurrent(&start);
+  for (g=0; g<groups.size() && !status; g++) {
+    std::vector<MD90HomeJob> &jobs = groups[g];
+
+    numWorkers = jobs.size();
+    if (maxConcurrent > 0 && (size_t)maxConcurrent < numWorkers) numWorkers = maxConcurrent;
+    run.jobs = &jobs;
+    run.next = 0;
+    run.running = numWorkers;
+    numStarted = 0;
+    for (i=0; i<numWorkers; i++) {
+      epicsSnprintf(threadName, sizeof(threadName), "MD90Home%d", (int)i);
+      if (epicsThreadCreate(threadName, epicsThreadPriorityLow,
+                            epicsThreadGetStackSize(epicsThreadStackMedium),
+                            (EPICSTHREADFUNC)MD90HomeThreadC, &run)) numStarted++;
+    }
+    if (numStarted < numWorkers) {
+      printf("%s: group %d: only %d of %d home threads started\n",
+        functionName, (int)g + 1, (int)numStarted, (int)numWorkers);
+      // Threads that did not start never finish; the started ones share the jobs between them
+      epicsMutexMustLock(run.lock);
+      run.running -= numWorkers - numStarted;
+      if (numStarted == 0) {
+        for (i=0; i<jobs.size(); i++) jobs[i].status = asynError;
+      }
+      if (run.running == 0) epicsEventSignal(run.done);
+      epicsMutexUnlock(run.lock);
+    }
+    epicsEventMustWait(run.done);
+    // The last thread signals with the lock held; once it is free the thread is done with run
+    epicsMutexMustLock(run.lock);
+    epicsMutexUnlock(run.lock);
+
+    for (i=0; i<jobs.size(); i++) {
+      printf("%s: group %d: %s %s in %.1f s\n", functionName, (int)g + 1, jobs[i].name.c_str(),
+        jobs[i].status ? "failed" : "homed", jobs[i].elapsed);
+      if (jobs[i].status) status = asynError;
+    }
+  }
+  epicsTimeGetCurrent(&now);
+  epicsEventDestroy(run.done);
+  epicsMutexDestroy(run.lock);
+
+  if (status && g < groups.size()) {
+    printf("%s: group %d failed, %d later group(s) not homed\n",
+      functionName, (int)g, (int)(groups.size() - g));
+  }
+  printf("%s: total %.1f s\n", functionName, epicsTimeDiffInSeconds(&now, &start));
+  return status;
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90HomeAllArg0 = {"Axes (port[:axis], groups separated by ;)", iocshArgString};
+static const iocshArg MD90HomeAllArg1 = {"Maximum concurrent axes", iocshArgInt};
+static const iocshArg MD90HomeAllArg2 = {"Forwards", iocshArgInt};
+static const iocshArg MD90HomeAllArg3 = {"Timeout (s)", iocshArgDouble};
+static const iocshArg * const MD90HomeAllArgs[] = {&MD90HomeAllArg0,
+                                                    &MD90HomeAllArg1,
+                                                    &MD90HomeAllArg2,
+                                                    &MD90HomeAllArg3};
+static const iocshFuncDef MD90HomeAllDef = {"MD90HomeAll", 4, MD90HomeAllArgs};
+static void MD90HomeAllCallFunc(const iocshArgBuf *args)
+{
+  MD90HomeAll(args[0].sval, args[1].ival, args[2].ival, args[3].dval);
+}
+
+static void MD90HomeRegister(void)
+{
+  iocshRegister(&MD90HomeAllDef, MD90HomeAllCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90HomeRegister);
+}
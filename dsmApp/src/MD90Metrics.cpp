@@ -0,0 +1,398 @@
+/*
+FILENAME...   MD90Metrics.cpp
+USAGE...      OpenMetrics export of DSM MD-90 driver counters and histograms.
+
+MD90MetricsServer starts a small HTTP server that answers GET /metrics with the
+metrics of every MD-90 controller in the IOC, in the OpenMetrics text format
+that Prometheus scrapes.  It serves one connection at a time and is meant to be
+bound to a local or management network address.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include <iocsh.h>
+#include <osiSock.h>
+#include <epicsThread.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+
+#define METRICS_REQUEST_SIZE  2048    // Longest request header read
+#define METRICS_RECV_TIMEOUT  2       // Time allowed for a client to send its request (s)
+
+// Upper bounds of the histogram buckets (s), from command round trips to homing
+static const double md90MetricsBuckets[MD90_METRICS_NUM_BUCKETS] = {
+  0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1., 2., 5., 10., 20., 50., 100.
+};
+
+// Label values of MD90ErrorClass
+static const char *md90ErrorClassNames[MD90_ERROR_NUM] = {
+  "none", "comm", "busy", "rejected", "homing", "stance",
+  "open_loop", "closed_loop", "end_of_travel", "ramp"
+};
+
+static std::vector<MD90Metrics *> registry;
+static std::mutex registryLock;
+static std::atomic<bool> serverRunning(false);
+static std::atomic<bool> publishing(false);
+static SOCKET serverSocket = INVALID_SOCKET;
+
+MD90Histogram::MD90Histogram()
+  : sum(0.), count(0.), max(0.)
+{
+  int i;
+
+  for (i=0; i<=MD90_METRICS_NUM_BUCKETS; i++) counts[i] = 0.;
+}
+
+void MD90Histogram::observe(double value)
+{
+  int i;
+
+  for (i=0; i<MD90_METRICS_NUM_BUCKETS && value > md90MetricsBuckets[i]; i++);
+  counts[i]++;
+  sum += value;
+  count++;
+  if (value > max) max = value;
+}
+
+/** Creates the metrics of one controller and adds them to those served
+  * \param[in] portName  asyn port name of the controller, used as the controller label
+  * \param[in] numAxes   Number of axes */
+MD90Metrics::MD90Metrics(const char *portName, int numAxes)
+{
+  int axis;
+
+  current_.portName = portName;
+  current_.timeouts = 0.;
+  current_.axes.resize(numAxes);
+  for (axis=0; axis<numAxes; axis++) {
+    current_.axes[axis].moves = 0.;
+    current_.axes[axis].commLostSince = 0.;
+    current_.axes[axis].errors.assign(MD90_ERROR_NUM, 0.);
+  }
+  std::lock_guard<std::mutex> guard(registryLock);
+  registry.push_back(this);
+}
+
+/** Monotonic time (s) for the durations recorded here */
+double MD90Metrics::now()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Records one command round trip
+  * \param[in] command  The command sent; the mnemonic before the first space is the label
+  * \param[in] rtt      Time from writing the command to reading the reply (s)
+  * \param[in] timeout  No reply was received */
+void MD90Metrics::command(const char *command, double rtt, bool timeout)
+{
+  char mnemonic[8] = "";
+
+  if (sscanf(command, "%7s", mnemonic) != 1) return;
+  if (timeout) {
+    current_.timeouts++;
+  } else {
+    current_.commandRtt[mnemonic].observe(rtt);
+  }
+}
+
+/** Publishes a copy of the current metrics for the server.  Does nothing until the
+  * server or the soak monitor has been started. */
+void MD90Metrics::publish()
+{
+  if (!publishing) return;
+  std::atomic_store(&snapshot_, std::shared_ptr<const MD90ControllerMetrics>(
+    std::make_shared<MD90ControllerMetrics>(current_)));
+}
+
+/** Returns the last published metrics, or an empty pointer before the first publish() */
+std::shared_ptr<const MD90ControllerMetrics> MD90Metrics::snapshot() const
+{
+  return std::atomic_load(&snapshot_);
+}
+
+/** Makes publish() copy the metrics from then on */
+void MD90Metrics::startPublishing()
+{
+  publishing = true;
+}
+
+/** Returns the last published metrics of every controller that has published */
+std::vector<std::shared_ptr<const MD90ControllerMetrics> > MD90Metrics::snapshots()
+{
+  std::vector<std::shared_ptr<const MD90ControllerMetrics> > result;
+  std::shared_ptr<const MD90ControllerMetrics> snapshot;
+  size_t c;
+
+  std::lock_guard<std::mutex> guard(registryLock);
+  for (c=0; c<registry.size(); c++) {
+    snapshot = registry[c]->snapshot();
+    if (snapshot) result.push_back(snapshot);
+  }
+  return result;
+}
+
+static void appendf(std::string *out, const char *format, ...)
+{
+  char buffer[512];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  *out += buffer;
+}
+
+static void appendFamily(std::string *out, const char *name, const char *type, const char *unit, const char *help)
+{
+  appendf(out, "# TYPE %s %s\n", name, type);
+  if (unit) appendf(out, "# UNIT %s %s\n", name, unit);
+  appendf(out, "# HELP %s %s\n", name, help);
+}
+
+/** Appends the samples of one histogram; labels is the label list without braces */
+static void appendHistogram(std::string *out, const char *name, const std::string &labels, const MD90Histogram &h)
+{
+  double cumulative = 0.;
+  int i;
+
+  for (i=0; i<MD90_METRICS_NUM_BUCKETS; i++) {
+    cumulative += h.counts[i];
+    appendf(out, "%s_bucket{%s,le=\"%g\"} %.0f\n", name, labels.c_str(), md90MetricsBuckets[i], cumulative);
+  }
+  appendf(out, "%s_bucket{%s,le=\"+Inf\"} %.0f\n", name, labels.c_str(), h.count);
+  appendf(out, "%s_count{%s} %.0f\n", name, labels.c_str(), h.count);
+  appendf(out, "%s_sum{%s} %.9g\n", name, labels.c_str(), h.sum);
+}
+
+static std::string axisLabels(const MD90ControllerMetrics &c, size_t axis)
+{
+  char buffer[256];
+
+  snprintf(buffer, sizeof(buffer), "controller=\"%s\",axis=\"%d\"", c.portName.c_str(), (int)axis);
+  return buffer;
+}
+
+/** Renders the published metrics of all controllers in the OpenMetrics text format */
+static std::string renderMetrics()
+{
+  std::vector<std::shared_ptr<const MD90ControllerMetrics> > snapshots = MD90Metrics::snapshots();
+  std::map<std::string, MD90Histogram>::const_iterator it;
+  std::string out;
+  size_t c, axis;
+  int e;
+
+  appendFamily(&out, "md90_command_rtt_seconds", "histogram", "seconds", "Command round trip time by mnemonic.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (it=snapshots[c]->commandRtt.begin(); it!=snapshots[c]->commandRtt.end(); ++it) {
+      appendHistogram(&out, "md90_command_rtt_seconds",
+        "controller=\"" + snapshots[c]->portName + "\",command=\"" + it->first + "\"", it->second);
+    }
+  }
+  appendFamily(&out, "md90_command_timeouts", "counter", NULL, "Commands that got no reply.");
+  for (c=0; c<snapshots.size(); c++) {
+    appendf(&out, "md90_command_timeouts_total{controller=\"%s\"} %.0f\n",
+      snapshots[c]->portName.c_str(), snapshots[c]->timeouts);
+  }
+  appendFamily(&out, "md90_poll_duration_seconds", "histogram", "seconds", "Time taken by each poll of an axis.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      appendHistogram(&out, "md90_poll_duration_seconds", axisLabels(*snapshots[c], axis),
+        snapshots[c]->axes[axis].pollDuration);
+    }
+  }
+  appendFamily(&out, "md90_errors", "counter", NULL,
+    "Errors by class: comm is no reply, busy and rejected are reply codes, the others are STA error states.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      for (e=MD90_ERROR_NONE + 1; e<MD90_ERROR_NUM; e++) {
+        appendf(&out, "md90_errors_total{%s,class=\"%s\"} %.0f\n", axisLabels(*snapshots[c], axis).c_str(),
+          md90ErrorClassNames[e], snapshots[c]->axes[axis].errors[e]);
+      }
+    }
+  }
+  appendFamily(&out, "md90_moves", "counter", NULL, "Completed moves.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      appendf(&out, "md90_moves_total{%s} %.0f\n", axisLabels(*snapshots[c], axis).c_str(),
+        snapshots[c]->axes[axis].moves);
+    }
+  }
+  appendFamily(&out, "md90_move_duration_seconds", "histogram", "seconds", "Time from a move command to the end of the move.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      appendHistogram(&out, "md90_move_duration_seconds", axisLabels(*snapshots[c], axis),
+        snapshots[c]->axes[axis].moveDuration);
+    }
+  }
+  appendFamily(&out, "md90_home_duration_seconds", "histogram", "seconds", "Time taken by the home routine.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      appendHistogram(&out, "md90_home_duration_seconds", axisLabels(*snapshots[c], axis),
+        snapshots[c]->axes[axis].homeDuration);
+    }
+  }
+  appendFamily(&out, "md90_recovery_duration_seconds", "histogram", "seconds",
+    "Time from losing the connection to the controller to restoring its settings.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      appendHistogram(&out, "md90_recovery_duration_seconds", axisLabels(*snapshots[c], axis),
+        snapshots[c]->axes[axis].recoveryDuration);
+    }
+  }
+  appendFamily(&out, "md90_compare_latency_seconds", "histogram", "seconds",
+    "Time from a position compare crossing to its event.");
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      appendHistogram(&out, "md90_compare_latency_seconds", axisLabels(*snapshots[c], axis),
+        snapshots[c]->axes[axis].compareLatency);
+    }
+  }
+  out += "# EOF\n";
+  return out;
+}
+
+static void sendAll(SOCKET sock, const std::string &data)
+{
+  size_t sent = 0;
+  int n;
+
+  while (sent < data.size()) {
+    n = send(sock, data.data() + sent, (int)(data.size() - sent), 0);
+    if (n <= 0) return;
+    sent += n;
+  }
+}
+
+/** Reads one request and answers it */
+static void serveClient(SOCKET sock)
+{
+  char request[METRICS_REQUEST_SIZE + 1];
+  char method[16] = "", path[256] = "";
+  const char *status = "200 OK";
+  const char *contentType = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+  std::string body, response;
+  struct timeval timeout;
+  size_t length = 0;
+  int n;
+
+  timeout.tv_sec = METRICS_RECV_TIMEOUT;
+  timeout.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+
+  // Only the request line is used, but read the whole header so the client is not reset
+  while (length < METRICS_REQUEST_SIZE) {
+    n = recv(sock, request + length, (int)(METRICS_REQUEST_SIZE - length), 0);
+    if (n <= 0) break;
+    length += n;
+    request[length] = '\0';
+    if (strstr(request, "\r\n\r\n")) break;
+  }
+  request[length] = '\0';
+  if (sscanf(request, "%15s %255s", method, path) != 2) return;
+
+  if (strcmp(method, "GET") != 0) {
+    status = "405 Method Not Allowed";
+  } else if (strcmp(path, "/metrics") != 0 && strcmp(path, "/") != 0) {
+    status = "404 Not Found";
+  }
+  if (strcmp(status, "200 OK") == 0) {
+    body = renderMetrics();
+  } else {
+    contentType = "text/plain; charset=utf-8";
+    body = std::string(status) + "\n";
+  }
+  response = "HTTP/1.1 " + std::string(status) + "\r\nContent-Type: " + contentType +
+    "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+  sendAll(sock, response);
+}
+
+static void metricsServerThread(void *)
+{
+  struct sockaddr_in client;
+  osiSocklen_t clientLength;
+  SOCKET sock;
+
+  while (1) {
+    clientLength = sizeof(client);
+    sock = epicsSocketAccept(serverSocket, (struct sockaddr *)&client, &clientLength);
+    if (sock == INVALID_SOCKET) {
+      epicsThreadSleep(1.);
+      continue;
+    }
+    serveClient(sock);
+    epicsSocketDestroy(sock);
+  }
+}
+
+/** Starts the metrics endpoint.
+  * Configuration command, called directly or from iocsh.  The metrics of every MD-90
+  * controller are published after each poll from then on.
+  * \param[in] address  Address to listen on, "host[:port]"; "" for 127.0.0.1:MD90_METRICS_PORT
+  */
+extern "C" int MD90MetricsServer(const char *address)
+{
+  struct sockaddr_in addr;
+  char name[64];
+  static const char *functionName = "MD90MetricsServer";
+
+  if (serverRunning) {
+    printf("%s: the metrics server is already running\n", functionName);
+    return asynError;
+  }
+  if (!address || !*address) address = "127.0.0.1";
+  if (aToIPAddr(address, MD90_METRICS_PORT, &addr)) {
+    printf("%s: bad address \"%s\"\n", functionName, address);
+    return asynError;
+  }
+
+  serverSocket = epicsSocketCreate(AF_INET, SOCK_STREAM, 0);
+  if (serverSocket == INVALID_SOCKET) {
+    printf("%s: cannot create a socket\n", functionName);
+    return asynError;
+  }
+  epicsSocketEnableAddressReuseDuringTimeWaitState(serverSocket);
+  if (bind(serverSocket, (struct sockaddr *)&addr, sizeof(addr)) || listen(serverSocket, 4)) {
+    ipAddrToDottedIP(&addr, name, sizeof(name));
+    printf("%s: cannot listen on %s\n", functionName, name);
+    epicsSocketDestroy(serverSocket);
+    serverSocket = INVALID_SOCKET;
+    return asynError;
+  }
+
+  serverRunning = true;
+  MD90Metrics::startPublishing();
+  epicsThreadCreate("MD90Metrics", epicsThreadPriorityLow,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)metricsServerThread, NULL);
+  ipAddrToDottedIP(&addr, name, sizeof(name));
+  printf("%s: serving http://%s/metrics\n", functionName, name);
+  return asynSuccess;
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90MetricsServerArg0 = {"Address (host[:port])", iocshArgString};
+static const iocshArg * const MD90MetricsServerArgs[] = {&MD90MetricsServerArg0};
+static const iocshFuncDef MD90MetricsServerDef = {"MD90MetricsServer", 1, MD90MetricsServerArgs};
+static void MD90MetricsServerCallFunc(const iocshArgBuf *args)
+{
+  MD90MetricsServer(args[0].sval);
+}
+
+static void MD90MetricsRegister(void)
+{
+  iocshRegister(&MD90MetricsServerDef, MD90MetricsServerCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90MetricsRegister);
+}
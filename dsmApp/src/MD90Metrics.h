@@ -0,0 +1,67 @@
+/*
+FILENAME...   MD90Metrics.h
+USAGE...      OpenMetrics export of DSM MD-90 driver counters and histograms.
+
+*/
+
+#ifndef MD90Metrics_H
+#define MD90Metrics_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+#define MD90_METRICS_NUM_BUCKETS  16      // Finite histogram buckets, see md90MetricsBuckets
+#define MD90_METRICS_PORT         9190    // Default TCP port of the metrics endpoint
+
+/** Histogram of durations with fixed bucket bounds (s) */
+struct MD90Histogram {
+  double counts[MD90_METRICS_NUM_BUCKETS + 1];  /**< Observations in each bucket, the last is +Inf */
+  double sum;
+  double count;
+  double max;                   /**< Largest observation */
+
+  MD90Histogram();
+  void observe(double value);
+};
+
+struct MD90AxisMetrics {
+  MD90Histogram pollDuration;   /**< Time taken by each poll of the axis */
+  MD90Histogram moveDuration;   /**< Time from a move command to the end of the move */
+  MD90Histogram homeDuration;   /**< Time from HOM to the end of the home routine */
+  MD90Histogram recoveryDuration; /**< Time from losing the connection to restoring the settings */
+  MD90Histogram compareLatency; /**< Time from a position compare crossing to its event */
+  double commLostSince;         /**< now() when the connection was lost, 0 while connected */
+  double moves;                 /**< Number of completed moves */
+  std::vector<double> errors;   /**< Number of errors, indexed by MD90ErrorClass */
+};
+
+struct MD90ControllerMetrics {
+  std::string portName;
+  std::map<std::string, MD90Histogram> commandRtt;  /**< Round trip time by command mnemonic */
+  double timeouts;              /**< Commands that got no reply */
+  std::vector<MD90AxisMetrics> axes;
+};
+
+/** Metrics of one controller.
+  * The driver updates current() with the controller locked and calls publish() after each
+  * poll.  The metrics server and the soak monitor read the last published copies with
+  * snapshots(), so they never take the controller lock or hold up the poller. */
+class MD90Metrics {
+public:
+  MD90Metrics(const char *portName, int numAxes);
+  MD90ControllerMetrics &current() { return current_; }
+  void command(const char *command, double rtt, bool timeout);
+  void publish();
+  std::shared_ptr<const MD90ControllerMetrics> snapshot() const;
+  static void startPublishing();
+  static std::vector<std::shared_ptr<const MD90ControllerMetrics> > snapshots();
+  static double now();
+
+private:
+  MD90ControllerMetrics current_;
+  std::shared_ptr<const MD90ControllerMetrics> snapshot_;
+};
+
+#endif /* MD90Metrics_H */
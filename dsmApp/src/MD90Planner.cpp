@@ -0,0 +1,273 @@
+/*
+FILENAME... MD90Planner.cpp
+USAGE...    Move time prediction and scan point ordering for DSM MD-90 axes.
+
+A closed loop move runs at the step frequency until the axis reaches the
+settle window, then settles.  The time of a point to point move is predicted
+from the distance, the step frequency times the calibrated counts per step,
+and a filtered settle time of recent moves.  Axes on different controllers
+move at the same time, so a multi-axis move takes as long as its slowest axis.
+
+The planner takes a list of points written to MD90_PLAN_POINTS, one position
+per plan axis for each point, and orders them for the shortest predicted time
+starting from the current positions.  It builds a nearest neighbour tour and
+improves it with 2-opt exchanges.  The order is usually close to the best
+but is not guaranteed optimal.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <iocsh.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+
+static const char *driverName = "MD90Planner";
+
+/** Predicted time of a move (s).
+  * \param[in] from  Start position (counts)
+  * \param[in] to    Target position (counts)
+  */
+double MD90MoveModel::predict(double from, double to) const
+{
+  if (from == to) return 0.;
+  return fabs(to - from) / velocity + ((settle > 0.) ? settle : 0.);
+}
+
+/** Returns the move model of this axis, which predicts the same travel time as
+  * predictMoveTime() for an unramped move.  Called with the controller locked. */
+MD90MoveModel MD90Axis::moveModel()
+{
+  MD90MoveModel model;
+
+  model.position = lastPosition_;
+  model.velocity = stepFreq_ * countsPerStep_;
+  model.settle = settleMean_;
+  return model;
+}
+
+/** Returns the move model of an axis, locking the controller.
+  * \param[in] axisNo  Axis number
+  * \param[out] model  Move model
+  */
+asynStatus MD90Controller::getMoveModel(int axisNo, MD90MoveModel *model)
+{
+  MD90Axis *pAxis;
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis) {
+    unlock();
+    return asynError;
+  }
+  *model = pAxis->moveModel();
+  unlock();
+  return asynSuccess;
+}
+
+/** Sets the axes whose positions make up each plan point.
+  * \param[in] axes  "port" or "port:axis" for each position of a point, separated by commas
+  *                  or spaces, in column order.  Empty to plan this controller's axis alone.
+  */
+asynStatus MD90Controller::setPlanAxes(const char *axes)
+{
+  std::vector<MD90PlanAxis> planAxes;
+  MD90PlanAxis planAxis;
+  char *spec, *name, *save;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "setPlanAxes";
+
+  spec = epicsStrDup(axes ? axes : "");
+  for (name = epicsStrtok_r(spec, ", \t", &save); name; name = epicsStrtok_r(NULL, ", \t", &save)) {
+    planAxis.pC = findAxis(functionName, name, &planAxis.axisNo);
+    if (!planAxis.pC) {
+      status = asynError;
+      break;
+    }
+    planAxes.push_back(planAxis);
+  }
+  free(spec);
+  if (status) return status;
+
+  lock();
+  planAxes_ = planAxes;
+  unlock();
+  return asynSuccess;
+}
+
+/** Predicted time to move between two points, the time of the slowest axis.
+  * A NULL point stands for the current positions. */
+static double planCost(const std::vector<MD90MoveModel> &models, const double *from, const double *to)
+{
+  double cost = 0., t;
+  size_t a;
+
+  for (a=0; a<models.size(); a++) {
+    t = models[a].predict(from ? from[a] : models[a].position, to[a]);
+    if (t > cost) cost = t;
+  }
+  return cost;
+}
+
+/** Orders the points written to MD90_PLAN_POINTS for the shortest predicted time and
+  * publishes the order and the predicted totals.  Called with the controller locked;
+  * the lock is released while the other plan axes are read and the order is computed.
+  * \param[in] axisNo  Axis whose records receive the results
+  */
+asynStatus MD90Controller::planPoints(int axisNo)
+{
+  std::vector<MD90PlanAxis> axes = planAxes_;
+  std::vector<double> points = planPoints_;
+  std::vector<MD90MoveModel> models;
+  std::vector<int> tour;
+  std::vector<double> order;
+  std::vector<bool> visited;
+  size_t numAxes, n, a, i, j, k, best;
+  double natural, total, cost, bestCost, delta;
+  const double *p, *prev, *next;
+  int pass;
+  bool improved;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "planPoints";
+
+  if (axes.empty()) {
+    MD90PlanAxis self = {this, axisNo};
+    axes.push_back(self);
+  }
+  numAxes = axes.size();
+  n = points.size() / numAxes;
+  if (n == 0 || n > PLAN_MAX_POINTS || points.size() % numAxes) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: %d values do not make 1 to %d points of %d axes\n",
+      driverName, functionName, (int)points.size(), PLAN_MAX_POINTS, (int)numAxes);
+    return asynError;
+  }
+
+  // Other controllers are locked in turn to read their models, so release this one
+  unlock();
+  models.resize(numAxes);
+  for (a=0; a<numAxes && !status; a++) {
+    status = axes[a].pC->getMoveModel(axes[a].axisNo, &models[a]);
+    if (!status && models[a].velocity <= 0.) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: plan axis %d has no step frequency\n", driverName, functionName, (int)a);
+      status = asynError;
+    }
+  }
+  if (status) {
+    lock();
+    return status;
+  }
+
+  natural = 0.;
+  for (i=0; i<n; i++) {
+    natural += planCost(models, i ? &points[(i-1)*numAxes] : NULL, &points[i*numAxes]);
+  }
+
+  // Nearest neighbour tour from the current positions
+  visited.assign(n, false);
+  prev = NULL;
+  for (i=0; i<n; i++) {
+    best = n;
+    bestCost = 0.;
+    for (j=0; j<n; j++) {
+      if (visited[j]) continue;
+      cost = planCost(models, prev, &points[j*numAxes]);
+      if (best == n || cost < bestCost) {
+        best = j;
+        bestCost = cost;
+      }
+    }
+    visited[best] = true;
+    tour.push_back((int)best);
+    prev = &points[best*numAxes];
+  }
+
+  // 2-opt: reverse tour[i..j] when that shortens the path.  The start is fixed at the
+  // current positions and the path is open at the end.
+  for (pass=0, improved=true; pass<PLAN_MAX_PASSES && improved; pass++) {
+    improved = false;
+    for (i=0; i<n; i++) {
+      prev = i ? &points[tour[i-1]*numAxes] : NULL;
+      for (j=i+1; j<n; j++) {
+        p = &points[tour[i]*numAxes];
+        next = &points[tour[j]*numAxes];
+        delta = planCost(models, prev, next) - planCost(models, prev, p);
+        if (j+1 < n) {
+          delta += planCost(models, p, &points[tour[j+1]*numAxes]) -
+                   planCost(models, next, &points[tour[j+1]*numAxes]);
+        }
+        if (delta < -1e-9) {
+          for (k=0; k<(j-i+1)/2; k++) {
+            std::swap(tour[i+k], tour[j-k]);
+          }
+          improved = true;
+        }
+      }
+    }
+  }
+
+  total = 0.;
+  order.resize(n);
+  for (i=0; i<n; i++) {
+    total += planCost(models, i ? &points[tour[i-1]*numAxes] : NULL, &points[tour[i]*numAxes]);
+    order[i] = tour[i];
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s: %d points, predicted %.3f s in the order given, %.3f s planned, %d passes\n",
+    driverName, functionName, (int)n, natural, total, pass);
+
+  lock();
+  setDoubleParam(axisNo, MD90PlanTotal_, total);
+  setDoubleParam(axisNo, MD90PlanNaturalTotal_, natural);
+  doCallbacksFloat64Array(&order[0], n, MD90PlanOrder_, axisNo);
+  callParamCallbacks(axisNo);
+  return asynSuccess;
+}
+
+/** Sets the axes whose positions make up each point written to MD90_PLAN_POINTS.
+  * Configuration command, called directly or from iocsh
+  * \param[in] portName  The name of the MD90Controller asyn port that runs the plan
+  * \param[in] axes      "port" or "port:axis" for each position of a point, separated
+  *                      by commas or spaces, in column order
+  */
+extern "C" int MD90PlanAxes(const char *portName, const char *axes)
+{
+  MD90Controller *pC;
+  static const char *functionName = "MD90PlanAxes";
+
+  pC = (MD90Controller*) findAsynPortDriver(portName);
+  if (!pC) {
+    printf("%s: %s: port not found\n", functionName, portName);
+    return asynError;
+  }
+  return pC->setPlanAxes(axes);
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90PlanAxesArg0 = {"Port name", iocshArgString};
+static const iocshArg MD90PlanAxesArg1 = {"Axes (port[:axis], in column order)", iocshArgString};
+static const iocshArg * const MD90PlanAxesArgs[] = {&MD90PlanAxesArg0,
+                                                     &MD90PlanAxesArg1};
+static const iocshFuncDef MD90PlanAxesDef = {"MD90PlanAxes", 2, MD90PlanAxesArgs};
+static void MD90PlanAxesCallFunc(const iocshArgBuf *args)
+{
+  MD90PlanAxes(args[0].sval, args[1].sval);
+}
+
+static void MD90PlanRegister(void)
+{
+  iocshRegister(&MD90PlanAxesDef, MD90PlanAxesCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90PlanRegister);
+}
@@ -0,0 +1,99 @@
+/*
+FILENAME...   MD90Protocol.cpp
+USAGE...      Command set and reply parsing of the DSM MD-90 controller.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "MD90Protocol.h"
+
+/** Parses a controller reply.
+  * Replies have the form "0: Current position in encoder counts: 1000"; commands that
+  * return no value reply "0: <description>".  Returns false if the text is not a reply.
+  * \param[in] text    The reply, without the terminator
+  * \param[out] reply  The parsed reply */
+bool md90ParseReply(const char *text, MD90Reply *reply)
+{
+  const char *p, *colon, *last;
+  char *end;
+  long code;
+
+  *reply = MD90Reply();
+  reply->text = text;
+  if (strcmp(text, "Unrecognized command.") == 0) {
+    reply->code = MD90_REPLY_UNRECOGNIZED;
+    reply->description = text;
+    return true;
+  }
+
+  code = strtol(text, &end, 10);
+  if (end == text || *end != ':') return false;
+  reply->code = (int)code;
+
+  p = end + 1;
+  while (*p == ' ') p++;
+  last = strrchr(p, ':');
+  if (last) {
+    reply->value = strtod(last + 1, &end);
+    reply->hasValue = (end != last + 1);
+  }
+  colon = reply->hasValue ? last : p + strlen(p);
+  reply->description.assign(p, colon - p);
+  return true;
+}
+
+/** Returns a command without an argument, e.g. "STA" */
+std::string md90Command(const char *mnemonic)
+{
+  return std::string(mnemonic);
+}
+
+/** Returns a command with an integer argument, e.g. "CLM 12340" */
+std::string md90Command(const char *mnemonic, long argument)
+{
+  char buffer[64];
+
+  snprintf(buffer, sizeof(buffer), "%s %ld", mnemonic, argument);
+  return std::string(buffer);
+}
+
+/** Returns true for the STA values that report an error */
+bool md90IsErrorStatus(int status)
+{
+  switch (status) {
+    case MD90_STA_HOMING_ERROR:
+    case MD90_STA_STANCE_ERROR:
+    case MD90_STA_OPEN_LOOP_ERROR:
+    case MD90_STA_CLOSED_LOOP_ERROR:
+    case MD90_STA_END_OF_TRAVEL:
+    case MD90_STA_RAMP_ERROR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/** Returns a short description of an STA value */
+const char *md90StatusName(int status)
+{
+  static const char *names[MD90_STA_NUM] = {
+    "Idle",
+    "Open loop move complete",
+    "Move in progress",
+    "Move stopped",
+    "Homing error",
+    "Stance error",
+    "Stance complete",
+    "Open loop move error",
+    "Closed loop move error",
+    "Closed loop move complete",
+    "End of travel error",
+    "Ramp move error"
+  };
+
+  if (status < 0 || status >= MD90_STA_NUM) return "Unknown status";
+  return names[status];
+}
@@ -0,0 +1,64 @@
+/*
+FILENAME...   MD90Protocol.h
+USAGE...      Command set and reply parsing of the DSM MD-90 controller.
+
+This file and the MD90Client, MD90Transport and MD90Sim classes do not depend
+on EPICS, so that test stands and bench tools can talk to an MD-90 with the
+same protocol code as the motor driver.
+
+*/
+
+#ifndef MD90Protocol_H
+#define MD90Protocol_H
+
+#include <string>
+
+#define MD90_EOS            "\r"    // Input and output terminator
+#define MD90_NM_PER_COUNT   10      // CLM/CRM take nm, encoder positions are in 10 nm counts
+#define MD90_BAUD           115200  // Serial line speed, 8 data bits, no parity, 1 stop bit
+#define MD90_COUNTS_PER_STEP 1000.0  // Nominal encoder counts per motor step (measured by testing)
+
+// Reply codes, the number before the first ':' of every reply
+enum MD90ReplyCode {
+  MD90_REPLY_NONE = -1,         // No reply, or a reply that could not be parsed
+  MD90_REPLY_OK = 0,
+  MD90_REPLY_BUSY = 3,          // Cannot execute while moving
+  MD90_REPLY_UNRECOGNIZED = 6   // "Unrecognized command." (this reply carries no code)
+};
+
+// Values returned by STA
+enum MD90Status {
+  MD90_STA_IDLE,
+  MD90_STA_OPEN_LOOP_DONE,
+  MD90_STA_MOVING,
+  MD90_STA_STOPPED,
+  MD90_STA_HOMING_ERROR,
+  MD90_STA_STANCE_ERROR,
+  MD90_STA_STANCE_DONE,
+  MD90_STA_OPEN_LOOP_ERROR,
+  MD90_STA_CLOSED_LOOP_ERROR,
+  MD90_STA_CLOSED_LOOP_DONE,
+  MD90_STA_END_OF_TRAVEL,
+  MD90_STA_RAMP_ERROR,
+  MD90_STA_NUM
+};
+
+/** A parsed controller reply, of the form "<code>: <description>[: <value>]" */
+struct MD90Reply {
+  int code;                     /**< Reply code, see MD90ReplyCode */
+  std::string description;      /**< Text between the code and the value */
+  double value;                 /**< Value after the last ':', if hasValue */
+  bool hasValue;
+  std::string text;             /**< The reply as received, without the terminator */
+
+  MD90Reply() : code(MD90_REPLY_NONE), value(0.), hasValue(false) {}
+  bool ok() const { return code == MD90_REPLY_OK; }
+};
+
+bool md90ParseReply(const char *text, MD90Reply *reply);
+std::string md90Command(const char *mnemonic);
+std::string md90Command(const char *mnemonic, long argument);
+bool md90IsErrorStatus(int status);
+const char *md90StatusName(int status);
+
+#endif /* MD90Protocol_H */
@@ -0,0 +1,537 @@
+/*
+FILENAME...   MD90Recorder.cpp
+USAGE...      Motion data recorder for DSM MD-90 axes.
+
+Every axis poll posts a sample (position, STA status, moving and homed flags),
+and moves, homes and errors post events.  The samples go to rotating files
+<path>.0.md90rec (newest) to <path>.<maxFiles-1>.md90rec (oldest).  Each file
+starts with the 8 byte magic "MD90REC1" and holds blocks of:
+
+    "MD9B", rows (u32), first time, last time (i64, us since the EPICS epoch),
+    number of controller names (u16), each name as length (u8) and characters,
+    payload length (u32), then MD90_RECORDER_NUM_COLUMNS columns in the order
+    of MD90RecordSample, each as the zigzag varint encoded differences between
+    successive rows.
+
+All integers are little-endian.  MD90RecorderDump decodes the blocks that
+overlap a time window into CSV.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+
+#include <iocsh.h>
+#include <epicsTime.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+#include "MD90Recorder.h"
+
+static const char fileMagic[] = "MD90REC1";
+static const char blockMagic[] = "MD9B";
+
+static const char *eventNames[] = {"sample", "move_start", "move_end", "home_start", "error"};
+
+static std::vector<std::string> controllerNames;
+static std::mutex controllerNamesLock;
+
+std::atomic<MD90Recorder *> MD90Recorder::instance_(NULL);
+
+static double steadyNow()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void putInt(std::string *out, uint64_t value, int bytes)
+{
+  int i;
+
+  for (i=0; i<bytes; i++) {
+    out->push_back((char)(value & 0xff));
+    value >>= 8;
+  }
+}
+
+static uint64_t getInt(const unsigned char *in, int bytes)
+{
+  uint64_t value = 0;
+  int i;
+
+  for (i=bytes-1; i>=0; i--) value = (value << 8) | in[i];
+  return value;
+}
+
+static void putVarint(std::string *out, int64_t value)
+{
+  uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+
+  while (zigzag >= 0x80) {
+    out->push_back((char)(zigzag | 0x80));
+    zigzag >>= 7;
+  }
+  out->push_back((char)zigzag);
+}
+
+/** Decodes one varint; returns false at the end of the buffer */
+static bool getVarint(const unsigned char **in, const unsigned char *end, int64_t *value)
+{
+  uint64_t zigzag = 0;
+  int shift = 0;
+
+  while (*in < end && shift < 64) {
+    zigzag |= (uint64_t)(**in & 0x7f) << shift;
+    if (!(*(*in)++ & 0x80)) {
+      *value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+      return true;
+    }
+    shift += 7;
+  }
+  return false;
+}
+
+/** Returns one field of a sample by its column number, in the order of MD90RecordSample */
+static int64_t *sampleColumn(MD90RecordSample &sample, int column)
+{
+  switch (column) {
+    case 0:  return &sample.time;
+    case 1:  return &sample.controller;
+    case 2:  return &sample.axis;
+    case 3:  return &sample.event;
+    case 4:  return &sample.position;
+    case 5:  return &sample.status;
+    case 6:  return &sample.flags;
+    default: return &sample.value;
+  }
+}
+
+static int64_t microseconds(const epicsTimeStamp &stamp)
+{
+  return (int64_t)stamp.secPastEpoch * 1000000 + stamp.nsec / 1000;
+}
+
+/** Creates a recorder; start() makes it the one the driver posts to.
+  * \param[in] path       Path and base name of the files
+  * \param[in] maxFileMB  Size at which the current file is rotated (MB)
+  * \param[in] maxFiles   Number of files kept, including the current one */
+MD90Recorder::MD90Recorder(const char *path, double maxFileMB, int maxFiles)
+  : queue_(MD90_RECORDER_QUEUE_SIZE), head_(0), tail_(0), drops_(0), path_(path),
+    maxFileBytes_((long)(maxFileMB * 1048576.)), maxFiles_(maxFiles < 1 ? 1 : maxFiles),
+    blockStart_(0.), file_(NULL), written_(0), flushRequest_(0), flushDone_(0), running_(false)
+{
+  size_t i;
+
+  for (i=0; i<queue_.size(); i++) queue_[i].sequence.store(i, std::memory_order_relaxed);
+  block_.reserve(MD90_RECORDER_BLOCK_ROWS);
+}
+
+MD90Recorder::~MD90Recorder()
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    running_ = false;
+  }
+  wakeup_.notify_all();
+  if (writer_.joinable()) writer_.join();
+  if (file_) fclose(file_);
+}
+
+/** Opens the current file, starts the writer thread and starts recording */
+void MD90Recorder::start(MD90Recorder *recorder)
+{
+  recorder->file_ = fopen(recorder->fileName(0).c_str(), "ab");
+  if (recorder->file_ && ftell(recorder->file_) == 0) {
+    fwrite(fileMagic, 1, 8, recorder->file_);
+  }
+  recorder->running_ = true;
+  recorder->writer_ = std::thread(&MD90Recorder::run, recorder);
+  instance_ = recorder;
+}
+
+/** Returns the index under which a controller's samples are recorded.
+  * Called once by each controller; the name is kept in every block. */
+int MD90Recorder::controllerId(const char *portName)
+{
+  std::lock_guard<std::mutex> guard(controllerNamesLock);
+
+  controllerNames.push_back(portName);
+  return (int)controllerNames.size() - 1;
+}
+
+/** Posts a sample from a poller.  Never blocks; does nothing if no recorder is running. */
+void MD90Recorder::post(int controller, int axis, int event, double position, int status, int flags, double value)
+{
+  MD90Recorder *recorder = instance_;
+  MD90RecordSample sample;
+  epicsTimeStamp now;
+
+  if (!recorder) return;
+  epicsTimeGetCurrent(&now);
+  sample.time = microseconds(now);
+  sample.controller = controller;
+  sample.axis = axis;
+  sample.event = event;
+  sample.position = (int64_t)floor(position + 0.5);
+  sample.status = status;
+  sample.flags = flags;
+  sample.value = (int64_t)floor(value + 0.5);
+  if (!recorder->push(sample)) recorder->drops_++;
+}
+
+/** Adds a sample to the queue, or returns false if the queue is full */
+bool MD90Recorder::push(const MD90RecordSample &sample)
+{
+  size_t mask = queue_.size() - 1;
+  size_t pos = head_.load(std::memory_order_relaxed);
+  size_t sequence;
+  long difference;
+
+  while (1) {
+    Cell &cell = queue_[pos & mask];
+    sequence = cell.sequence.load(std::memory_order_acquire);
+    difference = (long)sequence - (long)pos;
+    if (difference == 0) {
+      // The cell is free; claim it
+      if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        cell.sample = sample;
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (difference < 0) {
+      return false;
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/** Takes the oldest sample from the queue; called from the writer thread only */
+bool MD90Recorder::pop(MD90RecordSample *sample)
+{
+  size_t mask = queue_.size() - 1;
+  size_t pos = tail_.load(std::memory_order_relaxed);
+  Cell &cell = queue_[pos & mask];
+
+  if ((long)cell.sequence.load(std::memory_order_acquire) - (long)(pos + 1) < 0) return false;
+  *sample = cell.sample;
+  cell.sequence.store(pos + mask + 1, std::memory_order_release);
+  tail_.store(pos + 1, std::memory_order_relaxed);
+  return true;
+}
+
+std::string MD90Recorder::fileName(int index) const
+{
+  char suffix[32];
+
+  snprintf(suffix, sizeof(suffix), ".%d.md90rec", index);
+  return path_ + suffix;
+}
+
+/** Writer thread: empties the queue into blocks and writes full or old blocks */
+void MD90Recorder::run()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  MD90RecordSample sample;
+  unsigned long request;
+  bool stopping = false;
+
+  while (!stopping) {
+    wakeup_.wait_for(lock, std::chrono::duration<double>(MD90_RECORDER_DRAIN_TIME));
+    stopping = !running_;
+    request = flushRequest_;
+    while (pop(&sample)) {
+      if (block_.empty()) blockStart_ = steadyNow();
+      block_.push_back(sample);
+      if (block_.size() >= MD90_RECORDER_BLOCK_ROWS) writeBlock();
+    }
+    if (!block_.empty() &&
+        (stopping || request != flushDone_ || steadyNow() - blockStart_ >= MD90_RECORDER_FLUSH_TIME)) {
+      writeBlock();
+    }
+    flushDone_ = request;
+    flushed_.notify_all();
+  }
+}
+
+/** Encodes block_ and appends it to the current file; called with mutex_ held */
+void MD90Recorder::writeBlock()
+{
+  std::vector<std::string> names;
+  std::string header, payload;
+  int64_t first, last, previous;
+  size_t i;
+  int column;
+
+  if (block_.empty()) return;
+  {
+    std::lock_guard<std::mutex> guard(controllerNamesLock);
+    names = controllerNames;
+  }
+
+  first = last = block_[0].time;
+  for (i=0; i<block_.size(); i++) {
+    if (block_[i].time < first) first = block_[i].time;
+    if (block_[i].time > last) last = block_[i].time;
+  }
+  for (column=0; column<MD90_RECORDER_NUM_COLUMNS; column++) {
+    previous = 0;
+    for (i=0; i<block_.size(); i++) {
+      putVarint(&payload, *sampleColumn(block_[i], column) - previous);
+      previous = *sampleColumn(block_[i], column);
+    }
+  }
+
+  header.append(blockMagic, 4);
+  putInt(&header, block_.size(), 4);
+  putInt(&header, first, 8);
+  putInt(&header, last, 8);
+  putInt(&header, names.size(), 2);
+  for (i=0; i<names.size(); i++) {
+    header.push_back((char)(names[i].size() > 255 ? 255 : names[i].size()));
+    header.append(names[i], 0, 255);
+  }
+  putInt(&header, payload.size(), 4);
+
+  if (file_) {
+    fwrite(header.data(), 1, header.size(), file_);
+    fwrite(payload.data(), 1, payload.size(), file_);
+    fflush(file_);
+    written_ += block_.size();
+    if (ftell(file_) >= maxFileBytes_) rotate();
+  }
+  block_.clear();
+}
+
+/** Shifts the files up by one, dropping the oldest, and starts a new current file */
+void MD90Recorder::rotate()
+{
+  int i;
+
+  fclose(file_);
+  remove(fileName(maxFiles_ - 1).c_str());
+  for (i=maxFiles_-2; i>=0; i--) {
+    rename(fileName(i).c_str(), fileName(i + 1).c_str());
+  }
+  file_ = fopen(fileName(0).c_str(), "wb");
+  if (file_) {
+    fwrite(fileMagic, 1, 8, file_);
+    fflush(file_);
+  }
+}
+
+/** Writes the samples of one file that fall between since and until as CSV, and closes it.
+  * Returns the number of samples written. */
+int MD90Recorder::dumpFile(FILE *in, int64_t since, int64_t until, FILE *out)
+{
+  std::vector<std::string> names;
+  std::vector<MD90RecordSample> rows;
+  std::vector<unsigned char> buffer;
+  unsigned char fixed[26];
+  const unsigned char *p, *end;
+  char magic[8], timeText[64];
+  epicsTimeStamp stamp;
+  uint64_t numRows, numNames, payloadSize, first, last;
+  int64_t delta, value;
+  size_t i, n;
+  int c, column, count = 0;
+
+  if (fread(magic, 1, 8, in) != 8 || memcmp(magic, fileMagic, 8) != 0) {
+    fclose(in);
+    return 0;
+  }
+
+  while (fread(fixed, 1, 26, in) == 26 && memcmp(fixed, blockMagic, 4) == 0) {
+    numRows = getInt(fixed + 4, 4);
+    first = getInt(fixed + 8, 8);
+    last = getInt(fixed + 16, 8);
+    numNames = getInt(fixed + 24, 2);
+    names.clear();
+    for (i=0; i<numNames; i++) {
+      if ((c = fgetc(in)) == EOF) break;
+      n = (size_t)c;
+      names.push_back(std::string(n, '\0'));
+      if (n && fread(&names.back()[0], 1, n, in) != n) break;
+    }
+    // A block cut short, e.g. by a crash while it was written, ends the file
+    if (i < numNames) break;
+    if (fread(fixed, 1, 4, in) != 4) break;
+    payloadSize = getInt(fixed, 4);
+
+    // Skip blocks outside the window without decoding them
+    if ((int64_t)last < since || (int64_t)first > until) {
+      if (fseek(in, (long)payloadSize, SEEK_CUR)) break;
+      continue;
+    }
+    buffer.resize(payloadSize);
+    if (payloadSize && fread(&buffer[0], 1, payloadSize, in) != payloadSize) break;
+    p = buffer.empty() ? NULL : &buffer[0];
+    end = p + payloadSize;
+    rows.assign(numRows, MD90RecordSample());
+    for (column=0; column<MD90_RECORDER_NUM_COLUMNS; column++) {
+      value = 0;
+      for (i=0; i<numRows; i++) {
+        if (!getVarint(&p, end, &delta)) break;
+        value += delta;
+        *sampleColumn(rows[i], column) = value;
+      }
+    }
+
+    for (i=0; i<numRows; i++) {
+      if (rows[i].time < since || rows[i].time > until) continue;
+      stamp.secPastEpoch = (epicsUInt32)(rows[i].time / 1000000);
+      stamp.nsec = (epicsUInt32)(rows[i].time % 1000000) * 1000;
+      epicsTimeToStrftime(timeText, sizeof(timeText), "%Y-%m-%dT%H:%M:%S.%06f", &stamp);
+      fprintf(out, "%s,%s,%d,%s,%lld,%d,%d,%lld\n", timeText,
+        (rows[i].controller >= 0 && rows[i].controller < (int64_t)names.size()) ?
+          names[rows[i].controller].c_str() : "?",
+        (int)rows[i].axis,
+        (rows[i].event >= 0 && rows[i].event <= MD90_RECORD_ERROR) ? eventNames[rows[i].event] : "?",
+        (long long)rows[i].position, (int)rows[i].status, (int)rows[i].flags, (long long)rows[i].value);
+      count++;
+    }
+  }
+  fclose(in);
+  return count;
+}
+
+/** Writes the samples taken between since and until seconds ago to a CSV file.
+  * Samples still queued are written to the files first.  Returns the number of samples,
+  * or -1 if the output file cannot be opened.
+  * \param[in] since     Start of the window (s before now)
+  * \param[in] until     End of the window (s before now), 0 for now
+  * \param[in] fileName  Output file, NULL or "" for standard output */
+int MD90Recorder::dump(double since, double until, const char *fileName)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::vector<FILE *> in(maxFiles_);
+  epicsTimeStamp now;
+  unsigned long request;
+  int64_t start, end;
+  int i, count = 0;
+  FILE *out = stdout;
+
+  request = ++flushRequest_;
+  wakeup_.notify_all();
+  flushed_.wait_for(lock, std::chrono::seconds(5), [this, request] { return flushDone_ >= request; });
+
+  // Open the files before the writer can rotate them, then decode them without the lock
+  for (i=0; i<maxFiles_; i++) {
+    in[i] = fopen(this->fileName(i).c_str(), "rb");
+  }
+  lock.unlock();
+
+  if (fileName && *fileName) {
+    out = fopen(fileName, "w");
+    if (!out) {
+      for (i=0; i<maxFiles_; i++) {
+        if (in[i]) fclose(in[i]);
+      }
+      return -1;
+    }
+  }
+  epicsTimeGetCurrent(&now);
+  start = microseconds(now) - (int64_t)(since * 1e6);
+  end = microseconds(now) - (int64_t)(until * 1e6);
+  fprintf(out, "time,controller,axis,event,position,status,flags,value\n");
+  for (i=maxFiles_-1; i>=0; i--) {
+    if (in[i]) count += dumpFile(in[i], start, end, out);
+  }
+  if (out != stdout) fclose(out);
+  return count;
+}
+
+void MD90Recorder::report(FILE *fp)
+{
+  fprintf(fp, "MD90 recorder: %s.*.md90rec, %.1f MB x %d files\n",
+    path_.c_str(), maxFileBytes_ / 1048576., maxFiles_);
+  fprintf(fp, "  queued %lu, written %lu, dropped %lu\n",
+    (unsigned long)(head_.load() - tail_.load()), written_, drops_.load());
+}
+
+/** Starts recording every axis poll to rotating files.
+  * Configuration command, called directly or from iocsh.
+  * \param[in] path       Path and base name of the files
+  * \param[in] maxFileMB  Size at which a file is rotated (MB), 0 for 16
+  * \param[in] maxFiles   Number of files kept, 0 for 8
+  */
+extern "C" int MD90RecorderStart(const char *path, double maxFileMB, int maxFiles)
+{
+  static const char *functionName = "MD90RecorderStart";
+
+  if (MD90Recorder::instance()) {
+    printf("%s: the recorder is already running\n", functionName);
+    return asynError;
+  }
+  if (!path || !*path) {
+    printf("%s: no file path given\n", functionName);
+    return asynError;
+  }
+  if (maxFileMB <= 0.) maxFileMB = 16.;
+  if (maxFiles <= 0) maxFiles = 8;
+  MD90Recorder::start(new MD90Recorder(path, maxFileMB, maxFiles));
+  return asynSuccess;
+}
+
+/** Writes the recorded samples of a time window as CSV.
+  * Configuration command, called directly or from iocsh.
+  * \param[in] since     Start of the window (s before now)
+  * \param[in] until     End of the window (s before now), 0 for now
+  * \param[in] fileName  Output file, "" for the console
+  */
+extern "C" int MD90RecorderDump(double since, double until, const char *fileName)
+{
+  MD90Recorder *recorder = MD90Recorder::instance();
+  int count;
+  static const char *functionName = "MD90RecorderDump";
+
+  if (!recorder) {
+    printf("%s: the recorder is not running\n", functionName);
+    return asynError;
+  }
+  count = recorder->dump(since, until, fileName);
+  if (count < 0) {
+    printf("%s: cannot open %s\n", functionName, fileName);
+    return asynError;
+  }
+  recorder->report(stdout);
+  printf("%s: %d samples\n", functionName, count);
+  return asynSuccess;
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90RecorderStartArg0 = {"File path and base name", iocshArgString};
+static const iocshArg MD90RecorderStartArg1 = {"Maximum file size (MB)", iocshArgDouble};
+static const iocshArg MD90RecorderStartArg2 = {"Number of files", iocshArgInt};
+static const iocshArg * const MD90RecorderStartArgs[] = {&MD90RecorderStartArg0,
+                                                         &MD90RecorderStartArg1,
+                                                         &MD90RecorderStartArg2};
+static const iocshFuncDef MD90RecorderStartDef = {"MD90RecorderStart", 3, MD90RecorderStartArgs};
+static void MD90RecorderStartCallFunc(const iocshArgBuf *args)
+{
+  MD90RecorderStart(args[0].sval, args[1].dval, args[2].ival);
+}
+
+static const iocshArg MD90RecorderDumpArg0 = {"Start (s before now)", iocshArgDouble};
+static const iocshArg MD90RecorderDumpArg1 = {"End (s before now)", iocshArgDouble};
+static const iocshArg MD90RecorderDumpArg2 = {"Output file", iocshArgString};
+static const iocshArg * const MD90RecorderDumpArgs[] = {&MD90RecorderDumpArg0,
+                                                        &MD90RecorderDumpArg1,
+                                                        &MD90RecorderDumpArg2};
+static const iocshFuncDef MD90RecorderDumpDef = {"MD90RecorderDump", 3, MD90RecorderDumpArgs};
+static void MD90RecorderDumpCallFunc(const iocshArgBuf *args)
+{
+  MD90RecorderDump(args[0].dval, args[1].dval, args[2].sval);
+}
+
+static void MD90RecorderRegister(void)
+{
+  iocshRegister(&MD90RecorderStartDef, MD90RecorderStartCallFunc);
+  iocshRegister(&MD90RecorderDumpDef, MD90RecorderDumpCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90RecorderRegister);
+}
@@ -0,0 +1,106 @@
+/*
+FILENAME...   MD90Recorder.h
+USAGE...      Motion data recorder for DSM MD-90 axes.
+
+*/
+
+#ifndef MD90Recorder_H
+#define MD90Recorder_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#define MD90_RECORDER_QUEUE_SIZE  16384   // Samples queued between the pollers and the writer (power of 2)
+#define MD90_RECORDER_BLOCK_ROWS  4096    // Samples in one file block
+#define MD90_RECORDER_FLUSH_TIME  10.0    // Longest time a sample waits before its block is written (s)
+#define MD90_RECORDER_DRAIN_TIME  0.5     // Period at which the writer empties the queue (s)
+#define MD90_RECORDER_NUM_COLUMNS 8
+
+// Kinds of recorded samples
+enum MD90RecordEvent {
+  MD90_RECORD_SAMPLE,           // Poll: position, STA status, flags
+  MD90_RECORD_MOVE_START,       // Move command; value is the target (counts)
+  MD90_RECORD_MOVE_END,         // End of a move; value is the final error (counts)
+  MD90_RECORD_HOME_START,       // HOM sent
+  MD90_RECORD_ERROR             // Controller error; value is the MD90ErrorClass
+};
+
+// Bits of MD90RecordSample::flags
+#define MD90_RECORD_MOVING    0x1
+#define MD90_RECORD_HOMED     0x2
+#define MD90_RECORD_COMM_LOST 0x4
+
+/** One recorded sample.  All fields are stored as integers. */
+struct MD90RecordSample {
+  int64_t time;                 /**< Microseconds since the EPICS epoch */
+  int64_t controller;           /**< Index from MD90Recorder::controllerId() */
+  int64_t axis;
+  int64_t event;                /**< MD90RecordEvent */
+  int64_t position;             /**< Encoder position (counts) */
+  int64_t status;               /**< STA status */
+  int64_t flags;                /**< MD90_RECORD_* bits */
+  int64_t value;                /**< Depends on the event */
+};
+
+/** Records samples from every axis poll to rotating files.
+  * The pollers post samples to a preallocated lock-free queue and never wait: when the
+  * queue is full the sample is dropped and counted.  A writer thread empties the queue
+  * and writes blocks of samples to the files column by column, each column delta and
+  * variable-length encoded, which shrinks slowly changing positions and timestamps to
+  * one or two bytes per sample. */
+class MD90Recorder {
+public:
+  MD90Recorder(const char *path, double maxFileMB, int maxFiles);
+  ~MD90Recorder();
+  static MD90Recorder *instance() { return instance_; }
+  static void start(MD90Recorder *recorder);
+  static int controllerId(const char *portName);
+  static void post(int controller, int axis, int event, double position, int status, int flags, double value);
+  int dump(double since, double until, const char *fileName);
+  void report(FILE *fp);
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    MD90RecordSample sample;
+  };
+  bool push(const MD90RecordSample &sample);
+  bool pop(MD90RecordSample *sample);
+  void run();
+  void writeBlock();
+  void rotate();
+  std::string fileName(int index) const;
+  int dumpFile(FILE *in, int64_t since, int64_t until, FILE *out);
+
+  static std::atomic<MD90Recorder *> instance_;
+
+  // Lock-free bounded queue of samples, many pollers to one writer
+  std::vector<Cell> queue_;
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+  std::atomic<unsigned long> drops_;
+
+  // Writer thread state
+  std::string path_;
+  long maxFileBytes_;
+  int maxFiles_;
+  std::vector<MD90RecordSample> block_;   /**< Samples of the block being filled */
+  double blockStart_;           /**< Time the first sample of block_ was taken from the queue */
+  FILE *file_;
+  unsigned long written_;       /**< Samples written to the files */
+  std::mutex mutex_;            /**< Protects the files and the flush request */
+  std::condition_variable wakeup_;
+  std::condition_variable flushed_;
+  unsigned long flushRequest_;
+  unsigned long flushDone_;
+  bool running_;
+  std::thread writer_;
+};
+
+#endif /* MD90Recorder_H */
@@ -0,0 +1,216 @@
+/*
+FILENAME...   MD90Sim.cpp
+USAGE...      Simulated DSM MD-90 controller, for tools and bench tests without hardware.
+
+The model follows the behaviour the driver relies on: closed loop moves at the
+step frequency, STA values 2/9 for closed loop moves and 2/1 for open loop
+bursts, a servo state after a closed loop move that refuses SSF until STP, and
+a home routine that leaves the stage referenced at position 0.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+
+#include "MD90Protocol.h"
+#include "MD90Sim.h"
+
+MD90SimController::MD90SimController()
+  : position_(0.), target_(0.), openLoopEnd_(0.), homeEnd_(0.), lastTime_(now()),
+    mode_(MODE_NONE), status_(MD90_STA_IDLE), stepFreq_(100), steps_(0), gain_(1000),
+    deadband_(10), homed_(false), powerOn_(false), persistent_(false), servoing_(false)
+{
+}
+
+double MD90SimController::now()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Moves the stage for the time since the last call */
+void MD90SimController::advance()
+{
+  double t = now();
+  double step = stepFreq_ * MD90_SIM_COUNTS_PER_STEP * (t - lastTime_);
+  double end;
+
+  lastTime_ = t;
+  switch (mode_) {
+    case MODE_CLOSED_LOOP:
+    case MODE_OPEN_LOOP:
+      end = (mode_ == MODE_CLOSED_LOOP) ? target_ : openLoopEnd_;
+      if (fabs(end - position_) <= step) {
+        position_ = end;
+        status_ = (mode_ == MODE_CLOSED_LOOP) ? MD90_STA_CLOSED_LOOP_DONE : MD90_STA_OPEN_LOOP_DONE;
+        mode_ = MODE_NONE;
+      } else {
+        position_ += (end > position_) ? step : -step;
+      }
+      break;
+    case MODE_HOMING:
+      if (t >= homeEnd_) {
+        position_ = 0.;
+        homed_ = true;
+        status_ = MD90_STA_IDLE;
+        mode_ = MODE_NONE;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/** Executes one command and returns the reply, without the terminator */
+std::string MD90SimController::execute(const std::string &command)
+{
+  char mnemonic[8] = "";
+  char reply[128];
+  long arg = 0;
+  int nargs;
+  bool moving;
+
+  advance();
+  nargs = sscanf(command.c_str(), "%7s %ld", mnemonic, &arg);
+  moving = (mode_ != MODE_NONE);
+
+#define OK(desc)         snprintf(reply, sizeof(reply), "0: %s", desc)
+#define VALUE(desc, v)   snprintf(reply, sizeof(reply), "0: %s: %ld", desc, (long)(v))
+
+  if (nargs < 1) {
+    return "Unrecognized command.";
+  } else if (!strcmp(mnemonic, "STA")) {
+    VALUE("Current status value", status_);
+  } else if (!strcmp(mnemonic, "GEC")) {
+    VALUE("Current position in encoder counts", lround(position_));
+  } else if (!strcmp(mnemonic, "GPS")) {
+    VALUE("Power supply enabled state", powerOn_);
+  } else if (!strcmp(mnemonic, "GHS")) {
+    VALUE("Home status", homed_);
+  } else if (!strcmp(mnemonic, "GSF")) {
+    VALUE("Current step frequency", stepFreq_);
+  } else if (!strcmp(mnemonic, "GGN")) {
+    VALUE("Gain", gain_);
+  } else if (!strcmp(mnemonic, "GPM")) {
+    VALUE("Current persistent move state", persistent_);
+  } else if (!strcmp(mnemonic, "EPS") || !strcmp(mnemonic, "DPS")) {
+    powerOn_ = (mnemonic[0] == 'E');
+    OK("Power supply state set");
+  } else if (!strcmp(mnemonic, "EPM") || !strcmp(mnemonic, "DPM")) {
+    persistent_ = (mnemonic[0] == 'E');
+    OK("Persistent move state set");
+  } else if (!strcmp(mnemonic, "SDB") && nargs == 2) {
+    deadband_ = arg;
+    OK("Deadband set");
+  } else if (!strcmp(mnemonic, "SGN") && nargs == 2 && arg >= 1 && arg <= 1000) {
+    gain_ = arg;
+    OK("Gain set");
+  } else if (!strcmp(mnemonic, "SSF") && nargs == 2) {
+    if (moving || servoing_) {
+      return "3: Cannot execute while moving";
+    }
+    stepFreq_ = arg;
+    OK("Step frequency set");
+  } else if (!strcmp(mnemonic, "SNS") && nargs == 2) {
+    steps_ = arg;
+    OK("Number of steps set");
+  } else if ((!strcmp(mnemonic, "ESF") || !strcmp(mnemonic, "ESB")) && nargs == 1) {
+    if (!powerOn_) return "1: Power supply disabled";
+    openLoopEnd_ = position_ + ((mnemonic[2] == 'F') ? 1. : -1.) * steps_ * MD90_SIM_COUNTS_PER_STEP;
+    mode_ = MODE_OPEN_LOOP;
+    servoing_ = false;
+    status_ = MD90_STA_MOVING;
+    OK("Open loop move started");
+  } else if ((!strcmp(mnemonic, "CLM") || !strcmp(mnemonic, "CRM")) && nargs == 2) {
+    if (!powerOn_) return "1: Power supply disabled";
+    target_ = arg / (double)MD90_NM_PER_COUNT + ((mnemonic[1] == 'R') ? position_ : 0.);
+    mode_ = MODE_CLOSED_LOOP;
+    servoing_ = true;
+    status_ = MD90_STA_MOVING;
+    OK("Closed loop move started");
+  } else if (!strcmp(mnemonic, "HOM")) {
+    if (!powerOn_) return "1: Power supply disabled";
+    homeEnd_ = now() + MD90_SIM_HOME_TIME;
+    mode_ = MODE_HOMING;
+    servoing_ = false;
+    status_ = MD90_STA_MOVING;
+    OK("Homing started");
+  } else if (!strcmp(mnemonic, "STP")) {
+    if (moving) status_ = MD90_STA_STOPPED;
+    mode_ = MODE_NONE;
+    servoing_ = false;
+    OK("Stopped");
+  } else {
+    return "Unrecognized command.";
+  }
+
+#undef OK
+#undef VALUE
+  return std::string(reply);
+}
+
+MD90SimTransport::MD90SimTransport(double latency)
+  : latency_(latency), lastDue_(0.), open_(false)
+{
+}
+
+static double simNow()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool MD90SimTransport::open()
+{
+  open_ = true;
+  replies_.clear();
+  return true;
+}
+
+void MD90SimTransport::close()
+{
+  open_ = false;
+  replies_.clear();
+}
+
+bool MD90SimTransport::write(const std::string &command)
+{
+  Pending pending;
+  double t = simNow();
+  double lineTime;
+
+  if (!open_) return false;
+  pending.reply = controller_.execute(command);
+  // A reply is ready one latency after its command, but replies share the serial line
+  lineTime = (pending.reply.size() + 1) * MD90_SIM_CHAR_TIME;
+  pending.due = ((t + latency_ > lastDue_) ? t + latency_ : lastDue_) + lineTime;
+  lastDue_ = pending.due;
+  replies_.push_back(pending);
+  return true;
+}
+
+bool MD90SimTransport::readReply(std::string *reply, double timeout)
+{
+  double wait;
+
+  if (!open_ || replies_.empty()) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+    return false;
+  }
+  wait = replies_.front().due - simNow();
+  if (wait > timeout) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+    return false;
+  }
+  if (wait > 0.) std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+  *reply = replies_.front().reply;
+  replies_.pop_front();
+  return true;
+}
+
+void MD90SimTransport::flush()
+{
+  replies_.clear();
+}
@@ -0,0 +1,74 @@
+/*
+FILENAME...   MD90Sim.h
+USAGE...      Simulated DSM MD-90 controller, for tools and bench tests without hardware.
+
+*/
+
+#ifndef MD90Sim_H
+#define MD90Sim_H
+
+#include <string>
+#include <deque>
+
+#include "MD90Transport.h"
+
+#define MD90_SIM_COUNTS_PER_STEP  1000.0  // Encoder counts per motor step
+#define MD90_SIM_HOME_TIME        2.0     // Duration of the home routine (s)
+#define MD90_SIM_LATENCY          0.002   // Default reply latency (s), about one serial round trip
+#define MD90_SIM_CHAR_TIME        (10.0 / MD90_BAUD)  // Time to send one character (s)
+
+/** Model of one controller and its stage.
+  * Motion advances with wall clock time whenever a command is executed. */
+class MD90SimController {
+public:
+  MD90SimController();
+  std::string execute(const std::string &command);
+
+private:
+  enum Mode { MODE_NONE, MODE_CLOSED_LOOP, MODE_OPEN_LOOP, MODE_HOMING };
+  void advance();
+  static double now();
+
+  double position_;             /**< Encoder position (counts) */
+  double target_;               /**< Closed loop target (counts) */
+  double openLoopEnd_;          /**< End position of an open loop burst (counts) */
+  double homeEnd_;              /**< Time at which the home routine completes */
+  double lastTime_;             /**< Time the motion was last advanced */
+  int mode_;
+  int status_;                  /**< Value returned by STA */
+  int stepFreq_;
+  int steps_;                   /**< Steps set with SNS */
+  int gain_;
+  int deadband_;                /**< Deadband (nm) */
+  bool homed_;
+  bool powerOn_;
+  bool persistent_;
+  bool servoing_;               /**< Holding a closed loop target until STP; SSF is refused */
+};
+
+/** A transport to an in-process MD90SimController.
+  * A reply is sent one latency after its command, or once the previous reply has been
+  * sent if that is later, and takes the time to send its characters at MD90_BAUD. */
+class MD90SimTransport : public MD90Transport {
+public:
+  explicit MD90SimTransport(double latency = MD90_SIM_LATENCY);
+  bool open();
+  void close();
+  bool write(const std::string &command);
+  bool readReply(std::string *reply, double timeout);
+  void flush();
+  std::string name() const { return "sim"; }
+
+private:
+  struct Pending {
+    std::string reply;
+    double due;                 /**< Time the reply is available */
+  };
+  MD90SimController controller_;
+  std::deque<Pending> replies_;
+  double latency_;
+  double lastDue_;
+  bool open_;
+};
+
+#endif /* MD90Sim_H */
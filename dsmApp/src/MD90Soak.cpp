@@ -0,0 +1,320 @@
+/*
+FILENAME... MD90Soak.cpp
+USAGE...    Long-running stability test of DSM MD-90 controllers.
+
+MD90Soak runs in the background of an IOC whose controllers talk to
+md90simserver, or to real hardware.  It moves the given axes back and forth
+and, once per report period, reads the published metrics and the process
+state: the mean poll duration, the resident memory, the number of threads,
+and the time taken to recover each lost connection.  At the end of the run it
+compares the last period with the first and reports PASS or FAIL, and can exit
+the IOC with the result so that a soak run can be scripted.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <random>
+
+#include <iocsh.h>
+#include <epicsThread.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+#include <epicsExit.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+
+/** One axis moved by the soak test */
+struct MD90SoakAxis {
+  std::string name;             /**< Port name and axis as given on the command line */
+  MD90Controller *pC;
+  int axisNo;
+  double commanded;             /**< Number of moves started */
+  double movedAt;               /**< MD90Metrics::now() when the outstanding move was started */
+};
+
+/** Settings of a soak run */
+struct MD90SoakConfig {
+  std::vector<MD90SoakAxis> axes;
+  double duration;              /**< Length of the run (s) */
+  double period;                /**< Time between reports (s) */
+  double amplitude;             /**< Moves go to random positions within +/- amplitude (counts) */
+  double maxDrift;              /**< Largest allowed ratio of the last to the first mean poll duration */
+  double maxGrowth;             /**< Largest allowed growth of the resident memory (MB) */
+  double maxRecover;            /**< Longest allowed time to recover a lost connection (s) */
+  int exitWhenDone;
+};
+
+/** Totals over all controllers at one report */
+struct MD90SoakSample {
+  double pollSum;
+  double pollCount;
+  double recoveries;
+  double maxRecovery;           /**< Longest completed recovery (s) */
+  double lostFor;               /**< Longest ongoing loss of connection (s) */
+  double rssMB;                 /**< Resident memory (MB), -1 if unknown */
+  int threads;                  /**< Threads of the process, -1 if unknown */
+};
+
+/** Moves an axis to an absolute position as the motor record would.
+  * \param[in] axisNo    Axis number
+  * \param[in] position  Target (counts)
+  * \param[in] velocity  Velocity (counts / sec)
+  */
+asynStatus MD90Controller::moveAxis(int axisNo, double position, double velocity)
+{
+  MD90Axis *pAxis;
+  asynStatus status;
+
+  lock();
+  pAxis = getAxis(axisNo);
+  if (!pAxis) {
+    unlock();
+    return asynError;
+  }
+  status = pAxis->move(position, 0, 0., velocity, 0.);
+  if (!status) {
+    setIntegerParam(axisNo, motorStatusDone_, 0);
+    callParamCallbacks(axisNo);
+    wakeupPoller();
+  }
+  unlock();
+  return status;
+}
+
+/** Reads the resident memory and thread count of the IOC process (Linux only) */
+static void readProcessState(MD90SoakSample *sample)
+{
+  char line[256];
+  long value;
+  FILE *fp;
+
+  sample->rssMB = -1.;
+  sample->threads = -1;
+  fp = fopen("/proc/self/status", "r");
+  if (!fp) return;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "VmRSS: %ld", &value) == 1) sample->rssMB = value / 1024.;
+    if (sscanf(line, "Threads: %ld", &value) == 1) sample->threads = (int)value;
+  }
+  fclose(fp);
+}
+
+static void takeSample(MD90SoakSample *sample)
+{
+  std::vector<std::shared_ptr<const MD90ControllerMetrics> > snapshots = MD90Metrics::snapshots();
+  double now = MD90Metrics::now();
+  size_t c, axis;
+
+  memset(sample, 0, sizeof(*sample));
+  for (c=0; c<snapshots.size(); c++) {
+    for (axis=0; axis<snapshots[c]->axes.size(); axis++) {
+      const MD90AxisMetrics &a = snapshots[c]->axes[axis];
+      sample->pollSum += a.pollDuration.sum;
+      sample->pollCount += a.pollDuration.count;
+      sample->recoveries += a.recoveryDuration.count;
+      if (a.recoveryDuration.max > sample->maxRecovery) sample->maxRecovery = a.recoveryDuration.max;
+      if (a.commLostSince > 0. && now - a.commLostSince > sample->lostFor) sample->lostFor = now - a.commLostSince;
+    }
+  }
+  readProcessState(sample);
+}
+
+/** Returns the number of completed moves of an axis from the published metrics */
+static double completedMoves(const MD90SoakAxis &axis)
+{
+  std::vector<std::shared_ptr<const MD90ControllerMetrics> > snapshots = MD90Metrics::snapshots();
+  size_t c;
+
+  for (c=0; c<snapshots.size(); c++) {
+    if (snapshots[c]->portName == axis.pC->portName && (size_t)axis.axisNo < snapshots[c]->axes.size()) {
+      return snapshots[c]->axes[axis.axisNo].moves;
+    }
+  }
+  return 0.;
+}
+
+static void soakThread(void *pPvt)
+{
+  MD90SoakConfig *config = (MD90SoakConfig *)pPvt;
+  MD90SoakSample first, previous, sample;
+  std::mt19937 rng(12345);
+  std::uniform_real_distribution<double> target(-config->amplitude, config->amplitude);
+  double start, now, nextReport, pollMean, firstPollMean = 0., lastPollMean = 0.;
+  double stuckFor = 0.;
+  size_t i;
+  int failures = 0, reports = 0;
+  static const char *functionName = "MD90Soak";
+
+  start = MD90Metrics::now();
+  nextReport = start + config->period;
+  takeSample(&first);
+  previous = first;
+  printf("%s: %d axes, %.0f s, report every %.0f s\n",
+    functionName, (int)config->axes.size(), config->duration, config->period);
+
+  while (1) {
+    now = MD90Metrics::now();
+
+    // Start the next move of each axis whose last move has completed
+    for (i=0; i<config->axes.size() && config->amplitude > 0.; i++) {
+      MD90SoakAxis &axis = config->axes[i];
+      if (completedMoves(axis) < axis.commanded) {
+        if (now - axis.movedAt > stuckFor) stuckFor = now - axis.movedAt;
+        continue;
+      }
+      if (axis.pC->moveAxis(axis.axisNo, floor(target(rng)), SOAK_VELOCITY) == asynSuccess) {
+        axis.commanded = completedMoves(axis) + 1;
+        axis.movedAt = now;
+      }
+    }
+
+    if (now >= nextReport) {
+      takeSample(&sample);
+      pollMean = (sample.pollCount > previous.pollCount) ?
+        (sample.pollSum - previous.pollSum) / (sample.pollCount - previous.pollCount) : 0.;
+      if (reports == 0) {
+        // The first period is the baseline; the IOC has settled by its end
+        firstPollMean = pollMean;
+        first = sample;
+      }
+      lastPollMean = pollMean;
+      reports++;
+      printf("%s: %7.0f s  poll %.2f ms  rss %.1f MB  threads %d  recoveries %.0f (max %.1f s)  stuck %.1f s\n",
+        functionName, now - start, pollMean * 1e3, sample.rssMB, sample.threads,
+        sample.recoveries, sample.maxRecovery, stuckFor);
+      previous = sample;
+      stuckFor = 0.;
+      nextReport += config->period;
+      if (now - start >= config->duration) break;
+    }
+    epicsThreadSleep(0.1);
+  }
+
+  // Compare the end of the run with the baseline
+  if (firstPollMean > 0. && lastPollMean > firstPollMean * config->maxDrift) {
+    printf("%s: FAIL poll duration drifted from %.2f ms to %.2f ms\n",
+      functionName, firstPollMean * 1e3, lastPollMean * 1e3);
+    failures++;
+  }
+  if (first.rssMB >= 0. && sample.rssMB - first.rssMB > config->maxGrowth) {
+    printf("%s: FAIL resident memory grew from %.1f MB to %.1f MB\n",
+      functionName, first.rssMB, sample.rssMB);
+    failures++;
+  }
+  if (first.threads >= 0 && sample.threads > first.threads) {
+    printf("%s: FAIL threads grew from %d to %d\n", functionName, first.threads, sample.threads);
+    failures++;
+  }
+  if (sample.maxRecovery > config->maxRecover || sample.lostFor > config->maxRecover) {
+    printf("%s: FAIL recovery took %.1f s, %.1f s still lost at the end\n",
+      functionName, sample.maxRecovery, sample.lostFor);
+    failures++;
+  }
+  for (i=0; i<config->axes.size(); i++) {
+    if (completedMoves(config->axes[i]) < config->axes[i].commanded &&
+        now - config->axes[i].movedAt > SOAK_STUCK_TIME) {
+      printf("%s: FAIL %s has not finished a move for %.0f s\n",
+        functionName, config->axes[i].name.c_str(), now - config->axes[i].movedAt);
+      failures++;
+    }
+  }
+  printf("%s: %s after %.0f s, %.0f recoveries\n", functionName,
+    failures ? "FAIL" : "PASS", now - start, sample.recoveries);
+
+  if (config->exitWhenDone) epicsExit(failures ? 1 : 0);
+  delete config;
+}
+
+/** Runs a soak test in the background.
+  * Configuration command, called directly or from iocsh.
+  * \param[in] axes        Axes to move, "port" or "port:axis" separated by commas or spaces;
+  *                        empty to only watch the controllers
+  * \param[in] duration    Length of the run (s)
+  * \param[in] period      Time between reports (s); the first period is the baseline
+  * \param[in] amplitude   Moves go to random positions within +/- amplitude (counts)
+  * \param[in] maxDrift    Largest allowed ratio of the last to the first mean poll duration, 0 for 1.5
+  * \param[in] maxGrowth   Largest allowed growth of the resident memory (MB), 0 for 10
+  * \param[in] maxRecover  Longest allowed time to recover a lost connection (s), 0 for 30
+  * \param[in] exitWhenDone  Exit the IOC at the end, with status 1 if the test failed
+  */
+extern "C" int MD90Soak(const char *axes, double duration, double period, double amplitude,
+                        double maxDrift, double maxGrowth, double maxRecover, int exitWhenDone)
+{
+  MD90SoakConfig *config;
+  MD90SoakAxis axis;
+  char *spec, *name, *save;
+  static const char *functionName = "MD90Soak";
+
+  if (duration <= 0. || period <= 0.) {
+    printf("%s: duration and period must be positive\n", functionName);
+    return asynError;
+  }
+  config = new MD90SoakConfig;
+  config->duration = duration;
+  config->period = period;
+  config->amplitude = (amplitude > 0.) ? amplitude : 0.;
+  config->maxDrift = (maxDrift > 0.) ? maxDrift : 1.5;
+  config->maxGrowth = (maxGrowth > 0.) ? maxGrowth : 10.;
+  config->maxRecover = (maxRecover > 0.) ? maxRecover : 30.;
+  config->exitWhenDone = exitWhenDone;
+
+  spec = epicsStrDup(axes ? axes : "");
+  for (name = epicsStrtok_r(spec, ", \t", &save); name; name = epicsStrtok_r(NULL, ", \t", &save)) {
+    axis.name = name;
+    axis.commanded = 0.;
+    axis.movedAt = 0.;
+    axis.pC = MD90Controller::findAxis(functionName, name, &axis.axisNo);
+    if (!axis.pC) break;
+    config->axes.push_back(axis);
+  }
+  free(spec);
+  if (name) {
+    delete config;
+    return asynError;
+  }
+
+  MD90Metrics::startPublishing();
+  epicsThreadCreate("MD90Soak", epicsThreadPriorityLow,
+                    epicsThreadGetStackSize(epicsThreadStackMedium),
+                    (EPICSTHREADFUNC)soakThread, config);
+  return asynSuccess;
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90SoakArg0 = {"Axes to move (port[:axis])", iocshArgString};
+static const iocshArg MD90SoakArg1 = {"Duration (s)", iocshArgDouble};
+static const iocshArg MD90SoakArg2 = {"Report period (s)", iocshArgDouble};
+static const iocshArg MD90SoakArg3 = {"Move amplitude (counts)", iocshArgDouble};
+static const iocshArg MD90SoakArg4 = {"Maximum poll drift ratio", iocshArgDouble};
+static const iocshArg MD90SoakArg5 = {"Maximum memory growth (MB)", iocshArgDouble};
+static const iocshArg MD90SoakArg6 = {"Maximum recovery time (s)", iocshArgDouble};
+static const iocshArg MD90SoakArg7 = {"Exit when done", iocshArgInt};
+static const iocshArg * const MD90SoakArgs[] = {&MD90SoakArg0,
+                                                 &MD90SoakArg1,
+                                                 &MD90SoakArg2,
+                                                 &MD90SoakArg3,
+                                                 &MD90SoakArg4,
+                                                 &MD90SoakArg5,
+                                                 &MD90SoakArg6,
+                                                 &MD90SoakArg7};
+static const iocshFuncDef MD90SoakDef = {"MD90Soak", 8, MD90SoakArgs};
+static void MD90SoakCallFunc(const iocshArgBuf *args)
+{
+  MD90Soak(args[0].sval, args[1].dval, args[2].dval, args[3].dval,
+           args[4].dval, args[5].dval, args[6].dval, args[7].ival);
+}
+
+static void MD90SoakRegister(void)
+{
+  iocshRegister(&MD90SoakDef, MD90SoakCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90SoakRegister);
+}
@@ -0,0 +1,81 @@
+/*
+FILENAME... MD90Threads.cpp
+USAGE...    Scheduling of the DSM MD-90 driver threads and poll jitter measurement.
+
+Each controller has a poller thread, started by asynMotorController, and the
+asyn port threads of the controller and of its serial port, which carry the
+commands from the records.  MD90ThreadConfig sets the scheduling policy,
+priority and CPU affinity of these threads for one or more controllers.  The
+poller thread applies its settings itself at the start of its next cycle.
+Thread scheduling uses POSIX calls and is built from MD90ThreadsPosix.cpp on
+Linux and Darwin; on other targets MD90ThreadsDefault.cpp only reports that it
+is not supported.
+
+The poller waits one poll period after the end of each cycle.  The lateness of
+each poll start against that schedule is published as MD90_POLL_JITTER, with a
+filtered mean and a maximum, so the effect of the settings can be measured.
+
+*/
+
+#include <stdio.h>
+
+#include <iocsh.h>
+
+#include <epicsExport.h>
+#include "MD90Driver.h"
+
+extern "C" int MD90ThreadConfig(const char *ports, const char *threads, const char *policy,
+                                int priority, const char *cpus);
+
+/** Measures how late this poll started against its schedule.  Called by poll().
+  * The poller waits the moving poll period after a cycle in which an axis moved,
+  * else the idle period; it also waits the moving period for a few forced polls
+  * after a wakeup, and a poll well before the moving period was woken early. */
+void MD90Controller::measurePollJitter()
+{
+  double start = MD90Metrics::now();
+  double late;
+  int axis;
+
+  if (pollEnd_ > 0.) {
+    late = start - pollEnd_ - (pollMoving_ ? movingPollPeriod_ : idlePollPeriod_);
+    if (late < -JITTER_EARLY_LIMIT) late = start - pollEnd_ - movingPollPeriod_;
+    if (late >= -JITTER_EARLY_LIMIT) {
+      if (late < 0.) late = 0.;
+      jitterMean_ += JITTER_GAIN * (late - jitterMean_);
+      if (late > jitterMax_) jitterMax_ = late;
+      for (axis=0; axis<numAxes_; axis++) {
+        setDoubleParam(axis, MD90PollJitter_, late);
+        setDoubleParam(axis, MD90PollJitterMean_, jitterMean_);
+        setDoubleParam(axis, MD90PollJitterMax_, jitterMax_);
+      }
+    }
+  }
+  pollMoving_ = false;
+}
+
+/** Code for iocsh registration */
+static const iocshArg MD90ThreadConfigArg0 = {"Port names", iocshArgString};
+static const iocshArg MD90ThreadConfigArg1 = {"Threads (poller, io, all)", iocshArgString};
+static const iocshArg MD90ThreadConfigArg2 = {"Policy (other, fifo, rr)", iocshArgString};
+static const iocshArg MD90ThreadConfigArg3 = {"Priority", iocshArgInt};
+static const iocshArg MD90ThreadConfigArg4 = {"CPUs", iocshArgString};
+static const iocshArg * const MD90ThreadConfigArgs[] = {&MD90ThreadConfigArg0,
+                                                         &MD90ThreadConfigArg1,
+                                                         &MD90ThreadConfigArg2,
+                                                         &MD90ThreadConfigArg3,
+                                                         &MD90ThreadConfigArg4};
+static const iocshFuncDef MD90ThreadConfigDef = {"MD90ThreadConfig", 5, MD90ThreadConfigArgs};
+static void MD90ThreadConfigCallFunc(const iocshArgBuf *args)
+{
+  MD90ThreadConfig(args[0].sval, args[1].sval, args[2].sval, args[3].ival, args[4].sval);
+}
+
+static void MD90ThreadsRegister(void)
+{
+  iocshRegister(&MD90ThreadConfigDef, MD90ThreadConfigCallFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(MD90ThreadsRegister);
+}
@@ -0,0 +1,36 @@
+/*
+FILENAME... MD90ThreadsDefault.cpp
+USAGE...    Scheduling of the DSM MD-90 driver threads on targets without POSIX threads.
+
+Thread scheduling is not supported on these targets.  MD90ThreadConfig prints
+an error, and the threads keep the scheduling they were created with.
+
+*/
+
+#include <stdio.h>
+
+#include "MD90Driver.h"
+
+static const char *driverName = "MD90Threads";
+
+/** Nothing to apply on this target.  Called by poll(). */
+void MD90Controller::applyPollerSettings()
+{
+  pollerSettingsPending_ = false;
+}
+
+/** Thread scheduling is not supported on this target. */
+asynStatus MD90Controller::setThreadSettings(bool poller, bool io, const MD90ThreadSettings &settings)
+{
+  printf("%s: %s: thread scheduling is not supported on this target\n", driverName, portName);
+  return asynError;
+}
+
+/** Configuration command, called directly or from iocsh.
+  * Thread scheduling is not supported on this target. */
+extern "C" int MD90ThreadConfig(const char *ports, const char *threads, const char *policy,
+                                int priority, const char *cpus)
+{
+  printf("MD90ThreadConfig: thread scheduling is not supported on this target\n");
+  return asynError;
+}
@@ -0,0 +1,189 @@
+/*
+FILENAME... MD90ThreadsPosix.cpp
+USAGE...    Scheduling of the DSM MD-90 driver threads on POSIX targets.
+
+Sets the policy and priority of the poller and asyn port threads with
+pthread_setschedparam, and their CPU affinity with pthread_setaffinity_np on
+Linux.  Built on Linux and Darwin only; see MD90Threads.cpp.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+
+#include <epicsThread.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+
+#include "MD90Driver.h"
+
+static const char *driverName = "MD90Threads";
+
+/** Applies scheduling settings to a thread
+  * \param[in] thread    The thread
+  * \param[in] name      Name of the thread for messages
+  * \param[in] settings  Policy, priority and CPUs
+  * \return 0 on success, else an errno value
+  */
+static int applyThreadSettings(pthread_t thread, const char *name, const MD90ThreadSettings &settings)
+{
+  struct sched_param param;
+  int status = 0;
+
+  if (settings.policy >= 0) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = (settings.policy == SCHED_OTHER) ? 0 : settings.priority;
+    status = pthread_setschedparam(thread, settings.policy, &param);
+    if (status) {
+      printf("%s: %s: cannot set policy %d priority %d: %s\n",
+        driverName, name, settings.policy, param.sched_priority, strerror(status));
+      return status;
+    }
+  }
+
+  if (!settings.cpus.empty()) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    char *list, *item, *dash, *save;
+    int first, last, cpu;
+
+    CPU_ZERO(&cpus);
+    list = epicsStrDup(settings.cpus.c_str());
+    for (item = epicsStrtok_r(list, ",", &save); item; item = epicsStrtok_r(NULL, ",", &save)) {
+      first = last = atoi(item);
+      dash = strchr(item, '-');
+      if (dash) last = atoi(dash + 1);
+      for (cpu=first; cpu<=last && cpu<CPU_SETSIZE; cpu++) {
+        if (cpu >= 0) CPU_SET(cpu, &cpus);
+      }
+    }
+    free(list);
+    status = CPU_COUNT(&cpus) ? pthread_setaffinity_np(thread, sizeof(cpus), &cpus) : EINVAL;
+    if (status) {
+      printf("%s: %s: cannot set CPUs \"%s\": %s\n",
+        driverName, name, settings.cpus.c_str(), strerror(status));
+    }
+#else
+    printf("%s: %s: CPU affinity is only supported on Linux\n", driverName, name);
+    status = ENOTSUP;
+#endif
+  }
+  return status;
+}
+
+/** Applies the pending poller settings to the calling thread.  Called by poll(). */
+void MD90Controller::applyPollerSettings()
+{
+  std::string name = std::string(portName) + " poller";
+
+  pollerSettingsPending_ = false;
+  applyThreadSettings(pthread_self(), name.c_str(), pollerSettings_);
+}
+
+/** Sets the scheduling of the threads of this controller.
+  * \param[in] poller    Set the poller thread; applied at the start of its next cycle
+  * \param[in] io        Set the asyn port threads of the controller and its serial port
+  * \param[in] settings  Policy, priority and CPUs
+  */
+asynStatus MD90Controller::setThreadSettings(bool poller, bool io, const MD90ThreadSettings &settings)
+{
+  const char *names[2];
+  epicsThreadId id;
+  int i, status = 0;
+
+  if (io) {
+    names[0] = portName;
+    names[1] = ioPortName_.c_str();
+    for (i=0; i<2; i++) {
+      id = epicsThreadGetId(names[i]);
+      if (!id) {
+        // Ports that cannot block have no thread of their own
+        printf("%s: %s: no thread named %s\n", driverName, portName, names[i]);
+        continue;
+      }
+      if (applyThreadSettings(epicsThreadGetPosixThreadId(id), names[i], settings)) status = -1;
+    }
+  }
+  if (poller) {
+    lock();
+    pollerSettings_ = settings;
+    pollerSettingsPending_ = true;
+    unlock();
+    wakeupPoller();
+  }
+  return status ? asynError : asynSuccess;
+}
+
+/** Parses a scheduling policy name
+  * \return SCHED_OTHER, SCHED_FIFO, SCHED_RR, -1 to keep the current policy, or -2 if unknown */
+static int parsePolicy(const char *policy)
+{
+  if (!policy || !*policy) return -1;
+  if (!epicsStrCaseCmp(policy, "other")) return SCHED_OTHER;
+  if (!epicsStrCaseCmp(policy, "fifo")) return SCHED_FIFO;
+  if (!epicsStrCaseCmp(policy, "rr")) return SCHED_RR;
+  return -2;
+}
+
+/** Sets the scheduling of the threads of one or more controllers.
+  * Configuration command, called directly or from iocsh.  Real time policies need
+  * CAP_SYS_NICE or an rtprio limit for the IOC user.
+  * \param[in] ports     Controller port names, separated by commas or spaces
+  * \param[in] threads   "poller", "io", or "all"
+  * \param[in] policy    "other", "fifo" or "rr"; empty to keep the current policy
+  * \param[in] priority  Priority for "fifo" and "rr" (1-99)
+  * \param[in] cpus      CPUs the threads may run on, e.g. "2-3,6"; empty to keep
+  */
+extern "C" int MD90ThreadConfig(const char *ports, const char *threads, const char *policy,
+                                int priority, const char *cpus)
+{
+  MD90ThreadSettings settings;
+  MD90Controller *pC;
+  char *list, *name, *save;
+  bool poller, io;
+  asynStatus status = asynSuccess;
+  static const char *functionName = "MD90ThreadConfig";
+
+  if (!threads || !epicsStrCaseCmp(threads, "all")) {
+    poller = io = true;
+  } else if (!epicsStrCaseCmp(threads, "poller")) {
+    poller = true;
+    io = false;
+  } else if (!epicsStrCaseCmp(threads, "io")) {
+    poller = false;
+    io = true;
+  } else {
+    printf("%s: threads must be poller, io or all\n", functionName);
+    return asynError;
+  }
+  settings.policy = parsePolicy(policy);
+  if (settings.policy == -2) {
+    printf("%s: policy must be other, fifo or rr\n", functionName);
+    return asynError;
+  }
+  if ((settings.policy == SCHED_FIFO || settings.policy == SCHED_RR) &&
+      (priority < sched_get_priority_min(settings.policy) || priority > sched_get_priority_max(settings.policy))) {
+    printf("%s: priority %d is out of range for %s\n", functionName, priority, policy);
+    return asynError;
+  }
+  settings.priority = priority;
+  settings.cpus = cpus ? cpus : "";
+
+  list = epicsStrDup(ports ? ports : "");
+  for (name = epicsStrtok_r(list, ", \t", &save); name; name = epicsStrtok_r(NULL, ", \t", &save)) {
+    pC = (MD90Controller*) findAsynPortDriver(name);
+    if (!pC) {
+      printf("%s: %s: port not found\n", functionName, name);
+      status = asynError;
+      continue;
+    }
+    if (pC->setThreadSettings(poller, io, settings)) status = asynError;
+  }
+  free(list);
+  return status;
+}
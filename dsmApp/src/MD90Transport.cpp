@@ -0,0 +1,187 @@
+/*
+FILENAME...   MD90Transport.cpp
+USAGE...      Serial and TCP transports to a DSM MD-90 controller, for POSIX hosts.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "MD90Protocol.h"
+#include "MD90Transport.h"
+#include "MD90Sim.h"
+
+MD90FdTransport::MD90FdTransport()
+  : fd_(-1)
+{
+}
+
+MD90FdTransport::~MD90FdTransport()
+{
+  close();
+}
+
+void MD90FdTransport::close()
+{
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+  buffer_.clear();
+}
+
+bool MD90FdTransport::write(const std::string &command)
+{
+  std::string line = command + MD90_EOS;
+  const char *p = line.data();
+  size_t left = line.size();
+  ssize_t n;
+
+  if (fd_ < 0) return false;
+  while (left > 0) {
+    n = ::write(fd_, p, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+bool MD90FdTransport::readReply(std::string *reply, double timeout)
+{
+  struct pollfd pfd;
+  char chunk[256];
+  size_t eos;
+  ssize_t n;
+  int ms = (int)(timeout * 1000.);
+
+  if (fd_ < 0) return false;
+  while ((eos = buffer_.find(MD90_EOS)) == std::string::npos) {
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    n = ::poll(&pfd, 1, ms);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    n = ::read(fd_, chunk, sizeof(chunk));
+    if (n <= 0) return false;
+    buffer_.append(chunk, n);
+  }
+  reply->assign(buffer_, 0, eos);
+  buffer_.erase(0, eos + strlen(MD90_EOS));
+  // Some firmware sends "\r\n"; drop a leading newline left from the previous reply
+  if (!reply->empty() && (*reply)[0] == '\n') reply->erase(0, 1);
+  return true;
+}
+
+void MD90FdTransport::flush()
+{
+  char chunk[256];
+  struct pollfd pfd;
+
+  buffer_.clear();
+  if (fd_ < 0) return;
+  pfd.fd = fd_;
+  pfd.events = POLLIN;
+  while (::poll(&pfd, 1, 0) > 0 && ::read(fd_, chunk, sizeof(chunk)) > 0) {
+  }
+}
+
+MD90SerialTransport::MD90SerialTransport(const std::string &device)
+  : device_(device)
+{
+}
+
+/** Opens the port at 115200 baud, 8 data bits, no parity, 1 stop bit, raw mode */
+bool MD90SerialTransport::open()
+{
+  struct termios tio;
+
+  close();
+  fd_ = ::open(device_.c_str(), O_RDWR | O_NOCTTY);
+  if (fd_ < 0) return false;
+  if (tcgetattr(fd_, &tio) < 0) {
+    close();
+    return false;
+  }
+  cfmakeraw(&tio);
+  cfsetispeed(&tio, B115200);
+  cfsetospeed(&tio, B115200);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  if (tcsetattr(fd_, TCSANOW, &tio) < 0) {
+    close();
+    return false;
+  }
+  tcflush(fd_, TCIOFLUSH);
+  return true;
+}
+
+MD90TcpTransport::MD90TcpTransport(const std::string &host, int port)
+  : host_(host), port_(port)
+{
+}
+
+bool MD90TcpTransport::open()
+{
+  struct addrinfo hints, *result, *rp;
+  char service[16];
+  int one = 1;
+
+  close();
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%d", port_);
+  if (getaddrinfo(host_.c_str(), service, &hints, &result) != 0) return false;
+  for (rp = result; rp; rp = rp->ai_next) {
+    fd_ = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (fd_ < 0) continue;
+    if (connect(fd_, rp->ai_addr, rp->ai_addrlen) == 0) break;
+    ::close(fd_);
+    fd_ = -1;
+  }
+  freeaddrinfo(result);
+  if (fd_ < 0) return false;
+  // Commands are short; send each one at once
+  setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // Notice a terminal server that went away while no command is outstanding
+  setsockopt(fd_, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  return true;
+}
+
+std::string MD90TcpTransport::name() const
+{
+  char buffer[16];
+
+  snprintf(buffer, sizeof(buffer), ":%d", port_);
+  return host_ + buffer;
+}
+
+/** Creates a transport from a specification, without opening it.
+  * "sim" or "sim:<latency ms>" gives a simulated controller, "host:port" a TCP
+  * connection, and anything else is taken as a serial device path. */
+MD90Transport *md90CreateTransport(const char *spec)
+{
+  const char *colon;
+
+  if (strcmp(spec, "sim") == 0) return new MD90SimTransport();
+  if (strncmp(spec, "sim:", 4) == 0) return new MD90SimTransport(atof(spec + 4) / 1000.);
+  colon = strrchr(spec, ':');
+  if (spec[0] != '/' && colon) {
+    return new MD90TcpTransport(std::string(spec, colon - spec), atoi(colon + 1));
+  }
+  return new MD90SerialTransport(spec);
+}
@@ -0,0 +1,68 @@
+/*
+FILENAME...   MD90Transport.h
+USAGE...      Byte transports to a DSM MD-90 controller, independent of EPICS.
+
+*/
+
+#ifndef MD90Transport_H
+#define MD90Transport_H
+
+#include <string>
+
+/** A line-oriented connection to one controller.
+  * Commands and replies are terminated by MD90_EOS; the transport adds and strips it. */
+class MD90Transport {
+public:
+  virtual ~MD90Transport() {}
+  virtual bool open() = 0;
+  virtual void close() = 0;
+  /** Sends one command */
+  virtual bool write(const std::string &command) = 0;
+  /** Waits up to timeout seconds for one reply */
+  virtual bool readReply(std::string *reply, double timeout) = 0;
+  /** Discards any input not read yet */
+  virtual void flush() = 0;
+  virtual std::string name() const = 0;
+};
+
+/** Shared line buffering for transports on a POSIX file descriptor */
+class MD90FdTransport : public MD90Transport {
+public:
+  MD90FdTransport();
+  ~MD90FdTransport();
+  void close();
+  bool write(const std::string &command);
+  bool readReply(std::string *reply, double timeout);
+  void flush();
+
+protected:
+  int fd_;
+  std::string buffer_;          /**< Input received after the last complete reply */
+};
+
+/** A serial port, e.g. "/dev/serial/by-id/usb-FTDI_..." or "/dev/ttyUSB0" */
+class MD90SerialTransport : public MD90FdTransport {
+public:
+  explicit MD90SerialTransport(const std::string &device);
+  bool open();
+  std::string name() const { return device_; }
+
+private:
+  std::string device_;
+};
+
+/** A TCP connection to a terminal server port, "host:port" */
+class MD90TcpTransport : public MD90FdTransport {
+public:
+  MD90TcpTransport(const std::string &host, int port);
+  bool open();
+  std::string name() const;
+
+private:
+  std::string host_;
+  int port_;
+};
+
+MD90Transport *md90CreateTransport(const char *spec);
+
+#endif /* MD90Transport_H */
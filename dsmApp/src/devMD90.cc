@@ -10,6 +10,7 @@
  * .00  02-24-2002      mlr     initialized from devPM304.c
  * .01  05-23-2003      rls     Converted to R3.14.x.
  * .02  02-19-2004      mlr     Bug fix when not sending anything
+ * .03  10-18-2026              MD-90 command set
  */
 
 
@@ -21,6 +22,7 @@
 #include 	"motor.h"
 #include 	"motordevCom.h"
 #include        "drvMD90.h"
+#include        "MD90Protocol.h"
 #include 	"epicsExport.h"
 
 #define STATIC static
@@ -218,42 +220,51 @@ STATIC RTN_STATUS MD90_build_trans(motor_cmnd command, double *parms, struct mot
             break;
     }
 
+    /* One axis per controller, so commands carry no axis number.
+     * Positions are in encoder counts; CLM and CRM take nm. */
     switch (command)
     {
     case MOVE_ABS:
-        sprintf(motor_call->message, "#%02dG%+ld", axis, ival);
+        sprintf(motor_call->message, "CLM %ld", ival * MD90_NM_PER_COUNT);
         break;
     case MOVE_REL:
-        sprintf(motor_call->message, "#%02dI%+ld", axis, ival);
+        sprintf(motor_call->message, "CRM %ld", ival * MD90_NM_PER_COUNT);
         break;
     case HOME_FOR:
-        sprintf(motor_call->message, "#%02dH+", axis);
-        break;
     case HOME_REV:
-        sprintf(motor_call->message, "#%02dH-", axis);
+        /* The MD-90 homes in the direction of the last move, so set it with a
+           small step burst first, as the model 3 driver does.  The driver holds
+           HOM back until the burst has ended. */
+        cntrl->home_state = MD90_HOME_REQUESTED;
+        sprintf(motor_call->message, "SNS %d", MD90_HOME_STEPS);
+        rtnval = motor_end_trans_com(mr, drvtabptr);
+        rtnval = (RTN_STATUS) motor_start_trans_com(mr, MD90_cards);
+        motor_call->type = MD90_table[command];
+        sprintf(motor_call->message, (command == HOME_FOR) ? "ESF" : "ESB");
+        rtnval = motor_end_trans_com(mr, drvtabptr);
+        rtnval = (RTN_STATUS) motor_start_trans_com(mr, MD90_cards);
+        motor_call->type = MD90_table[command];
+        sprintf(motor_call->message, "HOM");
         break;
     case LOAD_POS:
-        sprintf(motor_call->message, "#%02dP=%+ld", axis, ival);
+        /* The encoder position can only be set by homing */
+        send=false;
+        trans->state = IDLE_STATE;
         break;
     case SET_VEL_BASE:
         send=false;
         trans->state = IDLE_STATE;
         break;          /* MD90 does not use base velocity */
     case SET_VELOCITY:
-        ival = (int) (fabs(115200./dval) + 0.5);
-        if (ival < 2) ival=2;
-        if (ival > 255) ival = 255;
-        sprintf(motor_call->message, "#%02dV=%ld", axis, ival);
+        /* dval is velocity in counts/sec, the MD-90 takes a step frequency in Hz */
+        ival = NINT(fabs(dval) / MD90_COUNTS_PER_STEP);
+        if (ival < 1) ival = 1;
+        sprintf(motor_call->message, "SSF %ld", ival);
         break;
     case SET_ACCEL:
-        /* dval is acceleration in steps/sec/sec */
-        /* MD-90 is programmed with Ramp Index (R) where: */
-        /* dval (steps/sec/sec) = 720,000/(256-R) */
-        /* or R=256-(720,000/dval) */
-        ival = (int) (256-(720000./dval)+0.5);
-        if (ival < 1) ival=1;
-        if (ival > 255) ival=255;
-        sprintf(motor_call->message, "#%02dR=%ld", axis, ival);
+        /* The MD-90 steps at a fixed frequency, it has no acceleration setting */
+        send=false;
+        trans->state = IDLE_STATE;
         break;
     case GO:
         /*
@@ -277,23 +288,27 @@ STATIC RTN_STATUS MD90_build_trans(motor_cmnd command, double *parms, struct mot
            of all motors */
         break;
     case STOP_AXIS:
-        sprintf(motor_call->message, "#%02dQ", axis);
+        sprintf(motor_call->message, "STP");
         break;
     case JOG:
-        /* MD-90 does not have jog command. Move 1 million steps */
-        ival = (int) (fabs(115200./dval) + 0.5);
-        if (ival < 2) ival=2;
-        if (ival > 65535) ival = 65535;
-        sprintf(motor_call->message, "#%02dC=%ld", axis, ival);
+        /* MD-90 does not have jog command. Make an open loop move of
+           MD90_JOG_STEPS steps at the jog velocity */
+        ival = NINT(fabs(dval) / MD90_COUNTS_PER_STEP);
+        if (ival < 1) ival = 1;
+        sprintf(motor_call->message, "SSF %ld", ival);
+        rtnval = motor_end_trans_com(mr, drvtabptr);
+        rtnval = (RTN_STATUS) motor_start_trans_com(mr, MD90_cards);
+        motor_call->type = MD90_table[command];
+        sprintf(motor_call->message, "SNS %d", MD90_JOG_STEPS);
         rtnval = motor_end_trans_com(mr, drvtabptr);
         rtnval = (RTN_STATUS) motor_start_trans_com(mr, MD90_cards);
         motor_call->type = MD90_table[command];
         if (dval > 0.) {
             /* This is a positive move in MD90 coordinates */
-            sprintf(motor_call->message, "#%02dM+1000000", axis);
+            sprintf(motor_call->message, "ESF");
         } else {
             /* This is a negative move in MD90 coordinates */
-            sprintf(motor_call->message, "#%02dM-1000000", axis);
+            sprintf(motor_call->message, "ESB");
         }
         break;
     case SET_PGAIN:
@@ -304,11 +319,11 @@ STATIC RTN_STATUS MD90_build_trans(motor_cmnd command, double *parms, struct mot
         break;
 
     case ENABLE_TORQUE:
-        sprintf(motor_call->message, "#%02dW=1", axis);
+        sprintf(motor_call->message, "EPS");
         break;
 
     case DISABL_TORQUE:
-        sprintf(motor_call->message, "#%02dW=0", axis);
+        sprintf(motor_call->message, "DPS");
         break;
 
     case SET_HIGH_LIMIT:
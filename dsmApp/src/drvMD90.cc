@@ -15,6 +15,9 @@
  *                        - added "\" at end of long Debug stmt's for SunPro.
  * .06  09-20-2004   rls  send_mess() argument changed to char * for
  *                        32axis/controller support.
+ * .07  10-18-2026        - MD-90 command set, one axis per controller, and
+ *                          batched STA/GEC/GSF status reads.
+ *                        - HOM is sent once the home direction burst has ended.
  */
 
 
@@ -26,6 +29,7 @@
 #include "motor.h"
 #include "dsmRegister.h"
 #include "drvMD90.h"
+#include "MD90Protocol.h"
 #include "asynOctetSyncIO.h"
 #include "epicsExport.h"
 
@@ -182,10 +186,13 @@ STATIC void start_status(int card)
  * set_status()
  ************************************************************/
 
+/* Status queries, written together and answered in order */
+static const char *status_commands[] = {"STA", "GEC", "GSF"};
+#define NUM_STATUS_COMMANDS (sizeof(status_commands) / sizeof(status_commands[0]))
+
 STATIC int set_status(int card, int signal)
 {
     register struct mess_info *motor_info;
-    char command[BUFF_SIZE];
     char response[BUFF_SIZE];
     struct mess_node *nodeptr;
     int rtn_state;
@@ -193,34 +200,77 @@ STATIC int set_status(int card, int signal)
     char buff[BUFF_SIZE];
     bool ls_active = false;
     msta_field status;
+    MD90Reply replies[NUM_STATUS_COMMANDS];
+    MD90Reply home_reply;
+    struct MD90controller *cntrl;
+    bool comm_err = false;
+    int sta;
+    size_t i;
 
     motor_info = &(motor_state[card]->motor_info[signal]);
     nodeptr = motor_info->motor_motion;
     status.All = motor_info->status.All;
 
-    /* Request the moving status of this motor */
-    sprintf(command, "#%02dX", signal);
-    send_mess(card, command, 0);
-    recv_mess(card, response, WAIT);
-    /* The response string is of the form "#01X=1" */
+    /* Write all status queries before reading the first reply, so that the
+     * axis costs one round trip instead of three */
+    for (i = 0; i < NUM_STATUS_COMMANDS; i++)
+        send_mess(card, status_commands[i], NULL);
+    for (i = 0; i < NUM_STATUS_COMMANDS; i++)
+    {
+        /* The response strings are of the form "0: Current status value: 9" */
+        if (recv_mess(card, response, WAIT) <= 0 || !md90ParseReply(response, &replies[i]))
+        {
+            comm_err = true;
+            break;
+        }
+        if (!replies[i].ok() || !replies[i].hasValue)
+            break;
+    }
+    if (i < NUM_STATUS_COMMANDS)
+    {
+        /* Later replies can no longer be matched to their queries.  Only a missing
+         * or garbled reply is a communication error; a refused query is not. */
+        Debug(1, "set_status: card %d, no valid reply to %s\n", card, status_commands[i]);
+        recv_mess(card, response, FLUSH);
+        status.Bits.CNTRL_COMM_ERR = comm_err ? 1 : 0;
+        status.Bits.RA_PROBLEM = 1;
+        motor_info->status.All = status.All;
+        return (1);
+    }
+    status.Bits.CNTRL_COMM_ERR = 0;
+
+    sta = (int) replies[0].value;
+
+    /* Home once the burst that set the direction has ended */
+    cntrl = (struct MD90controller *) motor_state[card]->DevicePrivate;
+    if (cntrl->home_state == MD90_HOME_WAIT && sta != MD90_STA_MOVING)
+    {
+        cntrl->home_state = MD90_HOME_IDLE;
+        if (!md90IsErrorStatus(sta))
+        {
+            send_mess(card, "HOM", NULL);
+            if (recv_mess(card, response, WAIT) > 0 && md90ParseReply(response, &home_reply) &&
+                home_reply.ok())
+                sta = MD90_STA_MOVING;
+            else
+                Debug(1, "set_status: card %d, HOM refused: %s\n", card, response);
+        }
+    }
+    status.Bits.RA_DONE = (sta == MD90_STA_MOVING) ? 0 : 1;
+    status.Bits.RA_PROBLEM = md90IsErrorStatus(sta) ? 1 : 0;
+    if (status.Bits.RA_PROBLEM)
+        Debug(1, "set_status: card %d, %s\n", card, md90StatusName(sta));
 
-    status.Bits.RA_DONE = (response[5] == '1') ? 0 : 1;
+    motorData = (long) replies[1].value;
 
-    /* Request the limit status of this motor */
-    sprintf(command, "#%02dE", signal);
-    send_mess(card, command, 0);
-    recv_mess(card, response, WAIT);
-    /* The response string is of the form "#01E=1" */
+    /* The MD-90 has no limit switches; an end of travel error stands in for them */
     status.Bits.RA_PLUS_LS = 0;
     status.Bits.RA_MINUS_LS = 0;
-    if (response[5] == '1') {
-        status.Bits.RA_PLUS_LS = 1;
-        status.Bits.RA_DIRECTION = 1;
-        ls_active = true;
-    }
-    if (response[6] == '1') {
-        status.Bits.RA_MINUS_LS = 1;
-        status.Bits.RA_DIRECTION = 0;
+    if (sta == MD90_STA_END_OF_TRAVEL) {
+        if (motorData > 0)
+            status.Bits.RA_PLUS_LS = 1;
+        else
+            status.Bits.RA_MINUS_LS = 1;
         ls_active = true;
     }
 
@@ -230,13 +280,6 @@ STATIC int set_status(int card, int signal)
     status.Bits.EA_SLIP_STALL = 0;
     status.Bits.EA_HOME       = 0;
 
-    /* Request the position of this motor */
-    sprintf(command, "#%02dP", signal);
-    send_mess(card, command, 0);
-    recv_mess(card, response, WAIT);
-    /* The response string is of the form "#01P=+1000" */
-    motorData = atoi(&response[5]);
-
     if (motorData == motor_info->position)
     {
         if (nodeptr != 0)   /* Increment counter only if motor is moving. */
@@ -250,10 +293,11 @@ STATIC int set_status(int card, int signal)
         motor_info->no_motion_count = 0;
     }
 
-    /* Parse motor velocity? */
-    /* NEEDS WORK */
-
-    motor_info->velocity = 0;
+    /* The step frequency times the nominal counts per step, while moving */
+    if (status.Bits.RA_DONE)
+        motor_info->velocity = 0;
+    else
+        motor_info->velocity = (int) (replies[2].value * MD90_COUNTS_PER_STEP);
 
     if (!status.Bits.RA_DIRECTION)
         motor_info->velocity *= -1;
@@ -274,7 +318,7 @@ STATIC int set_status(int card, int signal)
     return (rtn_state);
 }
 
-
+
 /*****************************************************/
 /* send a message to the MD90 board                 */
 /* send_mess()                                       */
@@ -295,6 +339,16 @@ STATIC RTN_STATUS send_mess(int card, const char *com, const char *name)
     if (strlen(com) == 0) return(OK);
     cntrl = (struct MD90controller *) motor_state[card]->DevicePrivate;
 
+    /* The controller refuses HOM while the direction burst runs, so
+     * set_status() sends it once STA shows the burst has ended */
+    if (cntrl->home_state == MD90_HOME_REQUESTED && strcmp(com, "HOM") == 0)
+    {
+        cntrl->home_state = MD90_HOME_WAIT;
+        return (OK);
+    }
+    if (strcmp(com, "STP") == 0)
+        cntrl->home_state = MD90_HOME_IDLE;
+
     Debug(2, "send_mess: sending message to card %d, message=%s\n",\
                      card, com);
 
@@ -415,6 +469,7 @@ MD90Config(int card,           /* card being configured */
     motor_state[card]->DevicePrivate = malloc(sizeof(struct MD90controller));
     cntrl = (struct MD90controller *) motor_state[card]->DevicePrivate;
     strcpy(cntrl->port, name);
+    cntrl->home_state = MD90_HOME_IDLE;
     return (OK);
 }
 
@@ -469,7 +524,7 @@ STATIC int motor_init()
             pasynOctetSyncIO->flush(cntrl->pasynUser);
             do
             {
-                send_mess(card_index, "#00X", 0);
+                send_mess(card_index, "STA", 0);
                 status = recv_mess(card_index, buff, WAIT);
                 retry++;
                 /* Return value is length of response string */
@@ -483,20 +538,17 @@ STATIC int motor_init()
             brdptr->motor_in_motion = 0;
             brdptr->cmnd_response = true;
 
-            /* Assume that this controller has 4 axes. */
-            total_axis = 4;
+            /* Each MD-90 drives one axis */
+            total_axis = MD90_NUM_CHANNELS;
             brdptr->total_axis = total_axis;
             start_status(card_index);
             for (motor_index = 0; motor_index < total_axis; motor_index++)
             {
                 struct mess_info *motor_info = &brdptr->motor_info[motor_index];
                 brdptr->motor_info[motor_index].motor_motion = NULL;
-                /* Don't turn on motor power, too dangerous */
-                sprintf(buff,"#%02dW=1", motor_index);
-                /* send_mess(card_index, buff, 0); */
+                /* Don't turn on motor power (EPS), too dangerous */
                 /* Stop motor */
-                sprintf(buff,"#%02dQ", motor_index);
-                send_mess(card_index, buff, 0);
+                send_mess(card_index, "STP", 0);
                 recv_mess(card_index, buff, WAIT);    /* Throw away response */
                 strcpy(brdptr->ident, "MD-90");
                 motor_info->status.All = 0;
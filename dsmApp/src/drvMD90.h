@@ -10,6 +10,7 @@
  * Modification Log:
  * -----------------
  * .01  02/24/2002  mlr  initialized from drvPM304.h
+ * .02  10/18/2026       MD-90 has one axis per controller
  */
 
 #ifndef	INCdrvMD90h
@@ -21,14 +22,25 @@
 /* MD90 default profile. */
 
 #define MD90_NUM_CARDS           4
-#define MD90_NUM_CHANNELS        4
+#define MD90_NUM_CHANNELS        1
+
+#define MD90_JOG_STEPS           6000    /* Number of steps in an open loop jog */
+#define MD90_HOME_STEPS          5       /* Number of steps that set the home direction */
 
 #define OUTPUT_TERMINATOR "\r"
 
+/* HOM is held back until the burst that sets the home direction has ended */
+enum MD90HomeState {
+    MD90_HOME_IDLE,        /* No home in progress */
+    MD90_HOME_REQUESTED,   /* Device support queued SNS, ESF/ESB and HOM */
+    MD90_HOME_WAIT         /* HOM was held back by send_mess(), set_status() sends it */
+};
+
 struct MD90controller
 {
     asynUser *pasynUser;   /* asynUser structure */
     char port[80];   /* asyn port name */
+    volatile int home_state;    /* One of MD90HomeState */
 };
 
 #endif	/* INCdrvMD90h */
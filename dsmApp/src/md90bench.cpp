@@ -0,0 +1,122 @@
+/*
+FILENAME...   md90bench.cpp
+USAGE...      Measures command round trip time and throughput to a DSM MD-90 controller.
+
+    md90bench [-n count] [-d depth] [-c command] [-t timeout] target
+
+target is a serial device ("/dev/serial/by-id/..."), a terminal server port
+("host:port"), or "sim[:latency ms]" for the built-in simulated controller.
+The round trip time is measured one command at a time; the throughput is
+measured with up to <depth> commands pipelined.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "MD90Protocol.h"
+#include "MD90Transport.h"
+#include "MD90Client.h"
+
+static double seconds()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+    "Usage: %s [-n count] [-d depth] [-c command] [-t timeout] target\n"
+    "  -n count    Number of commands in each test (default 1000)\n"
+    "  -d depth    Pipeline depth of the throughput test (default 4)\n"
+    "  -c command  Command to send (default STA)\n"
+    "  -t timeout  Reply timeout in seconds (default 1)\n"
+    "  target      Serial device, host:port, or sim[:latency ms]\n",
+    program);
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<double> rtt;
+  std::vector<std::string> batch;
+  std::vector<MD90Reply> replies;
+  MD90Reply reply;
+  const char *command = "STA";
+  double timeout = MD90_CLIENT_TIMEOUT;
+  double start, elapsed, sum = 0.;
+  int count = 1000, depth = 4;
+  int i, opt, errors = 0;
+
+  while ((opt = getopt(argc, argv, "n:d:c:t:h")) != -1) {
+    switch (opt) {
+      case 'n': count = atoi(optarg); break;
+      case 'd': depth = atoi(optarg); break;
+      case 'c': command = optarg; break;
+      case 't': timeout = atof(optarg); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || count < 1 || depth < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // A controller that drops the connection fails its commands instead of ending the tool
+  signal(SIGPIPE, SIG_IGN);
+
+  MD90Client client(md90CreateTransport(argv[optind]), 1, timeout);
+  if (!client.start()) {
+    fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[optind]);
+    return 1;
+  }
+  reply = client.request(command);
+  if (reply.code == MD90_REPLY_NONE) {
+    fprintf(stderr, "%s: no reply to %s from %s\n", argv[0], command, client.transport()->name().c_str());
+    return 1;
+  }
+  printf("%s: %s -> \"%s\"\n", client.transport()->name().c_str(), command, reply.text.c_str());
+
+  // Round trip time, one command at a time
+  for (i=0; i<count; i++) {
+    start = seconds();
+    reply = client.request(command);
+    elapsed = seconds() - start;
+    if (reply.code == MD90_REPLY_NONE) {
+      errors++;
+      continue;
+    }
+    rtt.push_back(elapsed);
+    sum += elapsed;
+  }
+  if (!rtt.empty()) {
+    std::sort(rtt.begin(), rtt.end());
+    printf("round trip:  %d commands, min %.3f ms, mean %.3f ms, p99 %.3f ms, max %.3f ms\n",
+      (int)rtt.size(), rtt.front() * 1e3, sum / rtt.size() * 1e3,
+      rtt[(size_t)((rtt.size() - 1) * 0.99)] * 1e3, rtt.back() * 1e3);
+  }
+
+  // Throughput with pipelining
+  client.setPipelineDepth(depth);
+  batch.assign(count, command);
+  start = seconds();
+  replies = client.sendBatch(batch).get();
+  elapsed = seconds() - start;
+  for (i=0; i<(int)replies.size(); i++) {
+    if (replies[i].code == MD90_REPLY_NONE) errors++;
+  }
+  printf("throughput:  %d commands at depth %d in %.3f s, %.1f commands/s\n",
+    count, depth, elapsed, count / elapsed);
+
+  if (errors) printf("errors:      %d commands without a reply\n", errors);
+  client.stop();
+  return errors ? 2 : 0;
+}
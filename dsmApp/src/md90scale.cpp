@@ -0,0 +1,184 @@
+/*
+FILENAME...   md90scale.cpp
+USAGE...      Measures poll rate and latency as the number of MD-90 controllers grows.
+
+    md90scale [-n controllers] [-P period ms] [-d duration s] [-t timeout] host:port
+
+Controller i is reached at port + i, e.g. ports of a terminal server or of
+md90simserver.  For 1, 2, 4, ... up to <controllers> controllers, one thread per
+controller runs the poll cycle of the EPICS driver (GPS, GHS, STA, GEC, GSF,
+GGN, GPM) every <period> for <duration>, as the driver's poller threads do.
+Each step prints the achieved poll rate, the poll cycle time and the command
+round trip time, so the point where the host, the network or the terminal
+servers saturate can be seen.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MD90Protocol.h"
+#include "MD90Transport.h"
+#include "MD90Client.h"
+
+// Commands of one axis poll of the EPICS driver, outside streaming mode
+static const char *pollCommands[] = {"GPS", "GHS", "STA", "GEC", "GSF", "GGN", "GPM"};
+#define NUM_POLL_COMMANDS (int)(sizeof(pollCommands) / sizeof(pollCommands[0]))
+
+/** Results of one controller's poll loop */
+struct PollStats {
+  std::vector<double> cycles;   /**< Duration of each poll cycle (s) */
+  std::vector<double> rtt;      /**< Round trip time of each command (s) */
+  int late;                     /**< Cycles that took longer than the poll period */
+  int errors;                   /**< Commands without a reply */
+};
+
+static double seconds()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double percentile(std::vector<double> &values, double fraction)
+{
+  if (values.empty()) return 0.;
+  std::sort(values.begin(), values.end());
+  return values[(size_t)((values.size() - 1) * fraction)];
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+    "Usage: %s [-n controllers] [-P period] [-d duration] [-t timeout] host:port\n"
+    "  -n controllers  Largest number of controllers, at ports port to port+n-1 (default 64)\n"
+    "  -P period       Poll period in ms (default 100)\n"
+    "  -d duration     Time spent at each number of controllers in s (default 10)\n"
+    "  -t timeout      Reply timeout in s (default 1)\n",
+    program);
+}
+
+/** Polls one controller until stop is set, as a driver poller thread would */
+static void pollLoop(MD90Client *client, double period, std::atomic<bool> *stop, PollStats *stats)
+{
+  MD90Reply reply;
+  double cycleStart, start, next;
+  int i;
+
+  next = seconds();
+  while (!*stop) {
+    cycleStart = seconds();
+    for (i=0; i<NUM_POLL_COMMANDS; i++) {
+      start = seconds();
+      reply = client->request(pollCommands[i]);
+      if (reply.code == MD90_REPLY_NONE) {
+        stats->errors++;
+      } else {
+        stats->rtt.push_back(seconds() - start);
+      }
+    }
+    stats->cycles.push_back(seconds() - cycleStart);
+    if (stats->cycles.back() > period) stats->late++;
+    next += period;
+    if (next < seconds()) next = seconds();
+    std::this_thread::sleep_for(std::chrono::duration<double>(next - seconds()));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::unique_ptr<MD90Client> > clients;
+  std::string host;
+  const char *colon;
+  double period = 0.1, duration = 10., timeout = MD90_CLIENT_TIMEOUT;
+  double start, elapsed;
+  int maxControllers = 64, basePort, count, i, opt, failed = 0;
+
+  while ((opt = getopt(argc, argv, "n:P:d:t:h")) != -1) {
+    switch (opt) {
+      case 'n': maxControllers = atoi(optarg); break;
+      case 'P': period = atof(optarg) / 1e3; break;
+      case 'd': duration = atof(optarg); break;
+      case 't': timeout = atof(optarg); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || maxControllers < 1 || period <= 0. || duration <= 0.) {
+    usage(argv[0]);
+    return 1;
+  }
+  colon = strrchr(argv[optind], ':');
+  if (!colon) {
+    usage(argv[0]);
+    return 1;
+  }
+  host.assign(argv[optind], colon - argv[optind]);
+  basePort = atoi(colon + 1);
+
+  // A controller that drops the connection fails its commands instead of ending the tool
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i=0; i<maxControllers; i++) {
+    clients.push_back(std::unique_ptr<MD90Client>(
+      new MD90Client(new MD90TcpTransport(host, basePort + i), 1, timeout)));
+    if (!clients.back()->start()) {
+      fprintf(stderr, "%s: cannot connect to %s\n", argv[0], clients.back()->transport()->name().c_str());
+      return 1;
+    }
+  }
+
+  printf("controllers  polls/s  per ctrl  cycle mean  cycle p99  rtt mean  rtt p99  late  errors\n");
+  for (count=1; ; count = std::min(count * 2, maxControllers)) {
+    std::vector<PollStats> stats(count);
+    std::vector<std::thread> threads;
+    std::vector<double> cycles, rtt;
+    std::atomic<bool> stop(false);
+    double cycleSum = 0., rttSum = 0.;
+    int late = 0, errors = 0;
+
+    for (i=0; i<count; i++) {
+      stats[i].late = stats[i].errors = 0;
+    }
+    start = seconds();
+    for (i=0; i<count; i++) {
+      threads.push_back(std::thread(pollLoop, clients[i].get(), period, &stop, &stats[i]));
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+    stop = true;
+    for (i=0; i<count; i++) {
+      threads[i].join();
+    }
+    elapsed = seconds() - start;
+
+    for (i=0; i<count; i++) {
+      cycles.insert(cycles.end(), stats[i].cycles.begin(), stats[i].cycles.end());
+      rtt.insert(rtt.end(), stats[i].rtt.begin(), stats[i].rtt.end());
+      late += stats[i].late;
+      errors += stats[i].errors;
+    }
+    for (i=0; i<(int)cycles.size(); i++) cycleSum += cycles[i];
+    for (i=0; i<(int)rtt.size(); i++) rttSum += rtt[i];
+    printf("%11d  %7.1f  %8.2f  %8.2f ms  %6.2f ms  %5.2f ms  %4.2f ms  %4d  %6d\n",
+      count, cycles.size() / elapsed, cycles.size() / elapsed / count,
+      cycles.empty() ? 0. : cycleSum / cycles.size() * 1e3, percentile(cycles, 0.99) * 1e3,
+      rtt.empty() ? 0. : rttSum / rtt.size() * 1e3, percentile(rtt, 0.99) * 1e3, late, errors);
+    fflush(stdout);
+    if (errors) failed = 1;
+    if (count == maxControllers) break;
+  }
+
+  for (i=0; i<(int)clients.size(); i++) {
+    clients[i]->stop();
+  }
+  return failed ? 2 : 0;
+}
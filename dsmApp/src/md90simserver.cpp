@@ -0,0 +1,298 @@
+/*
+FILENAME...   md90simserver.cpp
+USAGE...      Serves simulated DSM MD-90 controllers on TCP ports, with injected faults.
+
+    md90simserver [-n controllers] [-p port] [-l latency ms] [-D drop] [-T truncate]
+                  [-G garbage] [-S spike] [-s spike ms] [-X disconnect s] [-x down s]
+                  [-r seed]
+
+Controller i listens on port + i and answers like an MD-90 on a terminal server
+port, so an IOC can drive it with drvAsynIPPortConfigure.  Each reply is dropped,
+truncated, preceded by garbage bytes or delayed by a latency spike with the given
+probabilities.  With -X, each connection is closed after a random time with the
+given mean, and the controller does not answer for -x seconds afterwards, as if
+the link had gone down.  The simulated stage keeps its state across connections.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <deque>
+#include <vector>
+
+#include "MD90Protocol.h"
+#include "MD90Sim.h"
+
+#define SERVER_READ_SIZE  256     // Bytes read from a connection at a time
+#define SERVER_TICK       0.001   // Longest wait between checks for due replies (s)
+
+/** Fault probabilities and timings */
+struct Faults {
+  double drop;                  /**< Probability that a reply is not sent */
+  double truncate;              /**< Probability that a reply is cut short */
+  double garbage;               /**< Probability that random bytes precede a reply */
+  double spike;                 /**< Probability that a reply is delayed by spikeTime */
+  double spikeTime;             /**< Extra delay of a latency spike (s) */
+  double disconnect;            /**< Mean time between disconnects (s), 0 for none */
+  double downTime;              /**< Time without answers after a disconnect (s) */
+};
+
+struct Reply {
+  std::string bytes;            /**< Reply including the terminator */
+  double due;                   /**< Time the reply is sent */
+};
+
+/** One simulated controller and its connection */
+struct Station {
+  MD90SimController controller;
+  int listenFd;
+  int clientFd;
+  std::string input;            /**< Received bytes after the last complete command */
+  std::deque<Reply> replies;
+  double lastDue;
+  double disconnectAt;          /**< Time to close the connection */
+  double downUntil;             /**< No connection is accepted before this time */
+  unsigned long commands;
+  unsigned long faults;
+  unsigned long disconnects;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+  stopRequested = 1;
+}
+
+static double seconds()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr,
+    "Usage: %s [-n controllers] [-p port] [-l latency] [-D drop] [-T truncate] [-G garbage]\n"
+    "          [-S spike] [-s spike time] [-X disconnect] [-x down time] [-r seed]\n"
+    "  -n controllers  Number of controllers (default 1)\n"
+    "  -p port         TCP port of the first controller (default 5000)\n"
+    "  -l latency      Reply latency in ms (default 2)\n"
+    "  -D drop         Probability that a reply is dropped (default 0)\n"
+    "  -T truncate     Probability that a reply is truncated (default 0)\n"
+    "  -G garbage      Probability that garbage bytes precede a reply (default 0)\n"
+    "  -S spike        Probability of a latency spike (default 0)\n"
+    "  -s spike time   Latency spike in ms (default 500)\n"
+    "  -X disconnect   Mean time between disconnects in s, 0 for none (default 0)\n"
+    "  -x down time    Time without answers after a disconnect in s (default 5)\n"
+    "  -r seed         Random seed (default from the clock)\n",
+    program);
+}
+
+static int listenOn(int port)
+{
+  struct sockaddr_in addr;
+  int fd, on = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<Station> stations;
+  std::vector<struct pollfd> fds;
+  std::vector<int> owners;
+  std::mt19937 rng;
+  std::uniform_real_distribution<double> uniform(0., 1.);
+  Faults faults = {0., 0., 0., 0., 0.5, 0., 5.};
+  Reply reply;
+  char buffer[SERVER_READ_SIZE];
+  double latency = MD90_SIM_LATENCY;
+  double t, lineTime;
+  unsigned seed = (unsigned)time(NULL);
+  size_t eos, i, j, k;
+  int numStations = 1, basePort = 5000;
+  int opt, fd, n, on = 1;
+
+  while ((opt = getopt(argc, argv, "n:p:l:D:T:G:S:s:X:x:r:h")) != -1) {
+    switch (opt) {
+      case 'n': numStations = atoi(optarg); break;
+      case 'p': basePort = atoi(optarg); break;
+      case 'l': latency = atof(optarg) / 1e3; break;
+      case 'D': faults.drop = atof(optarg); break;
+      case 'T': faults.truncate = atof(optarg); break;
+      case 'G': faults.garbage = atof(optarg); break;
+      case 'S': faults.spike = atof(optarg); break;
+      case 's': faults.spikeTime = atof(optarg) / 1e3; break;
+      case 'X': faults.disconnect = atof(optarg); break;
+      case 'x': faults.downTime = atof(optarg); break;
+      case 'r': seed = (unsigned)strtoul(optarg, NULL, 0); break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc || numStations < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  rng.seed(seed);
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  stations.resize(numStations);
+  for (i=0; i<stations.size(); i++) {
+    stations[i].listenFd = listenOn(basePort + (int)i);
+    if (stations[i].listenFd < 0) {
+      fprintf(stderr, "%s: cannot listen on port %d: %s\n", argv[0], basePort + (int)i, strerror(errno));
+      return 1;
+    }
+    stations[i].clientFd = -1;
+    stations[i].lastDue = 0.;
+    stations[i].disconnectAt = 0.;
+    stations[i].downUntil = 0.;
+    stations[i].commands = stations[i].faults = stations[i].disconnects = 0;
+  }
+  printf("%s: %d controller(s) on ports %d-%d, seed %u\n",
+    argv[0], numStations, basePort, basePort + numStations - 1, seed);
+  fflush(stdout);
+
+  while (!stopRequested) {
+    t = seconds();
+
+    // Send the replies that are due, and close connections whose time is up
+    for (i=0; i<stations.size(); i++) {
+      Station &s = stations[i];
+      if (s.clientFd < 0) continue;
+      if (s.disconnectAt > 0. && t >= s.disconnectAt) {
+        close(s.clientFd);
+        s.clientFd = -1;
+        s.replies.clear();
+        s.input.clear();
+        s.downUntil = t + faults.downTime;
+        s.disconnects++;
+        continue;
+      }
+      while (!s.replies.empty() && s.replies.front().due <= t) {
+        if (send(s.clientFd, s.replies.front().bytes.data(), s.replies.front().bytes.size(), 0) < 0) break;
+        s.replies.pop_front();
+      }
+    }
+
+    // Wait for commands and connections
+    fds.clear();
+    owners.clear();
+    for (i=0; i<stations.size(); i++) {
+      struct pollfd p;
+      if (stations[i].clientFd >= 0) {
+        p.fd = stations[i].clientFd;
+      } else if (t >= stations[i].downUntil) {
+        p.fd = stations[i].listenFd;
+      } else {
+        continue;
+      }
+      p.events = POLLIN;
+      p.revents = 0;
+      fds.push_back(p);
+      owners.push_back((int)i);
+    }
+    if (poll(fds.empty() ? NULL : &fds[0], fds.size(), (int)(SERVER_TICK * 1e3)) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return 1;
+    }
+
+    t = seconds();
+    for (k=0; k<fds.size(); k++) {
+      Station &s = stations[owners[k]];
+      if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+      if (fds[k].fd == s.listenFd) {
+        fd = accept(s.listenFd, NULL, NULL);
+        if (fd < 0) continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        s.clientFd = fd;
+        s.input.clear();
+        s.replies.clear();
+        s.lastDue = t;
+        s.disconnectAt = (faults.disconnect > 0.) ?
+          t - faults.disconnect * log(1. - uniform(rng)) : 0.;
+        continue;
+      }
+
+      n = recv(s.clientFd, buffer, sizeof(buffer), 0);
+      if (n <= 0) {
+        close(s.clientFd);
+        s.clientFd = -1;
+        continue;
+      }
+      s.input.append(buffer, n);
+      while ((eos = s.input.find(MD90_EOS)) != std::string::npos) {
+        std::string command = s.input.substr(0, eos);
+        s.input.erase(0, eos + strlen(MD90_EOS));
+        if (command.empty()) continue;
+        s.commands++;
+
+        reply.bytes = s.controller.execute(command);
+        reply.due = ((t + latency > s.lastDue) ? t + latency : s.lastDue);
+        if (uniform(rng) < faults.drop) {
+          s.faults++;
+          continue;
+        }
+        if (uniform(rng) < faults.truncate && reply.bytes.size() > 1) {
+          reply.bytes.resize(1 + rng() % (reply.bytes.size() - 1));
+          s.faults++;
+        }
+        if (uniform(rng) < faults.garbage) {
+          std::string garbage(1 + rng() % 16, '\0');
+          for (j=0; j<garbage.size(); j++) garbage[j] = (char)(rng() % 256);
+          reply.bytes = garbage + reply.bytes;
+          s.faults++;
+        }
+        if (uniform(rng) < faults.spike) {
+          reply.due += faults.spikeTime;
+          s.faults++;
+        }
+        reply.bytes += MD90_EOS;
+        // Replies share the line and go out in order
+        lineTime = reply.bytes.size() * MD90_SIM_CHAR_TIME;
+        reply.due += lineTime;
+        s.lastDue = reply.due;
+        s.replies.push_back(reply);
+      }
+    }
+  }
+
+  for (i=0; i<stations.size(); i++) {
+    printf("port %d: %lu commands, %lu faults, %lu disconnects\n", basePort + (int)i,
+      stations[i].commands, stations[i].faults, stations[i].disconnects);
+    if (stations[i].clientFd >= 0) close(stations[i].clientFd);
+    close(stations[i].listenFd);
+  }
+  return 0;
+}